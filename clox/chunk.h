@@ -29,7 +29,11 @@ typedef enum {
     OP_GET_PROPERTY,
     OP_SET_PROPERTY,
     OP_GET_SUPER,
+    OP_BUILD_LIST,
+    OP_GET_INDEX,
+    OP_SET_INDEX,
     OP_EQUAL,
+    OP_NOT_EQUAL, // only made by the optimizer, from OP_EQUAL, OP_NOT
     OP_GREATER,
     OP_LESS,
     OP_ADD,
@@ -38,11 +42,32 @@ typedef enum {
     OP_DIVIDE,
     OP_NOT,
     OP_NEGATE,
+    // the same, for operands clox -O has proved are numbers (see specializeNumbers in passes.c), so they don't check
+    OP_GREATER_NUMBER,
+    OP_LESS_NUMBER,
+    OP_ADD_NUMBER,
+    OP_SUBTRACT_NUMBER,
+    OP_MULTIPLY_NUMBER,
+    OP_DIVIDE_NUMBER,
+    OP_NEGATE_NUMBER,
     OP_PRINT,
     OP_JUMP,
     OP_JUMP_IF_FALSE,
+    OP_JUMP_IF_TRUE,
+    // these pop the condition whichever way they go
+    OP_POP_JUMP_IF_FALSE,
+    OP_POP_JUMP_IF_TRUE,
+    // these compare the top two values, pop them, and jump on the result
+    OP_JUMP_IF_EQUAL,
+    OP_JUMP_IF_NOT_EQUAL,
+    OP_JUMP_IF_GREATER,
+    OP_JUMP_IF_NOT_GREATER,
+    OP_JUMP_IF_LESS,
+    OP_JUMP_IF_NOT_LESS,
     OP_LOOP,
+    OP_FOR_LOOP, // the bottom of a counted for loop (see CountedLoop in compiler.c)
     OP_CALL,
+    OP_TAIL_CALL, // a call whose result is returned straight away, which reuses the caller's frame
     OP_INVOKE,
     OP_SUPER_INVOKE,
     OP_CLOSURE,
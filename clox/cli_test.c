@@ -0,0 +1,312 @@
+/* Tests for the clox command line that the .lox integration tests can't reach, since those run scripts
+ * in a VM of their own rather than through the clox binary.
+ *
+ * Usage: cliTests clox clox-client
+ *
+ * Each test writes its scripts into a fresh temporary directory, runs clox (or clox-client) on them as a child process
+ * with stdout and stderr going to temporary files, and checks what came out along with the exit status.
+ * The server tests start a `clox --serve` of their own on a socket in that directory.
+ */
+
+#define _GNU_SOURCE // mkdtemp
+
+#include <dirent.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PATH_MAX_LENGTH 4096
+
+static const char* cloxPath;
+static const char* clientPath;
+static int failed = 0;
+
+typedef struct {
+    int status; // the exit status, or -1 if it didn't exit normally
+    char* out;
+    char* err;
+} RunResult;
+
+static void freeRunResult(RunResult* result) {
+    free(result->out);
+    free(result->err);
+}
+
+static char* readAll(FILE* file) {
+    fseek(file, 0L, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+    char* buffer = malloc(size + 1);
+    if (buffer == NULL) exit(1);
+    size_t got = fread(buffer, sizeof(char), size, file);
+    buffer[got] = '\0';
+    return buffer;
+}
+
+// Runs argv (argv[0] being the path of the program) to completion
+static RunResult runCommand(const char* argv[]) {
+    FILE* out = tmpfile();
+    FILE* err = tmpfile();
+    if (out == NULL || err == NULL) {
+        perror("tmpfile");
+        exit(1);
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(fileno(out), STDOUT_FILENO);
+        dup2(fileno(err), STDERR_FILENO);
+        execv(argv[0], (char* const*)argv);
+        _exit(127);
+    }
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+
+    RunResult result;
+    result.status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    result.out = readAll(out);
+    result.err = readAll(err);
+    fclose(out);
+    fclose(err);
+    return result;
+}
+
+static void makeTempDir(char* path) {
+    const char* tmp = getenv("TMPDIR");
+    snprintf(path, PATH_MAX_LENGTH, "%s/cloxtest.XXXXXX", tmp != NULL ? tmp : "/tmp");
+    if (mkdtemp(path) == NULL) {
+        perror("mkdtemp");
+        exit(1);
+    }
+}
+
+static void writeScript(const char* dir, const char* name, const char* source) {
+    char path[PATH_MAX_LENGTH];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        perror(path);
+        exit(1);
+    }
+    fputs(source, file);
+    fclose(file);
+}
+
+// Tests only ever write files straight into their directory
+static void removeTempDir(const char* dir) {
+    DIR* dirp = opendir(dir);
+    if (dirp == NULL) return;
+    struct dirent* entry;
+    while ((entry = readdir(dirp)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        char path[PATH_MAX_LENGTH];
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        unlink(path);
+    }
+    closedir(dirp);
+    rmdir(dir);
+}
+
+static void check(const char* test, bool passed, const char* what, RunResult* result) {
+    if (passed) return;
+    failed++;
+    printf("[  FAILED ] %s: %s\n  status: %d\n  stdout:\n%s\n  stderr:\n%s\n",
+           test, what, result->status, result->out, result->err);
+}
+
+// Scripts that finish out of order still have their output printed in sorted path order, each script's all together
+static void testBatchOrder(void) {
+    const char* test = "batch output order";
+    int failedBefore = failed;
+    char dir[PATH_MAX_LENGTH];
+    makeTempDir(dir);
+
+    // the earlier scripts spin longer, so they tend to finish last
+    char name[32];
+    char source[256];
+    for (int i = 0; i < 8; i++) {
+        snprintf(name, sizeof(name), "script%d.lox", i);
+        snprintf(source, sizeof(source),
+                 "for (var i = 0; i < %d; i = i + 1) {}\nprint \"%d a\";\nprint \"%d b\";\n", (8 - i) * 20000, i, i);
+        writeScript(dir, name, source);
+    }
+    writeScript(dir, "silent.lox", "var quiet = true;\n");
+
+    const char* argv[] = {cloxPath, "--jobs", "3", dir, NULL};
+    RunResult result = runCommand(argv);
+    check(test, result.status == 0, "exit status should be 0", &result);
+    check(test, strcmp(result.out, "0 a\n0 b\n1 a\n1 b\n2 a\n2 b\n3 a\n3 b\n4 a\n4 b\n"
+                                   "5 a\n5 b\n6 a\n6 b\n7 a\n7 b\n") == 0, "unexpected stdout", &result);
+    check(test, result.err[0] == '\0', "stderr should be empty", &result);
+    freeRunResult(&result);
+
+    removeTempDir(dir);
+    if (failed == failedBefore) printf("[      OK ] %s\n", test);
+}
+
+// The exit status is the one `clox path` would have given for the first failing script: 65 or 70
+static void testBatchExitStatus(void) {
+    const char* test = "batch exit status";
+    int failedBefore = failed;
+    char dir[PATH_MAX_LENGTH];
+    makeTempDir(dir);
+
+    writeScript(dir, "a.lox", "print \"a\";\n");
+    writeScript(dir, "b.lox", "print \"before\";\nnil();\nprint \"after\";\n");
+    writeScript(dir, "c.lox", "print;\n");
+    writeScript(dir, "d.lox", "print \"d\";\n");
+
+    const char* runtimeFirst[] = {cloxPath, "--jobs", "2", dir, NULL};
+    RunResult result = runCommand(runtimeFirst);
+    check(test, result.status == 70, "a runtime error first should exit with 70", &result);
+    check(test, strcmp(result.out, "a\nbefore\nd\n") == 0, "unexpected stdout", &result);
+    check(test, strstr(result.err, "Can only call functions and classes.") != NULL, "missing runtime error", &result);
+    check(test, strstr(result.err, "Error at ';': Expect expression.") != NULL, "missing compile error", &result);
+    freeRunResult(&result);
+
+    // the same scripts, with the compile error given first
+    char compileError[PATH_MAX_LENGTH + 8];
+    char runtimeError[PATH_MAX_LENGTH + 8];
+    snprintf(compileError, sizeof(compileError), "%s/c.lox", dir);
+    snprintf(runtimeError, sizeof(runtimeError), "%s/b.lox", dir);
+    const char* compileFirst[] = {cloxPath, "--jobs", "2", compileError, runtimeError, NULL};
+    result = runCommand(compileFirst);
+    check(test, result.status == 65, "a compile error first should exit with 65", &result);
+    check(test, strcmp(result.out, "before\n") == 0, "unexpected stdout", &result);
+    freeRunResult(&result);
+
+    removeTempDir(dir);
+    if (failed == failedBefore) printf("[      OK ] %s\n", test);
+}
+
+// Starts `clox --serve socket --jobs 2` and waits for it to be listening. Returns its pid, or -1 if it never was.
+static pid_t startServer(const char* socketPath) {
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == 0) {
+        const char* argv[] = {cloxPath, "--serve", socketPath, "--jobs", "2", NULL};
+        execv(argv[0], (char* const*)argv);
+        _exit(127);
+    }
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+
+    // the socket shows up at bind(), a moment before listen(), so runClient retries connecting as well
+    struct timespec pause = {0, 10 * 1000 * 1000};
+    for (int i = 0; i < 500; i++) {
+        struct stat info;
+        if (stat(socketPath, &info) == 0 && S_ISSOCK(info.st_mode)) return pid;
+        nanosleep(&pause, NULL);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+static void stopServer(pid_t pid) {
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
+static RunResult runClient(const char* socketPath, const char* scriptPath) {
+    const char* argv[] = {clientPath, socketPath, scriptPath, NULL};
+    RunResult result = runCommand(argv);
+    // the server accepts as soon as it's listening, which may be a moment after the socket shows up
+    for (int i = 0; i < 100 && result.status == 74 && strstr(result.err, "Could not connect") != NULL; i++) {
+        struct timespec pause = {0, 10 * 1000 * 1000};
+        nanosleep(&pause, NULL);
+        freeRunResult(&result);
+        result = runCommand(argv);
+    }
+    return result;
+}
+
+// Output reaches the client's own stdout and stderr (which it passes to the server over the socket), the client exits
+// with the status `clox path` would have, and a script edited between runs is recompiled, however quickly it changed
+static void testServer(void) {
+    const char* test = "server";
+    int failedBefore = failed;
+    char dir[PATH_MAX_LENGTH];
+    makeTempDir(dir);
+
+    char socketPath[PATH_MAX_LENGTH + 8];
+    char scriptPath[PATH_MAX_LENGTH + 16];
+    snprintf(socketPath, sizeof(socketPath), "%s/sock", dir);
+    snprintf(scriptPath, sizeof(scriptPath), "%s/script.lox", dir);
+
+    pid_t server = startServer(socketPath);
+    if (server < 0) {
+        failed++;
+        printf("[  FAILED ] %s: the server never started listening\n", test);
+        removeTempDir(dir);
+        return;
+    }
+
+    // the same size each time, and all well within a second, so only the contents tell the versions apart
+    char source[32];
+    char expected[32];
+    for (int i = 1; i <= 5; i++) {
+        snprintf(source, sizeof(source), "print %d;\n", i);
+        snprintf(expected, sizeof(expected), "%d\n", i);
+        writeScript(dir, "script.lox", source);
+        RunResult result = runClient(socketPath, scriptPath);
+        check(test, result.status == 0, "exit status should be 0", &result);
+        check(test, strcmp(result.out, expected) == 0, "an edited script should print its new output", &result);
+        freeRunResult(&result);
+    }
+
+    writeScript(dir, "script.lox", "print \"before\";\nnil();\n");
+    RunResult result = runClient(socketPath, scriptPath);
+    check(test, result.status == 70, "a runtime error should exit with 70", &result);
+    check(test, strcmp(result.out, "before\n") == 0, "unexpected stdout", &result);
+    check(test, strstr(result.err, "Can only call functions and classes.") != NULL, "missing runtime error", &result);
+    freeRunResult(&result);
+
+    writeScript(dir, "script.lox", "print;\n");
+    result = runClient(socketPath, scriptPath);
+    check(test, result.status == 65, "a compile error should exit with 65", &result);
+    check(test, strstr(result.err, "Error at ';': Expect expression.") != NULL, "missing compile error", &result);
+    freeRunResult(&result);
+
+    // a worker's VM must be clean again after a script that failed
+    writeScript(dir, "script.lox", "print \"again\";\n");
+    result = runClient(socketPath, scriptPath);
+    check(test, result.status == 0 && strcmp(result.out, "again\n") == 0, "the server should recover", &result);
+    freeRunResult(&result);
+
+    stopServer(server);
+    removeTempDir(dir);
+    if (failed == failedBefore) printf("[      OK ] %s\n", test);
+}
+
+int main(int argc, const char* argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: cliTests clox clox-client\n");
+        return 64;
+    }
+    cloxPath = argv[1];
+    clientPath = argv[2];
+
+    testBatchOrder();
+    testBatchExitStatus();
+    testServer();
+
+    printf("\n%s\n", failed == 0 ? "All CLI tests passed." : "Some CLI tests failed.");
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,137 @@
+//
+// clox-client: runs a script on a `clox --serve` server instead of starting a VM of its own.
+// The script's output goes straight to this process's stdout and stderr, and it exits with the status `clox path` would have.
+//
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "server.h"
+
+static char* readStdin(size_t* length) {
+    size_t capacity = 4096;
+    *length = 0;
+    char* buffer = malloc(capacity);
+    if (buffer == NULL) exit(74);
+
+    size_t got;
+    while ((got = fread(buffer + *length, 1, capacity - *length, stdin)) > 0) {
+        *length += got;
+        if (*length == capacity) {
+            capacity *= 2;
+            buffer = realloc(buffer, capacity);
+            if (buffer == NULL) exit(74);
+        }
+    }
+    return buffer;
+}
+
+static void writeFully(int fd, const char* buffer, size_t length) {
+    while (length > 0) {
+        ssize_t wrote = write(fd, buffer, length);
+        if (wrote <= 0) {
+            perror("clox-client: write");
+            exit(74);
+        }
+        buffer += wrote;
+        length -= wrote;
+    }
+}
+
+// Sends the header, with our stdout and stderr riding along as SCM_RIGHTS
+static void sendHeader(int fd, char kind, uint32_t length) {
+    char header[SERVE_HEADER_SIZE] = {
+            kind, (char)(length >> 24), (char)(length >> 16), (char)(length >> 8), (char)length
+    };
+    struct iovec iov = {header, SERVE_HEADER_SIZE};
+    union {
+        char buffer[CMSG_SPACE(sizeof(int) * 2)];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * 2);
+    int fds[2] = {STDOUT_FILENO, STDERR_FILENO};
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(fd, &message, 0) != SERVE_HEADER_SIZE) {
+        perror("clox-client: sendmsg");
+        exit(74);
+    }
+}
+
+int main(int argc, const char* argv[]) {
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "Usage: clox-client socket [path]   (reads the script from stdin if no path is given)\n");
+        exit(64);
+    }
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(argv[1]) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path \"%s\" is too long.\n", argv[1]);
+        exit(64);
+    }
+    strcpy(address.sun_path, argv[1]);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        fprintf(stderr, "Could not connect to \"%s\".\n", argv[1]);
+        exit(74);
+    }
+
+    char kind;
+    char* payload;
+    size_t length;
+    if (argc == 3) {
+        // the server has its own working directory, so send it a path it can't misread
+        char resolved[PATH_MAX];
+        if (realpath(argv[2], resolved) == NULL) {
+            fprintf(stderr, "Could not open file \"%s\".\n", argv[2]);
+            exit(74);
+        }
+        kind = SERVE_PATH;
+        payload = strdup(resolved);
+        length = strlen(payload);
+    } else {
+        kind = SERVE_SOURCE;
+        payload = readStdin(&length);
+    }
+    if (length > UINT32_MAX) {
+        fprintf(stderr, "Script is too large.\n");
+        exit(74);
+    }
+
+    // anything we've buffered has to come out before the server starts writing to the same fds
+    fflush(stdout);
+    fflush(stderr);
+
+    sendHeader(fd, kind, (uint32_t)length);
+    writeFully(fd, payload, length);
+    free(payload);
+
+    unsigned char status;
+    if (read(fd, &status, 1) != 1) {
+        fprintf(stderr, "The server hung up without finishing the script.\n");
+        exit(70);
+    }
+    close(fd);
+    return status;
+}
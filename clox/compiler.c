@@ -2,29 +2,18 @@
 // Created by Rita Bennett-Chew on 2/2/24.
 //
 
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "compiler.h"
 #include "common.h"
+#include "debug.h"
 #include "memory.h"
+#include "optimizer.h"
 #include "scanner.h"
 
-#ifdef DEBUG_PRINT_CODE
-#include "debug.h"
-#endif
-
-typedef struct {
-    Token current;
-    Token previous;
-    bool hadError; // did any errors occur during compilation?
-
-    // if in panicMode, suppress any other errors that get detected, but keep compiling
-    // panic mode ends when parser reaches a synchronization point (a statement boundary in Lox)
-    bool panicMode;
-} Parser;
-
 // ie, a call has a higher precedence than a unary
 typedef enum {
     PREC_NONE,
@@ -40,7 +29,9 @@ typedef enum {
     PREC_PRIMARY
 } Precedence;
 
-typedef void (*ParseFn)(VM* vm, bool canAssign);
+typedef struct Parser Parser;
+
+typedef void (*ParseFn)(Parser* parser, bool canAssign);
 
 /* In the rules table,
  * each row is a ParseRule.
@@ -102,158 +93,240 @@ typedef struct Compiler {
 
     // the number of blocks surrounding the current bit of code we're compiling
     int scopeDepth;
-
-    VM* vm;
 } Compiler;
 
+// What the compiler knows about the value of the expression it compiled last, so that whatever uses that value can
+// fold it away. It only describes the code at the very end of the chunk: emitting anything else resets it, and so does
+// patching a jump to land after it, since then the code at the end isn't all there is to the expression.
+typedef enum {
+    EXPR_UNKNOWN,
+    EXPR_CONSTANT, // a single instruction loading value, starting at start
+    EXPR_NUMBER,   // produces a number, unless it raises an error first
+    EXPR_BOOL,     // produces a bool, unless it raises an error first
+    EXPR_COMPARISON, // a bool from a comparison operator, whose instructions start at start
+    EXPR_CALL,     // the result of an OP_CALL at start
+} ExprKind;
+
+typedef struct {
+    ExprKind kind;
+    int start;
+    Value value;
+} ExprInfo;
+
 typedef struct ClassCompiler {
     struct ClassCompiler* enclosing;
     bool hasSuperclass;
 } ClassCompiler;
 
-Parser parser;
-Compiler* current = NULL; // this global variable isn't the best solution, especially if we were running in a multi-threaded app with multiple compilers running in parallel
-ClassCompiler* currentClass = NULL;
+// All the state for a single compilation: the scanner, the tokens, error flags and the
+// function/class currently being compiled. compile() keeps it on its own C stack and passes it
+// down explicitly, so any number of threads can compile different sources (into different VMs) at once.
+struct Parser {
+    Scanner scanner;
+    Token current;
+    Token previous;
+    bool hadError; // did any errors occur during compilation?
+
+    // if in panicMode, suppress any other errors that get detected, but keep compiling
+    // panic mode ends when parser reaches a synchronization point (a statement boundary in Lox)
+    bool panicMode;
+
+    // the innermost function being compiled, the head of the linked list of enclosing Compilers
+    Compiler* compiler;
+    ClassCompiler* currentClass;
+
+    ExprInfo lastExpr;
+
+    VM* vm;
+};
 
 // returns the address of the chunk owned by the function we're compiling atm
-static Chunk* currentChunk() {
-    return &current->function->chunk;
+static Chunk* currentChunk(Parser* parser) {
+    return &parser->compiler->function->chunk;
 }
 
-static void errorAt(VM* vm, Token* token, const char* message) {
-    if (parser.panicMode) return;
-    parser.panicMode = true;
-    fprintf(vm->ferr, "[line %d] Error", token->line);
+static void errorAt(Parser* parser, Token* token, const char* message) {
+    if (parser->panicMode) return;
+    parser->panicMode = true;
+    fprintf(parser->vm->ferr, "[line %d] Error", token->line);
 
     if (token->type == TOKEN_EOF) {
-        fprintf(vm->ferr, " at end");
+        fprintf(parser->vm->ferr, " at end");
     } else if (token->type == TOKEN_ERROR) {
         // Nothing.
     } else {
-        fprintf(vm->ferr, " at '%.*s'", token->length, token->start);
+        fprintf(parser->vm->ferr, " at '%.*s'", token->length, token->start);
     }
 
-    fprintf(vm->ferr, ": %s\n", message);
-    parser.hadError = true;
+    fprintf(parser->vm->ferr, ": %s\n", message);
+    parser->hadError = true;
 }
 
-static void error(VM* vm, const char* message) {
-    errorAt(vm, &parser.previous, message);
+static void error(Parser* parser, const char* message) {
+    errorAt(parser, &parser->previous, message);
 }
 
-static void errorAtCurrent(VM* vm, const char* message) {
-    errorAt(vm, &parser.current, message);
+static void errorAtCurrent(Parser* parser, const char* message) {
+    errorAt(parser, &parser->current, message);
 }
 
-static void advance(VM* vm) {
-    parser.previous = parser.current;
+static void advance(Parser* parser) {
+    parser->previous = parser->current;
 
     // keep looping and reporting errors
     for (;;) {
-        parser.current = scanToken();
-        if (parser.current.type != TOKEN_ERROR) break;
+        parser->current = scanToken(&parser->scanner);
+        if (parser->current.type != TOKEN_ERROR) break;
 
-        errorAtCurrent(vm, parser.current.start);
+        errorAtCurrent(parser, parser->current.start);
     }
 }
 
 // advances, but also validates whether the token has an expected type
-static void consume(VM* vm, TokenType type, const char* message) {
-    if (parser.current.type == type) {
-        advance(vm);
+static void consume(Parser* parser, TokenType type, const char* message) {
+    if (parser->current.type == type) {
+        advance(parser);
         return;
     }
 
-    errorAtCurrent(vm, message);
+    errorAtCurrent(parser, message);
 }
 
-static bool check(TokenType type) {
-    return parser.current.type == type;
+static bool check(Parser* parser, TokenType type) {
+    return parser->current.type == type;
 }
 
-static bool match(VM* vm, TokenType type) {
-    if (!check(type)) return false;
-    advance(vm);
+static bool match(Parser* parser, TokenType type) {
+    if (!check(parser, type)) return false;
+    advance(parser);
     return true;
 }
 
-static void emitByte(VM* vm, uint8_t byte) {
-    writeChunk(vm, currentChunk(), byte, parser.previous.line);
+static void emitByte(Parser* parser, uint8_t byte) {
+    writeChunk(parser->vm, currentChunk(parser), byte, parser->previous.line);
+    parser->lastExpr.kind = EXPR_UNKNOWN;
 }
 
-static void emitBytes(VM* vm, uint8_t byte1, uint8_t byte2) {
-    emitByte(vm, byte1);
-    emitByte(vm, byte2);
+static void emitBytes(Parser* parser, uint8_t byte1, uint8_t byte2) {
+    emitByte(parser, byte1);
+    emitByte(parser, byte2);
 }
 
-static void emitLoop(VM* vm, int loopStart) {
-    emitByte(vm, OP_LOOP);
+static void emitLoop(Parser* parser, int loopStart) {
+    emitByte(parser, OP_LOOP);
 
-    int offset = currentChunk()->count - loopStart + 2;
-    if (offset > UINT16_MAX) error(vm, "Loop body too large.");
+    int offset = currentChunk(parser)->count - loopStart + 2;
+    if (offset > UINT16_MAX) error(parser, "Loop body too large.");
 
-    emitByte(vm, (offset >> 8) & 0xff);
-    emitByte(vm, offset & 0xff);
+    emitByte(parser, (offset >> 8) & 0xff);
+    emitByte(parser, offset & 0xff);
 }
 
-static int emitJump(VM* vm, uint8_t instruction) {
-    emitByte(vm, instruction); // we'll return the offset of this instr
-    emitByte(vm, 0xff);
-    emitByte(vm, 0xff);
-    return currentChunk()->count-2;
+static int emitJump(Parser* parser, uint8_t instruction) {
+    emitByte(parser, instruction); // we'll return the offset of this instr
+    emitByte(parser, 0xff);
+    emitByte(parser, 0xff);
+    return currentChunk(parser)->count-2;
 }
 
-static void emitReturn(VM* vm) {
-    if (current->type == TYPE_INITIALIZER) {
-        emitBytes(vm, OP_GET_LOCAL, 0);
+static void emitReturn(Parser* parser) {
+    if (parser->compiler->type == TYPE_INITIALIZER) {
+        emitBytes(parser, OP_GET_LOCAL, 0);
     } else {
-        emitByte(vm, OP_NIL);
+        emitByte(parser, OP_NIL);
     }
-    emitByte(vm, OP_RETURN);
+    emitByte(parser, OP_RETURN);
 }
 
-static uint8_t makeConstant(VM* vm, Value value) {
-    int constant = addConstant(vm, currentChunk(), value);
+static uint8_t makeConstant(Parser* parser, Value value) {
+    int constant = addConstant(parser->vm, currentChunk(parser), value);
     if (constant > UINT8_MAX) {
-        error(vm, "Too many constants in one chunk.");
+        error(parser, "Too many constants in one chunk.");
         return 0;
     }
 
     return (uint8_t)constant;
 }
 
-static void emitConstant(VM* vm, Value value) {
-    emitBytes(vm, OP_CONSTANT, makeConstant(vm, value));
+static void emitConstant(Parser* parser, Value value) {
+    emitBytes(parser, OP_CONSTANT, makeConstant(parser, value));
+}
+
+// Loads a constant value, with nil, true and false getting their own instructions
+static void emitValue(Parser* parser, Value value) {
+    int start = currentChunk(parser)->count;
+    if (IS_NIL(value)) {
+        emitByte(parser, OP_NIL);
+    } else if (IS_BOOL(value)) {
+        emitByte(parser, AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    } else {
+        emitConstant(parser, value);
+    }
+    parser->lastExpr = (ExprInfo){EXPR_CONSTANT, start, value};
+}
+
+// Takes back the instruction emitValue emitted at start (which is the last one in the chunk), along with its constant
+// if nothing was added to the constant table after it
+static void discardValue(Parser* parser, int start) {
+    Chunk* chunk = currentChunk(parser);
+    if (chunk->code[start] == OP_CONSTANT && chunk->code[start + 1] == chunk->constants.count - 1) {
+        chunk->constants.count--;
+    }
+    chunk->count = start;
 }
 
-static void patchJump(VM* vm, int offset) {
+static void patchJump(Parser* parser, int offset) {
     // -2 to adjust for the bytecode for the jump offset itself
-    int jump = currentChunk()->count - offset - 2;
+    int jump = currentChunk(parser)->count - offset - 2;
 
     if (jump > UINT16_MAX) {
-        error(vm, "Too much code to jump over.");
+        error(parser, "Too much code to jump over.");
     }
 
     // replaces the temp op code bytes with the jumped amount
-    currentChunk()->code[offset] = (jump >> 8) & 0xff;
-    currentChunk()->code[offset+1] = jump & 0xff;
+    currentChunk(parser)->code[offset] = (jump >> 8) & 0xff;
+    currentChunk(parser)->code[offset+1] = jump & 0xff;
+    parser->lastExpr.kind = EXPR_UNKNOWN;
+}
+
+// Emits the jump for a statement's condition, which jumps if the condition is false and pops it either way.
+// A comparison gets fused into the jump, so the bool it would have pushed never exists.
+static int emitConditionJump(Parser* parser) {
+    ExprInfo condition = parser->lastExpr;
+    if (condition.kind != EXPR_COMPARISON) return emitJump(parser, OP_POP_JUMP_IF_FALSE);
+
+    Chunk* chunk = currentChunk(parser);
+    // `!=`, `>=` and `<=` are the opposite comparison followed by an OP_NOT
+    bool negated = chunk->count - condition.start == 2;
+    uint8_t jump;
+    switch (chunk->code[condition.start]) {
+        case OP_EQUAL:   jump = negated ? OP_JUMP_IF_EQUAL : OP_JUMP_IF_NOT_EQUAL; break;
+        case OP_GREATER: jump = negated ? OP_JUMP_IF_GREATER : OP_JUMP_IF_NOT_GREATER; break;
+        default:         jump = negated ? OP_JUMP_IF_LESS : OP_JUMP_IF_NOT_LESS; break;
+    }
+
+    // a type error is reported on the comparison's line
+    int line = chunk->lines[condition.start];
+    chunk->count = condition.start;
+    int offset = emitJump(parser, jump);
+    for (int i = offset - 1; i < offset + 2; i++) chunk->lines[i] = line;
+    return offset;
 }
 
-static void initCompiler(Compiler* compiler, FunctionType type, VM* vm) {
-    compiler->enclosing = current;
+static void initCompiler(Parser* parser, Compiler* compiler, FunctionType type) {
+    compiler->enclosing = parser->compiler;
     compiler->function = NULL;
     compiler->type = type;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
-    compiler->function = newFunction(vm);
-    compiler->vm = vm;
-    current = compiler;
+    compiler->function = newFunction(parser->vm);
+    parser->compiler = compiler;
     if (type != TYPE_SCRIPT) {
-        current->function->name = copyString(vm, parser.previous.start, parser.previous.length);
+        parser->compiler->function->name = copyString(parser->vm, parser->previous.start, parser->previous.length);
     }
 
     // compiler implicitly claims stack slot zero for the VM's own internal use
-    Local* local = &current->locals[current->localCount++];
+    Local* local = &parser->compiler->locals[parser->compiler->localCount++];
     local->depth = 0;
     local->isCaptured = false;
     if (type != TYPE_FUNCTION) {
@@ -265,46 +338,62 @@ static void initCompiler(Compiler* compiler, FunctionType type, VM* vm) {
     }
 }
 
-static ObjFunction* endCompiler(VM* vm) {
-    emitReturn(vm);
-    ObjFunction* function = current->function;
+// For --disassemble
+static void printCode(Parser* parser, const char* stage) {
+    ObjFunction* function = parser->compiler->function;
+    char name[128];
+    snprintf(name, sizeof(name), "%s (%s)", function->name != NULL ? function->name->chars : "<script>", stage);
+    // the script's own output so far comes first
+    flushOutput(&parser->vm->out);
+    disassembleChunk(currentChunk(parser), name);
+}
+
+static ObjFunction* endCompiler(Parser* parser) {
+    emitReturn(parser);
+    ObjFunction* function = parser->compiler->function;
+
+    if (!parser->hadError) {
+        if (parser->vm->disassemble) printCode(parser, "as compiled");
+        optimizeFunction(parser->vm, function, parser->vm->optimize);
+        if (parser->vm->disassemble) printCode(parser, "optimized");
+    }
 
 #ifdef DEBUG_PRINT_CODE
-    if (!parser.hadError) {
-        disassembleChunk(currentChunk(), function->name != NULL ? function->name->chars : "<script>");
+    if (!parser->hadError) {
+        disassembleChunk(currentChunk(parser), function->name != NULL ? function->name->chars : "<script>");
     }
 #endif
 
-    current = current->enclosing;
+    parser->compiler = parser->compiler->enclosing;
     return function;
 }
 
 // called before/after compiling the body of a block
-static void beginScope() {
-    current->scopeDepth++;
+static void beginScope(Parser* parser) {
+    parser->compiler->scopeDepth++;
 }
-static void endScope(VM* vm) {
-    current->scopeDepth--;
+static void endScope(Parser* parser) {
+    parser->compiler->scopeDepth--;
 
-    while (current->localCount > 0 && current->locals[current->localCount-1].depth > current->scopeDepth) {
-        if (current->locals[current->localCount - 1].isCaptured) {
-            emitByte(vm, OP_CLOSE_UPVALUE);
+    while (parser->compiler->localCount > 0 && parser->compiler->locals[parser->compiler->localCount-1].depth > parser->compiler->scopeDepth) {
+        if (parser->compiler->locals[parser->compiler->localCount - 1].isCaptured) {
+            emitByte(parser, OP_CLOSE_UPVALUE);
         } else {
-            emitByte(vm, OP_POP);
+            emitByte(parser, OP_POP);
         }
-        current->localCount--;
+        parser->compiler->localCount--;
     }
 }
 
 
-static void expression(VM* vm);
-static void statement(VM* vm);
-static void declaration(VM* vm);
+static void expression(Parser* parser);
+static void statement(Parser* parser);
+static void declaration(Parser* parser);
 static ParseRule* getRule(TokenType type);
-static void parsePrecedence(VM* vm, Precedence precedence);
+static void parsePrecedence(Parser* parser, Precedence precedence);
 
-static uint8_t identifierConstant(VM* vm, Token* name) {
-    return makeConstant(vm, OBJ_VAL(copyString(current->vm, name->start, name->length)));
+static uint8_t identifierConstant(Parser* parser, Token* name) {
+    return makeConstant(parser, OBJ_VAL(copyString(parser->vm, name->start, name->length)));
 }
 
 static bool identifiersEqual(Token* a, Token* b) {
@@ -312,7 +401,7 @@ static bool identifiersEqual(Token* a, Token* b) {
     return memcmp(a->start, b->start, a->length) == 0;
 }
 
-static int resolveLocal(VM* vm, Compiler* compiler, Token* name) {
+static int resolveLocal(Parser* parser, Compiler* compiler, Token* name) {
     for (int i = compiler->localCount - 1; i >= 0; i--) {
         Local* local = &compiler->locals[i];
         if (identifiersEqual(name, &local->name)) {
@@ -321,7 +410,7 @@ static int resolveLocal(VM* vm, Compiler* compiler, Token* name) {
                     { var a = "outer";
                         { var a = a; }}
                  */
-                error(vm, "Can't read local variable in its own initializer.");
+                error(parser, "Can't read local variable in its own initializer.");
             }
             return i;
         }
@@ -330,7 +419,7 @@ static int resolveLocal(VM* vm, Compiler* compiler, Token* name) {
 }
 
 // Upvalues used for closures
-static int addUpvalue(VM* vm, Compiler* compiler, uint8_t index, bool isLocal) {
+static int addUpvalue(Parser* parser, Compiler* compiler, uint8_t index, bool isLocal) {
     int upvalueCount = compiler->function->upvalueCount;
 
     // reuse upvalue index if we find an upvalue in the array whose slot index matches the one we're adding
@@ -342,7 +431,7 @@ static int addUpvalue(VM* vm, Compiler* compiler, uint8_t index, bool isLocal) {
     }
 
     if (upvalueCount == UINT8_COUNT) {
-        error(vm, "Too many closure variables in function.");
+        error(parser, "Too many closure variables in function.");
         return 0;
     }
 
@@ -354,31 +443,31 @@ static int addUpvalue(VM* vm, Compiler* compiler, uint8_t index, bool isLocal) {
 // looks for a local variable with name declared in any of the surrounding functions.
 // If found, it returns an upvalue index for that variable
 // if not, returns -1
-// only called when we know the variable isn't in the current compiler
-static int resolveUpvalue(VM* vm, Compiler* compiler, Token* name) {
+// only called when we know the variable isn't in the parser->compiler compiler
+static int resolveUpvalue(Parser* parser, Compiler* compiler, Token* name) {
     if (compiler->enclosing == NULL) return -1;
 
-    int local = resolveLocal(vm, compiler->enclosing, name);
+    int local = resolveLocal(parser, compiler->enclosing, name);
     if (local != -1) {
         compiler->enclosing->locals[local].isCaptured = true;
-        return addUpvalue(vm, compiler, (uint8_t)local, true);
+        return addUpvalue(parser, compiler, (uint8_t)local, true);
     }
 
-    int upvalue = resolveUpvalue(vm, compiler->enclosing, name);
+    int upvalue = resolveUpvalue(parser, compiler->enclosing, name);
     if (upvalue != -1) {
-        return addUpvalue(vm, compiler, (uint8_t)upvalue, false);
+        return addUpvalue(parser, compiler, (uint8_t)upvalue, false);
     }
 
     return -1;
 }
 
-static void addLocal(VM* vm, Token name) {
-    if (current->localCount == UINT8_COUNT) {
-        error(vm, "Too many local variables in function.");
+static void addLocal(Parser* parser, Token name) {
+    if (parser->compiler->localCount == UINT8_COUNT) {
+        error(parser, "Too many local variables in function.");
         return;
     }
 
-    Local* local = &current->locals[current->localCount++];
+    Local* local = &parser->compiler->locals[parser->compiler->localCount++];
     local->name = name;
     local->depth = -1; // indicate the variable is 'declared' but 'uninitialized'
     local->isCaptured = false;
@@ -386,140 +475,137 @@ static void addLocal(VM* vm, Token name) {
 
 // the function which tells the compiler to record the existence of the variable
 // only do this for locals, since global variables are late bound
-static void declareVariable(VM* vm) {
-    if (current->scopeDepth == 0) return;
+static void declareVariable(Parser* parser) {
+    if (parser->compiler->scopeDepth == 0) return;
 
-    Token* name = &parser.previous;
+    Token* name = &parser->previous;
 
     // disallow declaring multiple vars in same scope w/same name. Shadowing (same name, different scope) is okay
     // work backwards, since new vars are declared at the end of the array.
-    for (int i = current->localCount - 1; i >= 0; i--) {
-        Local* local = &current->locals[i];
-        if (local->depth != -1 && local->depth < current->scopeDepth) {
+    for (int i = parser->compiler->localCount - 1; i >= 0; i--) {
+        Local* local = &parser->compiler->locals[i];
+        if (local->depth != -1 && local->depth < parser->compiler->scopeDepth) {
             break;
         }
 
         if (identifiersEqual(name, &local->name)) {
-            error(vm, "Already a variable with this name in this scope.");
+            error(parser, "Already a variable with this name in this scope.");
         }
     }
 
-    addLocal(vm, *name);
+    addLocal(parser, *name);
 }
 
 // consumes the identifier token for the variable name
 // if global: adds its lexeme to the chunk's constant table
 // if global: returns the constant table index where it was added
 // if local: returns 0 (dummy table index)
-static uint8_t parseVariable(VM* vm, const char* errorMessage) {
-    consume(vm, TOKEN_IDENTIFIER, errorMessage);
+static uint8_t parseVariable(Parser* parser, const char* errorMessage) {
+    consume(parser, TOKEN_IDENTIFIER, errorMessage);
 
-    declareVariable(vm);
+    declareVariable(parser);
 
     // if the variable is local, exit.
     // We don't store local variable identifiers in the constant table
-    if (current->scopeDepth > 0) return 0;
-    return identifierConstant(vm, &parser.previous);
+    if (parser->compiler->scopeDepth > 0) return 0;
+    return identifierConstant(parser, &parser->previous);
 }
 
 // mark the local as avaiable to use (depth was currently -1)
-static void markInitialized() {
-    if (current->scopeDepth == 0) return;
-    current->locals[current->localCount-1].depth = current->scopeDepth;
+static void markInitialized(Parser* parser) {
+    if (parser->compiler->scopeDepth == 0) return;
+    parser->compiler->locals[parser->compiler->localCount-1].depth = parser->compiler->scopeDepth;
 }
 
 // called when declaring a variable (by varDeclaration()) at runtime
 // this function is called at runtime
 // the VM's state has already init'ed the variable (with the var's initializer or the implicit nil
 // the value sitting on top of the stack is the temporary, and "becomes" the local variable
-static void defineVariable(VM* vm, uint8_t global) {
-    if (current->scopeDepth > 0) {
-        markInitialized();
+static void defineVariable(Parser* parser, uint8_t global) {
+    if (parser->compiler->scopeDepth > 0) {
+        markInitialized(parser);
         // at runtime, don't create a local variable
         return;
     }
 
-    emitBytes(vm, OP_DEFINE_GLOBAL, global);
+    emitBytes(parser, OP_DEFINE_GLOBAL, global);
 }
 
-static uint8_t argumentList(VM* vm) {
+static uint8_t argumentList(Parser* parser) {
     uint8_t argCount = 0;
-    if (!check(TOKEN_RIGHT_PAREN)) {
+    if (!check(parser, TOKEN_RIGHT_PAREN)) {
         do {
             // Each of the following arg expressions generates code that leavees its value on the stack in preparation for the call
-            expression(vm);
+            expression(parser);
             if (argCount == 255) {
-                error(vm, "Can't have more than 255 arguments.");
+                error(parser, "Can't have more than 255 arguments.");
             }
             argCount++;
-        } while (match(vm, TOKEN_COMMA));
+        } while (match(parser, TOKEN_COMMA));
     }
-    consume(vm, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
     return argCount;
 }
 
 // when called, LHS of expression has already been compiled. AT runtime, its value will be on stack top. If it's falsey, we skip the right operand and LHS value is result of entire expression. If it's not falsey, discard the LHS value, evaluate the right operand
-static void and_(VM* vm, bool canAssign) {
-    int endJump = emitJump(vm, OP_JUMP_IF_FALSE);
-    emitByte(vm, OP_POP);
-    parsePrecedence(vm, PREC_AND);
+static void and_(Parser* parser, bool canAssign) {
+    int endJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByte(parser, OP_POP);
+    parsePrecedence(parser, PREC_AND);
 
-    patchJump(vm, endJump);
+    patchJump(parser, endJump);
 }
 
 // assume the initial '(' has already been consumed
 // grouping is purely syntactic and has no runtime semantics and doesn't emit any bytecode on its own
-static void grouping(VM* vm, bool canAssign) {
-    expression(vm);
-    consume(vm, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+static void grouping(Parser* parser, bool canAssign) {
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
-static void number(VM* vm, bool canAssign) {
-    double value = strtod(parser.previous.start, NULL);
-    emitConstant(vm, NUMBER_VAL(value));
+static void number(Parser* parser, bool canAssign) {
+    double value = strtod(parser->previous.start, NULL);
+    emitValue(parser, NUMBER_VAL(value));
 }
 
-// when LHS if falsey, do tiny jump to next statement, which is unconditional jump over the code for the right operand.
-static void or_(VM* vm, bool canAssign) {
-    int elseJump = emitJump(vm, OP_JUMP_IF_FALSE);
-    int endJump = emitJump(vm, OP_JUMP);
+// the mirror image of and_: if the LHS is truthy, it's the result and the right operand is skipped
+static void or_(Parser* parser, bool canAssign) {
+    int endJump = emitJump(parser, OP_JUMP_IF_TRUE);
+    emitByte(parser, OP_POP);
 
-    patchJump(vm, elseJump);
-    emitByte(vm, OP_POP);
-
-    parsePrecedence(vm, PREC_OR);
-    patchJump(vm, endJump);
+    parsePrecedence(parser, PREC_OR);
+    patchJump(parser, endJump);
 }
 
 // +1, -2 trims the quotation marks
-static void string(VM* vm, bool canAssign) {
-    emitConstant(vm, OBJ_VAL(copyString(current->vm, parser.previous.start + 1, parser.previous.length - 2)));
+static void string(Parser* parser, bool canAssign) {
+    emitValue(parser, OBJ_VAL(copyString(parser->vm, parser->previous.start + 1, parser->previous.length - 2)));
 }
 
-static void namedVariable(VM* vm, Token name, bool canAssign) {
+static void namedVariable(Parser* parser, Token name, bool canAssign) {
     uint8_t getOp, setOp;
-    int arg = resolveLocal(vm, current, &name);
+    int arg = resolveLocal(parser, parser->compiler, &name);
     if (arg != -1) {
         getOp = OP_GET_LOCAL;
         setOp = OP_SET_LOCAL;
-    } else if ((arg = resolveUpvalue(vm, current, &name)) != -1) {
+    } else if ((arg = resolveUpvalue(parser, parser->compiler, &name)) != -1) {
         getOp = OP_GET_UPVALUE;
         setOp = OP_SET_UPVALUE;
     } else {
-        arg = identifierConstant(vm, &name);
+        arg = identifierConstant(parser, &name);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
     }
-    if (canAssign && match(vm, TOKEN_EQUAL)) {
-        expression(vm);
-        emitBytes(vm, setOp, (uint8_t)arg);
+    if (canAssign && match(parser, TOKEN_EQUAL)) {
+        expression(parser);
+        emitBytes(parser, setOp, (uint8_t)arg);
     } else {
-        emitBytes(vm, getOp, (uint8_t)arg);
+        emitBytes(parser, getOp, (uint8_t)arg);
     }
 }
 
-static void variable(VM* vm, bool canAssign) {
-    namedVariable(vm, parser.previous, canAssign);
+static void variable(Parser* parser, bool canAssign) {
+    namedVariable(parser, parser->previous, canAssign);
 }
 
 static Token syntheticToken(const char* text) {
@@ -529,103 +615,272 @@ static Token syntheticToken(const char* text) {
     return token;
 }
 
-static void super_(VM* vm, bool canAssign) {
-    if (currentClass == NULL) {
-        error(vm, "Can't use 'super' outside of a class.");
-    } else if (!currentClass->hasSuperclass) {
-        error(vm, "Can't use 'super' in a class with no superclass.");
+static void super_(Parser* parser, bool canAssign) {
+    if (parser->currentClass == NULL) {
+        error(parser, "Can't use 'super' outside of a class.");
+    } else if (!parser->currentClass->hasSuperclass) {
+        error(parser, "Can't use 'super' in a class with no superclass.");
     }
 
-    consume(vm, TOKEN_DOT, "Expect '.' after 'super'.");
-    consume(vm, TOKEN_IDENTIFIER, "Expect superclass method name.");
-    uint8_t name = identifierConstant(vm, &parser.previous);
+    consume(parser, TOKEN_DOT, "Expect '.' after 'super'.");
+    consume(parser, TOKEN_IDENTIFIER, "Expect superclass method name.");
+    uint8_t name = identifierConstant(parser, &parser->previous);
 
-    namedVariable(vm, syntheticToken("this"), false);
-    if (match(vm, TOKEN_LEFT_PAREN)) {
-        uint8_t argCount = argumentList(vm);
-        namedVariable(vm, syntheticToken("super"), false);
-        emitBytes(vm, OP_SUPER_INVOKE, name);
-        emitByte(vm, argCount);
+    namedVariable(parser, syntheticToken("this"), false);
+    if (match(parser, TOKEN_LEFT_PAREN)) {
+        uint8_t argCount = argumentList(parser);
+        namedVariable(parser, syntheticToken("super"), false);
+        emitBytes(parser, OP_SUPER_INVOKE, name);
+        emitByte(parser, argCount);
     } else {
-        namedVariable(vm, syntheticToken("super"), false);
-        emitBytes(vm, OP_GET_SUPER, name);
+        namedVariable(parser, syntheticToken("super"), false);
+        emitBytes(parser, OP_GET_SUPER, name);
     }
 }
 
 // treat `this` as a lexically scoped local variable whose value gets magically initialized
-static void this_(VM* vm, bool canAssign) {
-    if (currentClass == NULL) {
-        error(vm, "Can't use 'this' outside of a class.");
+static void this_(Parser* parser, bool canAssign) {
+    if (parser->currentClass == NULL) {
+        error(parser, "Can't use 'this' outside of a class.");
         return;
     }
 
-    variable(vm, false);
+    variable(parser, false);
+}
+
+// Constant folding: an operator whose operands are constants is worked out here instead of at runtime, but only when
+// the VM would get a value out of it too. Anything that would raise a runtime error is left for the VM to raise.
+
+static bool isFalseyConstant(Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// Works out `a op b` the way the VM would. Returns false if the VM would raise an error instead.
+static bool foldBinary(Parser* parser, TokenType operatorType, Value a, Value b, Value* result) {
+    if (operatorType == TOKEN_EQUAL_EQUAL || operatorType == TOKEN_BANG_EQUAL) {
+        bool equal = valuesEqual(a, b);
+        *result = BOOL_VAL(operatorType == TOKEN_EQUAL_EQUAL ? equal : !equal);
+        return true;
+    }
+
+    if (operatorType == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b)) {
+        ObjString* left = AS_STRING(a);
+        ObjString* right = AS_STRING(b);
+        int length = left->length + right->length;
+        char* chars = malloc(length);
+        if (chars == NULL) exit(1);
+        memcpy(chars, left->chars, left->length);
+        memcpy(chars + left->length, right->chars, right->length);
+        // a and b are still in the constant table, so they're safe from the GC while this allocates
+        *result = OBJ_VAL(copyString(parser->vm, chars, length));
+        free(chars);
+        return true;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (operatorType) {
+        case TOKEN_PLUS:  *result = NUMBER_VAL(x + y); return true;
+        case TOKEN_MINUS: *result = NUMBER_VAL(x - y); return true;
+        case TOKEN_STAR:  *result = NUMBER_VAL(x * y); return true;
+        case TOKEN_SLASH: *result = NUMBER_VAL(x / y); return true;
+        case TOKEN_GREATER: *result = BOOL_VAL(x > y); return true;
+        case TOKEN_LESS:    *result = BOOL_VAL(x < y); return true;
+        // these compile to the negated opposite comparison, which isn't the same thing when there's a NaN involved
+        case TOKEN_GREATER_EQUAL: *result = BOOL_VAL(!(x < y)); return true;
+        case TOKEN_LESS_EQUAL:    *result = BOOL_VAL(!(x > y)); return true;
+        default: return false;
+    }
+}
+
+// x * 1, x / 1, x - 0 and x + -0 are all just x, as long as x is a number, and 1 * x is too.
+// If x might not be a number, the operator has to stay to raise the error.
+// rightStart is where the right operand's code starts. Returns true if the operator could be dropped.
+static bool simplifyIdentity(Parser* parser, TokenType operatorType, ExprInfo left, ExprInfo right, int rightStart) {
+    if (left.kind == EXPR_NUMBER && right.kind == EXPR_CONSTANT && IS_NUMBER(right.value)) {
+        double y = AS_NUMBER(right.value);
+        bool identity = ((operatorType == TOKEN_STAR || operatorType == TOKEN_SLASH) && y == 1)
+                        || (operatorType == TOKEN_MINUS && y == 0 && !signbit(y))
+                        || (operatorType == TOKEN_PLUS && y == 0 && signbit(y));
+        if (!identity) return false;
+        discardValue(parser, rightStart);
+        parser->lastExpr = (ExprInfo){EXPR_NUMBER};
+        return true;
+    }
+
+    if (operatorType == TOKEN_STAR && left.kind == EXPR_CONSTANT && IS_NUMBER(left.value) && AS_NUMBER(left.value) == 1
+        && right.kind == EXPR_NUMBER) {
+        // slide the right operand's code down over the 1. Its jumps are all relative and inside it, so they still work.
+        Chunk* chunk = currentChunk(parser);
+        int length = chunk->count - rightStart;
+        if (chunk->code[left.start] == OP_CONSTANT && chunk->code[left.start + 1] == chunk->constants.count - 1) {
+            chunk->constants.count--;
+        }
+        memmove(chunk->code + left.start, chunk->code + rightStart, length);
+        memmove(chunk->lines + left.start, chunk->lines + rightStart, sizeof(int) * length);
+        chunk->count = left.start + length;
+        parser->lastExpr = (ExprInfo){EXPR_NUMBER};
+        return true;
+    }
+
+    return false;
+}
+
+static bool isNumberExpr(ExprInfo expr) {
+    return expr.kind == EXPR_NUMBER || (expr.kind == EXPR_CONSTANT && IS_NUMBER(expr.value));
 }
 
 // The left hand operator has already been compiled,
 // and the infix operator has already been consumed
-static void binary(VM* vm, bool canAssign) {
-    TokenType operatorType = parser.previous.type;
+static void binary(Parser* parser, bool canAssign) {
+    TokenType operatorType = parser->previous.type;
+    ExprInfo left = parser->lastExpr;
+    int rightStart = currentChunk(parser)->count;
+
     ParseRule* rule = getRule(operatorType);
-    parsePrecedence(vm, (Precedence)(rule->precedence + 1));
+    parsePrecedence(parser, (Precedence)(rule->precedence + 1));
+    ExprInfo right = parser->lastExpr;
+    // the right operand's info has to be about all of the right operand
+    if (right.kind == EXPR_CONSTANT && right.start != rightStart) right.kind = EXPR_UNKNOWN;
+
+    Value folded;
+    if (left.kind == EXPR_CONSTANT && right.kind == EXPR_CONSTANT
+        && foldBinary(parser, operatorType, left.value, right.value, &folded)) {
+        push(parser->vm, folded); // it's no longer in a constant table once the operands are discarded
+        discardValue(parser, right.start);
+        discardValue(parser, left.start);
+        emitValue(parser, folded);
+        pop(parser->vm);
+        return;
+    }
+    if (simplifyIdentity(parser, operatorType, left, right, rightStart)) return;
 
+    int operatorStart = currentChunk(parser)->count;
     switch (operatorType) {
-        case TOKEN_BANG_EQUAL:      emitBytes(vm,OP_EQUAL, OP_NOT); break;
-        case TOKEN_EQUAL_EQUAL:     emitByte(vm, OP_EQUAL); break;
-        case TOKEN_GREATER:         emitByte(vm, OP_GREATER); break;
-        case TOKEN_GREATER_EQUAL:   emitBytes(vm,OP_LESS, OP_NOT); break;
-        case TOKEN_LESS:            emitByte(vm, OP_LESS); break;
-        case TOKEN_LESS_EQUAL:      emitBytes(vm,OP_GREATER, OP_NOT); break;
-        case TOKEN_PLUS:            emitByte(vm, OP_ADD); break;
-        case TOKEN_MINUS:           emitByte(vm, OP_SUBTRACT); break;
-        case TOKEN_STAR:            emitByte(vm, OP_MULTIPLY); break;
-        case TOKEN_SLASH:           emitByte(vm, OP_DIVIDE); break;
+        case TOKEN_BANG_EQUAL:      emitBytes(parser,OP_EQUAL, OP_NOT); break;
+        case TOKEN_EQUAL_EQUAL:     emitByte(parser, OP_EQUAL); break;
+        case TOKEN_GREATER:         emitByte(parser, OP_GREATER); break;
+        case TOKEN_GREATER_EQUAL:   emitBytes(parser,OP_LESS, OP_NOT); break;
+        case TOKEN_LESS:            emitByte(parser, OP_LESS); break;
+        case TOKEN_LESS_EQUAL:      emitBytes(parser,OP_GREATER, OP_NOT); break;
+        case TOKEN_PLUS:            emitByte(parser, OP_ADD); break;
+        case TOKEN_MINUS:           emitByte(parser, OP_SUBTRACT); break;
+        case TOKEN_STAR:            emitByte(parser, OP_MULTIPLY); break;
+        case TOKEN_SLASH:           emitByte(parser, OP_DIVIDE); break;
         default: return; // unreachable
     }
+
+    switch (operatorType) {
+        case TOKEN_PLUS:
+            // strings add up too
+            if (isNumberExpr(left) && isNumberExpr(right)) parser->lastExpr.kind = EXPR_NUMBER;
+            break;
+        case TOKEN_MINUS:
+        case TOKEN_STAR:
+        case TOKEN_SLASH:
+            parser->lastExpr.kind = EXPR_NUMBER;
+            break;
+        default:
+            parser->lastExpr = (ExprInfo){EXPR_COMPARISON, operatorStart};
+            break;
+    }
+}
+
+static void call(Parser* parser, bool canAssign) {
+    uint8_t argCount = argumentList(parser);
+    emitBytes(parser, OP_CALL, argCount);
+    parser->lastExpr = (ExprInfo){EXPR_CALL, currentChunk(parser)->count - 2};
+}
+
+static void dot(Parser* parser, bool canAssign) {
+    consume(parser, TOKEN_IDENTIFIER, "Expect property name after '.'.");
+    uint8_t name = identifierConstant(parser, &parser->previous);
+
+    if (canAssign && match(parser, TOKEN_EQUAL)) {
+        expression(parser);
+        emitBytes(parser, OP_SET_PROPERTY, name);
+    } else if (match(parser, TOKEN_LEFT_PAREN)) {
+        uint8_t argCount = argumentList(parser);
+        emitBytes(parser, OP_INVOKE, name);
+        emitByte(parser, argCount);
+    } else {
+        emitBytes(parser, OP_GET_PROPERTY, name);
+    }
 }
 
-static void call(VM* vm, bool canAssign) {
-    uint8_t argCount = argumentList(vm);
-    emitBytes(vm, OP_CALL, argCount);
+// `[a, b, c]`: the elements are left on the stack, and OP_BUILD_LIST gathers them into a new list
+static void list(Parser* parser, bool canAssign) {
+    int count = 0;
+    if (!check(parser, TOKEN_RIGHT_BRACKET)) {
+        do {
+            // allow a trailing comma
+            if (check(parser, TOKEN_RIGHT_BRACKET)) break;
+            expression(parser);
+            if (count == 255) {
+                error(parser, "Can't have more than 255 elements in a list literal.");
+            }
+            count++;
+        } while (match(parser, TOKEN_COMMA));
+    }
+    consume(parser, TOKEN_RIGHT_BRACKET, "Expect ']' after list elements.");
+    emitBytes(parser, OP_BUILD_LIST, (uint8_t)count);
 }
 
-static void dot(VM* vm, bool canAssign) {
-    consume(vm, TOKEN_IDENTIFIER, "Expect property name after '.'.");
-    uint8_t name = identifierConstant(vm, &parser.previous);
+// `target[index]`, or `target[index] = value` - the target has already been compiled
+static void subscript(Parser* parser, bool canAssign) {
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
 
-    if (canAssign && match(vm, TOKEN_EQUAL)) {
-        expression(vm);
-        emitBytes(vm, OP_SET_PROPERTY, name);
-    } else if (match(vm, TOKEN_LEFT_PAREN)) {
-        uint8_t argCount = argumentList(vm);
-        emitBytes(vm, OP_INVOKE, name);
-        emitByte(vm, argCount);
+    if (canAssign && match(parser, TOKEN_EQUAL)) {
+        expression(parser);
+        emitByte(parser, OP_SET_INDEX);
     } else {
-        emitBytes(vm, OP_GET_PROPERTY, name);
+        emitByte(parser, OP_GET_INDEX);
     }
 }
 
-static void literal(VM* vm, bool canAssign) {
-    switch (parser.previous.type) {
-        case TOKEN_FALSE: emitByte(vm, OP_FALSE); break;
-        case TOKEN_NIL: emitByte(vm, OP_NIL); break;
-        case TOKEN_TRUE: emitByte(vm, OP_TRUE); break;
+static void literal(Parser* parser, bool canAssign) {
+    switch (parser->previous.type) {
+        case TOKEN_FALSE: emitValue(parser, FALSE_VAL); break;
+        case TOKEN_NIL: emitValue(parser, NIL_VAL); break;
+        case TOKEN_TRUE: emitValue(parser, TRUE_VAL); break;
         default: return; // Unreachable
     }
 }
 
 // evaluate the operator first, then encounter the OP_NEGATE instruction,
 // at that point, pop the value, negate it, and push the result
-static void unary(VM* vm, bool canAssign) {
-    TokenType operatorType = parser.previous.type;
+static void unary(Parser* parser, bool canAssign) {
+    TokenType operatorType = parser->previous.type;
 
     // Compile the operand
-    parsePrecedence(vm, PREC_UNARY);
+    int operandStart = currentChunk(parser)->count;
+    parsePrecedence(parser, PREC_UNARY);
+
+    // fold a constant operand, unless negating it would be an error
+    ExprInfo operand = parser->lastExpr;
+    if (operand.kind == EXPR_CONSTANT && operand.start == operandStart
+        && (operatorType == TOKEN_BANG || IS_NUMBER(operand.value))) {
+        discardValue(parser, operand.start);
+        if (operatorType == TOKEN_BANG) {
+            emitValue(parser, BOOL_VAL(isFalseyConstant(operand.value)));
+        } else {
+            emitValue(parser, NUMBER_VAL(-AS_NUMBER(operand.value)));
+        }
+        return;
+    }
 
     // Emit the operator instruction
     switch (operatorType) {
-        case TOKEN_BANG: emitByte(vm, OP_NOT); break;
-        case TOKEN_MINUS: emitByte(vm, OP_NEGATE); break;
+        case TOKEN_BANG:
+            emitByte(parser, OP_NOT);
+            parser->lastExpr.kind = EXPR_BOOL;
+            break;
+        case TOKEN_MINUS:
+            emitByte(parser, OP_NEGATE);
+            parser->lastExpr.kind = EXPR_NUMBER;
+            break;
         default: return;
     }
 }
@@ -635,6 +890,8 @@ ParseRule rules[] = {
   [TOKEN_RIGHT_PAREN]   = {NULL,     NULL,   PREC_NONE},
   [TOKEN_LEFT_BRACE]    = {NULL,     NULL,   PREC_NONE},
   [TOKEN_RIGHT_BRACE]   = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_LEFT_BRACKET]  = {list,     subscript, PREC_CALL},
+  [TOKEN_RIGHT_BRACKET] = {NULL,     NULL,   PREC_NONE},
   [TOKEN_COMMA]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_DOT]           = {NULL,     dot,    PREC_CALL},
   [TOKEN_MINUS]         = {unary,    binary, PREC_TERM},
@@ -674,25 +931,25 @@ ParseRule rules[] = {
 };
 
 // Parse until we get to a precedence lower than the given precedence
-static void parsePrecedence(VM* vm, Precedence precedence) {
-    advance(vm);
-    ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+static void parsePrecedence(Parser* parser, Precedence precedence) {
+    advance(parser);
+    ParseFn prefixRule = getRule(parser->previous.type)->prefix;
     if (prefixRule == NULL) {
-        error(vm, "Expect expression.");
+        error(parser, "Expect expression.");
         return;
     }
 
     bool canAssign = precedence <= PREC_ASSIGNMENT;
-    prefixRule(vm, canAssign);
+    prefixRule(parser, canAssign);
 
-    while (precedence <= getRule(parser.current.type)->precedence) {
-        advance(vm);
-        ParseFn infixRule = getRule(parser.previous.type)->infix;
-        infixRule(vm, canAssign);
+    while (precedence <= getRule(parser->current.type)->precedence) {
+        advance(parser);
+        ParseFn infixRule = getRule(parser->previous.type)->infix;
+        infixRule(parser, canAssign);
     }
 
-    if (canAssign && match(vm, TOKEN_EQUAL)) {
-        error(vm, "Invalid assignment target.");
+    if (canAssign && match(parser, TOKEN_EQUAL)) {
+        error(parser, "Invalid assignment target.");
     }
 }
 
@@ -700,268 +957,347 @@ static ParseRule* getRule(TokenType type) {
     return &rules[type];
 }
 
-static void expression(VM* vm) {
-    parsePrecedence(vm, PREC_ASSIGNMENT);
+static void expression(Parser* parser) {
+    parsePrecedence(parser, PREC_ASSIGNMENT);
 }
 
-static void block(VM* vm) {
-    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-        declaration(vm);
+static void block(Parser* parser) {
+    while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+        declaration(parser);
     }
 
-    consume(vm, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void function(VM* vm, FunctionType type) {
+static void function(Parser* parser, FunctionType type) {
     // Create a separate Compiler for each function being compiled.
     Compiler compiler;
-    initCompiler(&compiler, type, vm);
-    beginScope();
+    initCompiler(parser, &compiler, type);
+    beginScope(parser);
 
-    consume(vm, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
 
     // handle Parameters, which are local variables declared in the outermost lexical scope of the func body
-    if (!check(TOKEN_RIGHT_PAREN)) {
+    if (!check(parser, TOKEN_RIGHT_PAREN)) {
         do {
-            current->function->arity++;
-            if (current->function->arity > 255) {
-                errorAtCurrent(vm, "Can't have more than 255 parameters.");
+            parser->compiler->function->arity++;
+            if (parser->compiler->function->arity > 255) {
+                errorAtCurrent(parser, "Can't have more than 255 parameters.");
             }
-            uint8_t constant = parseVariable(vm, "Expect parameter name.");
-            defineVariable(vm, constant);
-        } while (match(vm, TOKEN_COMMA));
+            uint8_t constant = parseVariable(parser, "Expect parameter name.");
+            defineVariable(parser, constant);
+        } while (match(parser, TOKEN_COMMA));
     }
 
-    consume(vm, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
-    consume(vm, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-    block(vm);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+    consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+    block(parser);
 
     // After reaching the end of the func's block body,
     // call endCompiler, which yields the newly compiled function object
     // which is stored as a constant in the surrounding func's constant table
-    ObjFunction* function = endCompiler(vm);
-    emitBytes(vm, OP_CLOSURE, makeConstant(vm, OBJ_VAL(function)));
+    ObjFunction* function = endCompiler(parser);
+    emitBytes(parser, OP_CLOSURE, makeConstant(parser, OBJ_VAL(function)));
 
     for (int i = 0; i < function->upvalueCount; i++) {
-        emitByte(vm, compiler.upvalues[i].isLocal ? 1 : 0);
-        emitByte(vm, compiler.upvalues[i].index);
+        emitByte(parser, compiler.upvalues[i].isLocal ? 1 : 0);
+        emitByte(parser, compiler.upvalues[i].index);
     }
 }
 
-static void method(VM* vm) {
+static void method(Parser* parser) {
     // to define a new method, the VM needs 3 things:
     // 1. method name
     // 2. method body closure
     // 3. class to bind the method to
-    consume(vm, TOKEN_IDENTIFIER, "Expect method name.");
-    Token className = parser.previous;
+    consume(parser, TOKEN_IDENTIFIER, "Expect method name.");
+    Token className = parser->previous;
 
-    uint8_t constant = identifierConstant(vm, &parser.previous);
+    uint8_t constant = identifierConstant(parser, &parser->previous);
 
     FunctionType type = TYPE_METHOD;
-    if (parser.previous.length == 4 && memcmp(parser.previous.start, "init", 4) == 0) {
+    if (parser->previous.length == 4 && memcmp(parser->previous.start, "init", 4) == 0) {
         type = TYPE_INITIALIZER;
     }
-    function(vm, type);
+    function(parser, type);
 
 
-    emitBytes(vm,OP_METHOD, constant);
+    emitBytes(parser,OP_METHOD, constant);
 }
 
-static void classDeclaration(VM* vm) {
-    consume(vm, TOKEN_IDENTIFIER, "Expect class name.");
-    Token className = parser.previous;
-    uint8_t nameConstant = identifierConstant(vm, &parser.previous);
-    declareVariable(vm);
+static void classDeclaration(Parser* parser) {
+    consume(parser, TOKEN_IDENTIFIER, "Expect class name.");
+    Token className = parser->previous;
+    uint8_t nameConstant = identifierConstant(parser, &parser->previous);
+    declareVariable(parser);
 
-    emitBytes(vm, OP_CLASS, nameConstant);
-    defineVariable(vm, nameConstant);
+    emitBytes(parser, OP_CLASS, nameConstant);
+    defineVariable(parser, nameConstant);
 
     ClassCompiler classCompiler;
     classCompiler.hasSuperclass = false;
-    classCompiler.enclosing = currentClass;
-    currentClass = &classCompiler;
+    classCompiler.enclosing = parser->currentClass;
+    parser->currentClass = &classCompiler;
 
-    if (match(vm, TOKEN_LESS)) {
-        consume(vm, TOKEN_IDENTIFIER, "Expect superclass name.");
-        variable(vm, false);
+    if (match(parser, TOKEN_LESS)) {
+        consume(parser, TOKEN_IDENTIFIER, "Expect superclass name.");
+        variable(parser, false);
 
-        if (identifiersEqual(&className, &parser.previous)) {
-            error(vm, "A class can't inherit from itself.");
+        if (identifiersEqual(&className, &parser->previous)) {
+            error(parser, "A class can't inherit from itself.");
         }
 
-        beginScope();
-        addLocal(vm, syntheticToken("super"));
-        defineVariable(vm, 0);
+        beginScope(parser);
+        addLocal(parser, syntheticToken("super"));
+        defineVariable(parser, 0);
 
-        namedVariable(vm, className, false);
-        emitByte(vm, OP_INHERIT);
+        namedVariable(parser, className, false);
+        emitByte(parser, OP_INHERIT);
         classCompiler.hasSuperclass = true;
     }
 
-    namedVariable(vm, className, false);
-    consume(vm, TOKEN_LEFT_BRACE, "Expect '{' before class body.");
-    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-        method(vm);
+    namedVariable(parser, className, false);
+    consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+    while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+        method(parser);
     }
-    consume(vm, TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
-    emitByte(vm, OP_POP);
+    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+    emitByte(parser, OP_POP);
 
     if (classCompiler.hasSuperclass) {
-        endScope(vm);
+        endScope(parser);
     }
 
-    currentClass = currentClass->enclosing;
+    parser->currentClass = parser->currentClass->enclosing;
 }
 
-static void funDeclaration(VM* vm) {
-    uint8_t global = parseVariable(vm, "Expect function name.");
-    markInitialized();
-    function(vm, TYPE_FUNCTION);
-    defineVariable(vm, global);
+static void funDeclaration(Parser* parser) {
+    uint8_t global = parseVariable(parser, "Expect function name.");
+    markInitialized(parser);
+    function(parser, TYPE_FUNCTION);
+    defineVariable(parser, global);
 }
 
-static void varDeclaration(VM* vm) {
-    uint8_t global = parseVariable(vm, "Expect variable name.");
+static void varDeclaration(Parser* parser) {
+    uint8_t global = parseVariable(parser, "Expect variable name.");
 
-    if (match(vm, TOKEN_EQUAL)) {
-        expression(vm);
+    if (match(parser, TOKEN_EQUAL)) {
+        expression(parser);
     } else {
         // if user doesn't initialize the var, do it for them, init-ing it to nil.
-        emitByte(vm, OP_NIL);
+        emitByte(parser, OP_NIL);
     }
-    consume(vm, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
 
-    defineVariable(vm, global);
+    defineVariable(parser, global);
 }
 
-static void expressionStatement(VM* vm) {
-    expression(vm);
-    consume(vm, TOKEN_SEMICOLON, "Expect ';' after expression.");
-    emitByte(vm, OP_POP);
+static void expressionStatement(Parser* parser) {
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression.");
+    emitByte(parser, OP_POP);
 }
 
-static void forStatement(VM* vm) {
-    beginScope(); // necessary for var declared in for loop - that var should be scoped to the loop body
-    consume(vm, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
-    if (match(vm, TOKEN_SEMICOLON)) {
+// A counted loop is `for (...; i < limit; i = i + step)`, with i a local, step a number constant and limit a constant
+// or variable other than i, compared with any of < <= > >=. Its increment and condition are done by one OP_FOR_LOOP at
+// the bottom of the loop, straight on i's stack slot. The limit only gets read before the increment rather than after,
+// which is the same thing, since the increment can't change it.
+typedef struct {
+    uint8_t slot;
+    uint8_t step;       // constant
+    uint8_t arithmetic; // OP_ADD or OP_SUBTRACT
+    uint8_t exitTest;   // the fused jump the condition compiled to
+    int limitStart;     // the limit's instruction, in the condition
+    int conditionLine;
+    int incrementLine;
+} CountedLoop;
+
+// Looks at the code a for loop's condition and increment compiled to, which run from conditionStart to the end of
+// the chunk, for a counted loop
+static bool matchCountedLoop(Parser* parser, int conditionStart, int exitJump, int incrementStart, CountedLoop* loop) {
+    Chunk* chunk = currentChunk(parser);
+    uint8_t* code = chunk->code;
+
+    // the condition: OP_GET_LOCAL i, the limit, then a fused comparison
+    loop->exitTest = code[exitJump - 1];
+    if (loop->exitTest != OP_JUMP_IF_LESS && loop->exitTest != OP_JUMP_IF_NOT_LESS
+        && loop->exitTest != OP_JUMP_IF_GREATER && loop->exitTest != OP_JUMP_IF_NOT_GREATER) return false;
+    if (code[conditionStart] != OP_GET_LOCAL) return false;
+    loop->slot = code[conditionStart + 1];
+    loop->limitStart = conditionStart + 2;
+    if (exitJump - 1 - loop->limitStart != 2) return false;
+    switch (code[loop->limitStart]) {
+        case OP_CONSTANT:
+        case OP_GET_GLOBAL:
+        case OP_GET_UPVALUE:
+            break;
+        case OP_GET_LOCAL:
+            if (code[loop->limitStart + 1] == loop->slot) return false;
+            break;
+        default:
+            return false;
+    }
+
+    // the increment: OP_GET_LOCAL i, OP_CONSTANT step, OP_ADD or OP_SUBTRACT, OP_SET_LOCAL i, OP_POP
+    uint8_t* increment = code + incrementStart;
+    if (chunk->count - incrementStart != 8) return false;
+    if (increment[0] != OP_GET_LOCAL || increment[1] != loop->slot || increment[2] != OP_CONSTANT
+        || (increment[4] != OP_ADD && increment[4] != OP_SUBTRACT)
+        || increment[5] != OP_SET_LOCAL || increment[6] != loop->slot || increment[7] != OP_POP) return false;
+    if (!IS_NUMBER(chunk->constants.values[increment[3]])) return false;
+    loop->step = increment[3];
+    loop->arithmetic = increment[4];
+
+    loop->conditionLine = chunk->lines[conditionStart];
+    loop->incrementLine = chunk->lines[incrementStart];
+    return true;
+}
+
+// The bottom of a counted loop: the limit again, then OP_FOR_LOOP back to the top of the body
+static void emitCountedLoop(Parser* parser, CountedLoop* loop, int bodyStart) {
+    Chunk* chunk = currentChunk(parser);
+    int start = chunk->count;
+    emitBytes(parser, chunk->code[loop->limitStart], chunk->code[loop->limitStart + 1]);
+    emitBytes(parser, OP_FOR_LOOP, loop->slot);
+    emitBytes(parser, loop->step, loop->arithmetic);
+    emitByte(parser, loop->exitTest);
+
+    int offset = chunk->count - bodyStart + 2;
+    if (offset > UINT16_MAX) error(parser, "Loop body too large.");
+    emitBytes(parser, (offset >> 8) & 0xff, offset & 0xff);
+
+    // errors are reported on the line they would be without it: the VM checks the counter after reading the
+    // arithmetic and the limit after reading the exit test
+    for (int i = start; i < chunk->count; i++) chunk->lines[i] = loop->conditionLine;
+    for (int i = start + 2; i < start + 6; i++) chunk->lines[i] = loop->incrementLine;
+}
+
+static void forStatement(Parser* parser) {
+    beginScope(parser); // necessary for var declared in for loop - that var should be scoped to the loop body
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+    if (match(parser, TOKEN_SEMICOLON)) {
         // No initializer
-    } else if (match(vm, TOKEN_VAR)) {
-        varDeclaration(vm);
+    } else if (match(parser, TOKEN_VAR)) {
+        varDeclaration(parser);
     } else {
-        expressionStatement(vm);
+        expressionStatement(parser);
     }
 
-    int loopStart = currentChunk()->count;
+    int loopStart = currentChunk(parser)->count;
     int exitJump = -1;
-    if (!match(vm, TOKEN_SEMICOLON)) {
-        expression(vm);
-        consume(vm, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+    if (!match(parser, TOKEN_SEMICOLON)) {
+        expression(parser);
+        consume(parser, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
         // Jump out of the loop if the condition is false.
-        exitJump = emitJump(vm, OP_JUMP_IF_FALSE);
-        emitByte(vm, OP_POP); // Condition
+        exitJump = emitConditionJump(parser);
     }
 
     // Since we only make a single pass, we compile the increment clause after we encounter it.
     // We'll jump over the increment, run the body, jump back up to the increment, run it, then go to the next iteration
-    if (!match(vm, TOKEN_RIGHT_PAREN)) {
-        int bodyJump = emitJump(vm, OP_JUMP);
-        int incrementStart = currentChunk()->count;
-        expression(vm);
-        emitByte(vm, OP_POP);
-        consume(vm, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
-
-        emitLoop(vm, loopStart);
-        loopStart = incrementStart;
-        patchJump(vm, bodyJump);
+    CountedLoop counted;
+    bool isCounted = false;
+    if (!match(parser, TOKEN_RIGHT_PAREN)) {
+        int bodyJump = emitJump(parser, OP_JUMP);
+        int incrementStart = currentChunk(parser)->count;
+        expression(parser);
+        emitByte(parser, OP_POP);
+        consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+
+        if (exitJump != -1 && matchCountedLoop(parser, loopStart, exitJump, incrementStart, &counted)) {
+            // OP_FOR_LOOP does the increment, so the jump over it and the increment itself go
+            currentChunk(parser)->count = bodyJump - 1;
+            isCounted = true;
+        } else {
+            emitLoop(parser, loopStart);
+            loopStart = incrementStart;
+            patchJump(parser, bodyJump);
+        }
     }
 
-
-    statement(vm);
-    emitLoop(vm, loopStart);
-
-    if (exitJump != -1) {
-        patchJump(vm, exitJump);
-        emitByte(vm, OP_POP); // Condition
+    int bodyStart = currentChunk(parser)->count;
+    statement(parser);
+    if (isCounted) {
+        emitCountedLoop(parser, &counted, bodyStart);
+    } else {
+        emitLoop(parser, loopStart);
     }
 
-    endScope(vm);
+    if (exitJump != -1) patchJump(parser, exitJump);
+
+    endScope(parser);
 }
 
-static void ifStatement(VM* vm) {
-    consume(vm, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+static void ifStatement(Parser* parser) {
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
     // Put condition expression on top of stack,
     // so we can use it to determine whether to execute the then branch or skip it, at runtime
-    expression(vm);
-    consume(vm, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
     // Use backpatching: emit the half finished jump instruction 1st with a placeholder offset operand (keep track of where that is)
-    // emitJump emits the given instruction, then 2 placeholder byte instructions
-    int thenJump = emitJump(vm, OP_JUMP_IF_FALSE);
-
-    // when the condition is truthy, pop it right before the code inside the then branch
-    emitByte(vm, OP_POP);
-    statement(vm);
-
-    int elseJump = emitJump(vm, OP_JUMP);
+    // The jump pops the condition whichever way it goes, so neither branch has to
+    int thenJump = emitConditionJump(parser);
+    statement(parser);
 
     // Then, after compiling the then body, we'll know how far to jump, so replace it with the complete instruction
-    patchJump(vm, thenJump);
-
-    // if the condition is falsey, pop at the beginning of the else branch
-    emitByte(vm, OP_POP);
-
-    if (match(vm, TOKEN_ELSE)) statement(vm);
-    patchJump(vm, elseJump);
+    if (match(parser, TOKEN_ELSE)) {
+        int elseJump = emitJump(parser, OP_JUMP);
+        patchJump(parser, thenJump);
+        statement(parser);
+        patchJump(parser, elseJump);
+    } else {
+        patchJump(parser, thenJump);
+    }
 }
 
-static void printStatement(VM* vm) {
-    expression(vm);
-    consume(vm, TOKEN_SEMICOLON, "Expect ';' after value.");
-    emitByte(vm, OP_PRINT);
+static void printStatement(Parser* parser) {
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after value.");
+    emitByte(parser, OP_PRINT);
 }
 
-static void returnStatement(VM* vm) {
-    if (current->type == TYPE_SCRIPT) {
-        error(vm, "Can't return from top-level code.");
+static void returnStatement(Parser* parser) {
+    if (parser->compiler->type == TYPE_SCRIPT) {
+        error(parser, "Can't return from top-level code.");
     }
-    if (match(vm, TOKEN_SEMICOLON)) {
-        emitReturn(vm);
+    if (match(parser, TOKEN_SEMICOLON)) {
+        emitReturn(parser);
     } else {
-        if (current->type == TYPE_INITIALIZER) {
-            error(vm, "Can't return a value from an initializer.");
+        if (parser->compiler->type == TYPE_INITIALIZER) {
+            error(parser, "Can't return a value from an initializer.");
         }
-        expression(vm);
-        consume(vm, TOKEN_SEMICOLON, "Expect ';' after return value.");
-        emitByte(vm, OP_RETURN);
+        expression(parser);
+        consume(parser, TOKEN_SEMICOLON, "Expect ';' after return value.");
+        // returning what a call returns: the callee can take over this frame. The OP_RETURN stays for the callees that
+        // don't (natives, classes), for which OP_TAIL_CALL is just a call.
+        if (parser->lastExpr.kind == EXPR_CALL) currentChunk(parser)->code[parser->lastExpr.start] = OP_TAIL_CALL;
+        emitByte(parser, OP_RETURN);
     }
 }
 
-static void whileStatement(VM* vm) {
-    int loopStart = currentChunk()->count;
-    consume(vm, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
-    expression(vm);
-    consume(vm, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+static void whileStatement(Parser* parser) {
+    int loopStart = currentChunk(parser)->count;
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int exitJump = emitJump(vm, OP_JUMP_IF_FALSE);
-    emitByte(vm, OP_POP);
-    statement(vm);
+    int exitJump = emitConditionJump(parser);
+    statement(parser);
 
     // jump backwards
-    emitLoop(vm, loopStart);
+    emitLoop(parser, loopStart);
 
-    patchJump(vm, exitJump);
-    emitByte(vm, OP_POP);
+    patchJump(parser, exitJump);
 }
 
-static void synchronize(VM* vm) {
-    parser.panicMode = false;
+static void synchronize(Parser* parser) {
+    parser->panicMode = false;
 
     // Skip tokens until we reach something that looks like a statement boundary - either we just passed a semicolon, or the subsequent token is one that begins a statemetn
-    while (parser.current.type != TOKEN_EOF) {
-        if (parser.previous.type == TOKEN_SEMICOLON) return;
-        switch (parser.current.type) {
+    while (parser->current.type != TOKEN_EOF) {
+        if (parser->previous.type == TOKEN_SEMICOLON) return;
+        switch (parser->current.type) {
             case TOKEN_CLASS:
             case TOKEN_FUN:
             case TOKEN_VAR:
@@ -975,65 +1311,75 @@ static void synchronize(VM* vm) {
                 ; // Do nothing
         }
 
-        advance(vm);
+        advance(parser);
     }
 }
 
-static void declaration(VM* vm) {
-    if (match(vm, TOKEN_CLASS)) {
-        classDeclaration(vm);
-    } else if (match(vm, TOKEN_FUN)) {
-        funDeclaration(vm);
-    } else if (match(vm, TOKEN_VAR)) {
-        varDeclaration(vm);
+static void declaration(Parser* parser) {
+    if (match(parser, TOKEN_CLASS)) {
+        classDeclaration(parser);
+    } else if (match(parser, TOKEN_FUN)) {
+        funDeclaration(parser);
+    } else if (match(parser, TOKEN_VAR)) {
+        varDeclaration(parser);
     } else {
-        statement(vm);
-    }
-
-    if (parser.panicMode) synchronize(vm);
-}
-
-static void statement(VM* vm) {
-    if (match(vm, TOKEN_PRINT)) {
-        printStatement(vm);
-    } else if (match(vm, TOKEN_FOR)) {
-        forStatement(vm);
-    } else if (match(vm, TOKEN_IF)) {
-        ifStatement(vm);
-    } else if (match(vm, TOKEN_RETURN)) {
-        returnStatement(vm);
-    } else if (match(vm, TOKEN_WHILE)) {
-        whileStatement(vm);
-    } else if (match(vm, TOKEN_LEFT_BRACE)) {
-        beginScope();
-        block(vm);
-        endScope(vm);
+        statement(parser);
+    }
+
+    if (parser->panicMode) synchronize(parser);
+}
+
+static void statement(Parser* parser) {
+    if (match(parser, TOKEN_PRINT)) {
+        printStatement(parser);
+    } else if (match(parser, TOKEN_FOR)) {
+        forStatement(parser);
+    } else if (match(parser, TOKEN_IF)) {
+        ifStatement(parser);
+    } else if (match(parser, TOKEN_RETURN)) {
+        returnStatement(parser);
+    } else if (match(parser, TOKEN_WHILE)) {
+        whileStatement(parser);
+    } else if (match(parser, TOKEN_LEFT_BRACE)) {
+        beginScope(parser);
+        block(parser);
+        endScope(parser);
     } else {
-        expressionStatement(vm);
+        expressionStatement(parser);
     }
 }
 
 ObjFunction* compile(VM* vm, const char* source) {
-    initScanner(source);
-
-    Compiler compiler;
-    initCompiler(&compiler, TYPE_SCRIPT, vm);
-
+    Parser parser;
+    initScanner(&parser.scanner, source);
     parser.hadError = false;
     parser.panicMode = false;
+    parser.compiler = NULL;
+    parser.currentClass = NULL;
+    parser.lastExpr.kind = EXPR_UNKNOWN;
+    parser.vm = vm;
 
-    advance(vm);
+    // let the GC find the functions we're in the middle of compiling
+    vm->parser = &parser;
 
-    while (!match(vm, TOKEN_EOF)) {
-        declaration(vm);
+    Compiler compiler;
+    initCompiler(&parser, &compiler, TYPE_SCRIPT);
+
+    advance(&parser);
+
+    while (!match(&parser, TOKEN_EOF)) {
+        declaration(&parser);
     }
 
-    ObjFunction* function = endCompiler(vm);
+    ObjFunction* function = endCompiler(&parser);
+    vm->parser = NULL;
     return parser.hadError ? NULL : function;
 }
 
 void markCompilerRoots(VM* vm) {
-    Compiler* compiler = current;
+    if (vm->parser == NULL) return;
+
+    Compiler* compiler = vm->parser->compiler;
     while (compiler != NULL) {
         markObject(vm, (Obj*)compiler->function);
         compiler = compiler->enclosing;
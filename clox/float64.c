@@ -0,0 +1,439 @@
+//
+// See float64.h. The vector kernels are compiled with per-function target attributes rather than a global -mavx2,
+// so the binary still runs on CPUs without AVX2 and only calls those kernels once the CPU has said it has it.
+//
+
+#include <math.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "float64.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_X86_KERNELS
+#include <immintrin.h>
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+// Every min and max kernel follows the same rule: a NaN anywhere makes the result the first NaN, and -0 counts as less
+// than 0. The vector kernels only note that they saw a NaN, and leave finding the first one to firstNaN.
+
+static double firstNaN(const double* x, int count) {
+    for (int i = 0; i < count; i++) {
+        if (isnan(x[i])) return x[i];
+    }
+    return 0; // unreachable, for callers that saw a NaN
+}
+
+// a and b mustn't be NaN
+static double lesser(double a, double b) {
+    return b < a || (b == a && signbit(b)) ? b : a;
+}
+
+static double greater(double a, double b) {
+    return b > a || (b == a && !signbit(b)) ? b : a;
+}
+
+// sum and dot add in the same order in every kernel, so they round the same whichever kernels run: eight running totals,
+// the kth taking every eighth element from k on, combined as ((t0 + t4) + (t2 + t6)) + ((t1 + t5) + (t3 + t7)), then
+// whatever is left over after the last full eight, one at a time. That's the order two AVX2 accumulators fall into.
+#define SUM_LANES 8
+
+static double combineLanes(const double t[SUM_LANES]) {
+    return ((t[0] + t[4]) + (t[2] + t[6])) + ((t[1] + t[5]) + (t[3] + t[7]));
+}
+
+// Scalar
+
+static double sumScalar(const double* x, int count) {
+    double t[SUM_LANES] = {0};
+    int i = 0;
+    for (; i + SUM_LANES <= count; i += SUM_LANES) {
+        for (int k = 0; k < SUM_LANES; k++) t[k] += x[i + k];
+    }
+    double total = combineLanes(t);
+    for (; i < count; i++) total += x[i];
+    return total;
+}
+
+static double dotScalar(const double* x, const double* y, int count) {
+    double t[SUM_LANES] = {0};
+    int i = 0;
+    for (; i + SUM_LANES <= count; i += SUM_LANES) {
+        for (int k = 0; k < SUM_LANES; k++) t[k] += x[i + k] * y[i + k];
+    }
+    double total = combineLanes(t);
+    for (; i < count; i++) total += x[i] * y[i];
+    return total;
+}
+
+static void scaleScalar(double* x, double factor, int count) {
+    for (int i = 0; i < count; i++) x[i] *= factor;
+}
+
+static void axpyScalar(double a, const double* x, double* y, int count) {
+    for (int i = 0; i < count; i++) y[i] += a * x[i];
+}
+
+// Finishes a min or max from i on, given result covers everything before i and there's no NaN there
+static double minFrom(const double* x, int i, int count, double result) {
+    for (; i < count; i++) {
+        if (isnan(x[i])) return x[i];
+        result = lesser(result, x[i]);
+    }
+    return result;
+}
+
+static double maxFrom(const double* x, int i, int count, double result) {
+    for (; i < count; i++) {
+        if (isnan(x[i])) return x[i];
+        result = greater(result, x[i]);
+    }
+    return result;
+}
+
+static double minScalar(const double* x, int count) {
+    return minFrom(x, 0, count, x[0]);
+}
+
+static double maxScalar(const double* x, int count) {
+    return maxFrom(x, 0, count, x[0]);
+}
+
+// Finishes a prefix sum from i on, given everything before i is done
+static void prefixSumFrom(double* x, int i, int count) {
+    double running = i > 0 ? x[i - 1] : 0;
+    for (; i < count; i++) {
+        running += x[i];
+        x[i] = running;
+    }
+}
+
+static void prefixSumScalar(double* x, int count) {
+    prefixSumFrom(x, 0, count);
+}
+
+static const Float64Kernels scalarKernels = {
+        "scalar", sumScalar, dotScalar, scaleScalar, axpyScalar, minScalar, maxScalar, prefixSumScalar
+};
+
+#ifdef HAVE_X86_KERNELS
+
+// SSE2: two doubles at a time
+
+TARGET_SSE2 static double hsum128(__m128d v) {
+    return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v)));
+}
+
+// the eight totals, two to an accumulator, combined in combineLanes' order
+TARGET_SSE2 static double combineSse2(__m128d acc0, __m128d acc1, __m128d acc2, __m128d acc3) {
+    return hsum128(_mm_add_pd(_mm_add_pd(acc0, acc2), _mm_add_pd(acc1, acc3)));
+}
+
+TARGET_SSE2 static double sumSse2(const double* x, int count) {
+    __m128d acc0 = _mm_setzero_pd();
+    __m128d acc1 = _mm_setzero_pd();
+    __m128d acc2 = _mm_setzero_pd();
+    __m128d acc3 = _mm_setzero_pd();
+    int i = 0;
+    // several accumulators, so each add doesn't have to wait for the one before it
+    for (; i + 8 <= count; i += 8) {
+        acc0 = _mm_add_pd(acc0, _mm_load_pd(x + i));
+        acc1 = _mm_add_pd(acc1, _mm_load_pd(x + i + 2));
+        acc2 = _mm_add_pd(acc2, _mm_load_pd(x + i + 4));
+        acc3 = _mm_add_pd(acc3, _mm_load_pd(x + i + 6));
+    }
+    double total = combineSse2(acc0, acc1, acc2, acc3);
+    for (; i < count; i++) total += x[i];
+    return total;
+}
+
+TARGET_SSE2 static double dotSse2(const double* x, const double* y, int count) {
+    __m128d acc0 = _mm_setzero_pd();
+    __m128d acc1 = _mm_setzero_pd();
+    __m128d acc2 = _mm_setzero_pd();
+    __m128d acc3 = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        acc0 = _mm_add_pd(acc0, _mm_mul_pd(_mm_load_pd(x + i), _mm_load_pd(y + i)));
+        acc1 = _mm_add_pd(acc1, _mm_mul_pd(_mm_load_pd(x + i + 2), _mm_load_pd(y + i + 2)));
+        acc2 = _mm_add_pd(acc2, _mm_mul_pd(_mm_load_pd(x + i + 4), _mm_load_pd(y + i + 4)));
+        acc3 = _mm_add_pd(acc3, _mm_mul_pd(_mm_load_pd(x + i + 6), _mm_load_pd(y + i + 6)));
+    }
+    double total = combineSse2(acc0, acc1, acc2, acc3);
+    for (; i < count; i++) total += x[i] * y[i];
+    return total;
+}
+
+TARGET_SSE2 static void scaleSse2(double* x, double factor, int count) {
+    __m128d f = _mm_set1_pd(factor);
+    int i = 0;
+    for (; i + 2 <= count; i += 2) _mm_store_pd(x + i, _mm_mul_pd(_mm_load_pd(x + i), f));
+    for (; i < count; i++) x[i] *= factor;
+}
+
+TARGET_SSE2 static void axpySse2(double a, const double* x, double* y, int count) {
+    __m128d va = _mm_set1_pd(a);
+    int i = 0;
+    for (; i + 2 <= count; i += 2) {
+        _mm_store_pd(y + i, _mm_add_pd(_mm_load_pd(y + i), _mm_mul_pd(va, _mm_load_pd(x + i))));
+    }
+    for (; i < count; i++) y[i] += a * x[i];
+}
+
+// minpd returns its second operand when the two are equal (0 and -0) or either is NaN. So NaNs are tracked with an
+// unordered compare instead, and the min is taken both ways round and ORed, which makes -0 win over 0 (and max ANDs,
+// so 0 wins).
+TARGET_SSE2 static double minSse2(const double* x, int count) {
+    __m128d acc = _mm_set1_pd(x[0]);
+    __m128d unordered = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 2 <= count; i += 2) {
+        __m128d v = _mm_load_pd(x + i);
+        unordered = _mm_or_pd(unordered, _mm_cmpunord_pd(v, v));
+        acc = _mm_or_pd(_mm_min_pd(acc, v), _mm_min_pd(v, acc));
+    }
+    if (_mm_movemask_pd(unordered) != 0) return firstNaN(x, count);
+    double result = lesser(_mm_cvtsd_f64(acc), _mm_cvtsd_f64(_mm_unpackhi_pd(acc, acc)));
+    return minFrom(x, i, count, result);
+}
+
+TARGET_SSE2 static double maxSse2(const double* x, int count) {
+    __m128d acc = _mm_set1_pd(x[0]);
+    __m128d unordered = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 2 <= count; i += 2) {
+        __m128d v = _mm_load_pd(x + i);
+        unordered = _mm_or_pd(unordered, _mm_cmpunord_pd(v, v));
+        acc = _mm_and_pd(_mm_max_pd(acc, v), _mm_max_pd(v, acc));
+    }
+    if (_mm_movemask_pd(unordered) != 0) return firstNaN(x, count);
+    double result = greater(_mm_cvtsd_f64(acc), _mm_cvtsd_f64(_mm_unpackhi_pd(acc, acc)));
+    return maxFrom(x, i, count, result);
+}
+
+TARGET_SSE2 static void prefixSumSse2(double* x, int count) {
+    __m128d carry = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 2 <= count; i += 2) {
+        __m128d v = _mm_load_pd(x + i);
+        // [a, b] -> [a, a + b]
+        v = _mm_add_pd(v, _mm_castsi128_pd(_mm_slli_si128(_mm_castpd_si128(v), 8)));
+        v = _mm_add_pd(v, carry);
+        _mm_store_pd(x + i, v);
+        carry = _mm_unpackhi_pd(v, v);
+    }
+    prefixSumFrom(x, i, count);
+}
+
+static const Float64Kernels sse2Kernels = {
+        "sse2", sumSse2, dotSse2, scaleSse2, axpySse2, minSse2, maxSse2, prefixSumSse2
+};
+
+// AVX2: four doubles at a time
+
+TARGET_AVX2 static double hsum256(__m256d v) {
+    __m128d half = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+}
+
+TARGET_AVX2 static double sumAvx2(const double* x, int count) {
+    __m256d acc0 = _mm256_setzero_pd();
+    __m256d acc1 = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        acc0 = _mm256_add_pd(acc0, _mm256_load_pd(x + i));
+        acc1 = _mm256_add_pd(acc1, _mm256_load_pd(x + i + 4));
+    }
+    double total = hsum256(_mm256_add_pd(acc0, acc1));
+    for (; i < count; i++) total += x[i];
+    return total;
+}
+
+TARGET_AVX2 static double dotAvx2(const double* x, const double* y, int count) {
+    __m256d acc0 = _mm256_setzero_pd();
+    __m256d acc1 = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(_mm256_load_pd(x + i), _mm256_load_pd(y + i)));
+        acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(_mm256_load_pd(x + i + 4), _mm256_load_pd(y + i + 4)));
+    }
+    double total = hsum256(_mm256_add_pd(acc0, acc1));
+    for (; i < count; i++) total += x[i] * y[i];
+    return total;
+}
+
+TARGET_AVX2 static void scaleAvx2(double* x, double factor, int count) {
+    __m256d f = _mm256_set1_pd(factor);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) _mm256_store_pd(x + i, _mm256_mul_pd(_mm256_load_pd(x + i), f));
+    for (; i < count; i++) x[i] *= factor;
+}
+
+TARGET_AVX2 static void axpyAvx2(double a, const double* x, double* y, int count) {
+    __m256d va = _mm256_set1_pd(a);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm256_store_pd(y + i, _mm256_add_pd(_mm256_load_pd(y + i), _mm256_mul_pd(va, _mm256_load_pd(x + i))));
+    }
+    for (; i < count; i++) y[i] += a * x[i];
+}
+
+// The same tricks as minSse2 and maxSse2
+TARGET_AVX2 static double minAvx2(const double* x, int count) {
+    __m256d acc = _mm256_set1_pd(x[0]);
+    __m256d unordered = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256d v = _mm256_load_pd(x + i);
+        unordered = _mm256_or_pd(unordered, _mm256_cmp_pd(v, v, _CMP_UNORD_Q));
+        acc = _mm256_or_pd(_mm256_min_pd(acc, v), _mm256_min_pd(v, acc));
+    }
+    if (_mm256_movemask_pd(unordered) != 0) return firstNaN(x, count);
+    double lanes[4];
+    _mm256_storeu_pd(lanes, acc);
+    double result = lesser(lesser(lanes[0], lanes[1]), lesser(lanes[2], lanes[3]));
+    return minFrom(x, i, count, result);
+}
+
+TARGET_AVX2 static double maxAvx2(const double* x, int count) {
+    __m256d acc = _mm256_set1_pd(x[0]);
+    __m256d unordered = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256d v = _mm256_load_pd(x + i);
+        unordered = _mm256_or_pd(unordered, _mm256_cmp_pd(v, v, _CMP_UNORD_Q));
+        acc = _mm256_and_pd(_mm256_max_pd(acc, v), _mm256_max_pd(v, acc));
+    }
+    if (_mm256_movemask_pd(unordered) != 0) return firstNaN(x, count);
+    double lanes[4];
+    _mm256_storeu_pd(lanes, acc);
+    double result = greater(greater(lanes[0], lanes[1]), greater(lanes[2], lanes[3]));
+    return maxFrom(x, i, count, result);
+}
+
+TARGET_AVX2 static void prefixSumAvx2(double* x, int count) {
+    __m256d zero = _mm256_setzero_pd();
+    __m256d carry = zero;
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256d v = _mm256_load_pd(x + i);
+        // [a, b, c, d] -> [a, a + b, b + c, c + d]
+        v = _mm256_add_pd(v, _mm256_blend_pd(_mm256_permute4x64_pd(v, 0x90), zero, 0x1));
+        // -> [a, a + b, a + b + c, a + b + c + d]
+        v = _mm256_add_pd(v, _mm256_permute2f128_pd(v, v, 0x08));
+        v = _mm256_add_pd(v, carry);
+        _mm256_store_pd(x + i, v);
+        carry = _mm256_permute4x64_pd(v, 0xFF);
+    }
+    prefixSumFrom(x, i, count);
+}
+
+static const Float64Kernels avx2Kernels = {
+        "avx2", sumAvx2, dotAvx2, scaleAvx2, axpyAvx2, minAvx2, maxAvx2, prefixSumAvx2
+};
+
+#endif
+
+static const Float64Kernels* chooseKernels(void) {
+    const char* forced = getenv("CLOX_SIMD");
+    if (forced != NULL && strcmp(forced, "scalar") == 0) return &scalarKernels;
+
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    bool avx2 = __builtin_cpu_supports("avx2");
+    bool sse2 = __builtin_cpu_supports("sse2");
+    if (forced != NULL && strcmp(forced, "sse2") == 0 && sse2) return &sse2Kernels;
+    if (avx2) return &avx2Kernels;
+    if (sse2) return &sse2Kernels;
+#endif
+
+    return &scalarKernels;
+}
+
+// Every thread would choose the same kernels, so it doesn't matter which one gets to store its choice
+static _Atomic(const Float64Kernels*) chosenKernels = NULL;
+
+const Float64Kernels* float64Kernels(void) {
+    const Float64Kernels* kernels = atomic_load_explicit(&chosenKernels, memory_order_relaxed);
+    if (kernels == NULL) {
+        kernels = chooseKernels();
+        atomic_store_explicit(&chosenKernels, kernels, memory_order_relaxed);
+    }
+    return kernels;
+}
+
+// Sorting: an LSD radix sort, a byte at a time, on the doubles' bits mapped to integers that sort in the same order.
+// Comparison sorts are stuck branching on every comparison, which makes them slow on unpredictable data.
+
+// Flips the sign bit of positive numbers and every bit of negative ones, so the integers order like the doubles
+static uint64_t sortKey(uint64_t bits) {
+    uint64_t mask = (uint64_t)-(int64_t)(bits >> 63) | 0x8000000000000000ull;
+    return bits ^ mask;
+}
+
+static uint64_t unsortKey(uint64_t key) {
+    uint64_t mask = (key >> 63) ? 0x8000000000000000ull : ~0ull;
+    return key ^ mask;
+}
+
+// Below this many elements the histograms cost more than they save
+#define RADIX_SORT_MIN 64
+
+void float64Sort(double* x, int count) {
+    if (count < 2) return;
+
+    // sort the keys in place of the doubles: same size, and memcpy keeps the type punning legal
+    uint64_t* keys = malloc(sizeof(uint64_t) * count);
+    if (keys == NULL) exit(1);
+    memcpy(keys, x, sizeof(uint64_t) * count);
+    for (int i = 0; i < count; i++) keys[i] = sortKey(keys[i]);
+
+    if (count < RADIX_SORT_MIN) {
+        for (int i = 1; i < count; i++) {
+            uint64_t key = keys[i];
+            int j = i;
+            for (; j > 0 && keys[j - 1] > key; j--) keys[j] = keys[j - 1];
+            keys[j] = key;
+        }
+    } else {
+        uint64_t* scratch = malloc(sizeof(uint64_t) * count);
+        if (scratch == NULL) exit(1);
+
+        // every pass's histogram, counted in one read of the keys
+        int counts[8][256] = {0};
+        for (int i = 0; i < count; i++) {
+            for (int pass = 0; pass < 8; pass++) counts[pass][(keys[i] >> (pass * 8)) & 0xFF]++;
+        }
+
+        uint64_t* from = keys;
+        uint64_t* to = scratch;
+        for (int pass = 0; pass < 8; pass++) {
+            int* passCounts = counts[pass];
+            int shift = pass * 8;
+            // a byte that's the same in every key (say, the exponent of numbers of similar size) can't reorder anything
+            if (passCounts[(from[0] >> shift) & 0xFF] == count) continue;
+
+            int offset = 0;
+            for (int b = 0; b < 256; b++) {
+                int bucketCount = passCounts[b];
+                passCounts[b] = offset;
+                offset += bucketCount;
+            }
+            for (int i = 0; i < count; i++) to[passCounts[(from[i] >> shift) & 0xFF]++] = from[i];
+
+            uint64_t* swap = from;
+            from = to;
+            to = swap;
+        }
+
+        if (from != keys) memcpy(keys, from, sizeof(uint64_t) * count);
+        free(scratch);
+    }
+
+    for (int i = 0; i < count; i++) keys[i] = unsortKey(keys[i]);
+    memcpy(x, keys, sizeof(uint64_t) * count);
+    free(keys);
+}
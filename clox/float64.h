@@ -0,0 +1,33 @@
+//
+// Bulk kernels over packed doubles, for Float64Array's natives.
+// There's a scalar, an SSE2 and an AVX2 version of each kernel, and the best one the CPU supports is picked the first
+// time float64Kernels() is called. Setting CLOX_SIMD to scalar, sse2 or avx2 forces a (supported) choice, for testing.
+//
+
+#ifndef CLOX_FLOAT64_H
+#define CLOX_FLOAT64_H
+
+#include "common.h"
+
+// Float64Array storage is aligned to this, so the kernels can use aligned loads and stores from the start of an array
+#define FLOAT64_ALIGNMENT 32
+
+// sum and dot add in the same order in every set of kernels (see combineLanes), so they give the same result whichever
+// runs. prefixSum's vector kernels add within each vector first, so it can round differently from one set to another.
+typedef struct {
+    const char* name;
+    double (*sum)(const double* x, int count);
+    double (*dot)(const double* x, const double* y, int count);
+    void (*scale)(double* x, double factor, int count); // x *= factor
+    void (*axpy)(double a, const double* x, double* y, int count); // y += a * x
+    double (*min)(const double* x, int count); // count must be at least 1. The first NaN if there is one, and -0 < 0.
+    double (*max)(const double* x, int count); // likewise
+    void (*prefixSum)(double* x, int count); // in place: x[i] becomes x[0] + ... + x[i]
+} Float64Kernels;
+
+const Float64Kernels* float64Kernels(void);
+
+// Sorts x ascending in place. Negative NaNs sort before everything else, and positive ones after.
+void float64Sort(double* x, int count);
+
+#endif //CLOX_FLOAT64_H
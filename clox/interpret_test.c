@@ -1,17 +1,41 @@
 //
 // Created by Rita Bennett-Chew on 2/11/24.
 //
-/* run integration test with source .lox code hard-coded here:
+/* Integration test runner: runs every .lox file under the test directory and compares
+ * what the VM writes to fout/ferr against the `// expect: ...` style comments in the file.
+ *
+ * Usage: integrationTests [-j jobs] [-O] [testDir]
+ *
+ * With -O every test is compiled with the whole-function passes on, as `clox -O` would.
+ * CLOX_SIMD=scalar|sse2|avx2 in the environment picks the Float64Array and scanner kernels, as it does for clox.
+ *
+ * Test files are discovered at startup (no hard-coded count), then handed out to a pool of
+ * worker processes. Each worker pulls the next test index from a counter in shared memory,
+ * runs the file in its own VM with its own memstreams, and writes the result (and timing)
+ * into a shared results array, which the parent reports on once every worker has exited.
+ * Workers are processes rather than threads so a crash in one test can't take the whole suite down.
  */
 
-#include <stdio.h>
+#define _GNU_SOURCE // strcasestr
+
 #include <dirent.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
-#include "utest.h"
 #include "vm.h"
-#include "memory.h"
 
-#define TEST_FILE_COUNTS 246
+#define DEFAULT_TEST_DIR "../test"
+
+// -O: run the tests with vm.optimize on. Workers are forked after it's set, so they all see it.
+static bool optimizeTests = false;
+#define SLOWEST_TESTS_SHOWN 10
+#define RESULT_DETAIL_MAX 1024
 
 typedef struct {
     char* bufp;
@@ -19,10 +43,10 @@ typedef struct {
     FILE* fptr;
 } MemBuf;
 
-void initMemBuf(MemBuf* memBuf) {
+static void initMemBuf(MemBuf* memBuf) {
     memBuf->bufp = NULL;
     memBuf->size = 0;
-    memBuf->fptr = NULL;
+    memBuf->fptr = open_memstream(&memBuf->bufp, &memBuf->size);
 }
 
 typedef enum {
@@ -30,305 +54,206 @@ typedef enum {
     EXP_ERROR,
     EXP_LINE,
     EXP_RUNTIME_ERROR,
-    EXP_SYNTAX_ERROR,
-    EXP_STACK_TRACE_ERROR
 } ExpectedType;
 
+// A dynamic array of paths to every .lox file found under the test directory
 typedef struct {
-    ExpectedType type;
-    char* output;
-} ExpectedLine;
+    int capacity;
+    int count;
+    char** paths;
+} TestPaths;
 
-// An ExpectedArray is a dynamic array of expected lines. One is generated for each file.
+typedef enum {
+    RESULT_PENDING, // no worker has picked the test up yet
+    RESULT_RUNNING, // a worker started the test but never finished it (it crashed)
+    RESULT_PASSED,
+    RESULT_FAILED,
+} ResultStatus;
+
+// One per test file. Lives in memory shared between the parent and all workers
 typedef struct {
-    uint32_t capacity;
-    uint32_t count;
-    ExpectedLine* outLines;
-} ExpectedArray;
-
-// Use globals so we can assign from main, use in tests.
-VM vm;
-MemBuf outActual, errActual;
-MemBuf outExpected, errExpected;
-int numTests = 0;
-
-// data for each file
-struct FixtureData {
-    ExpectedArray* expectedsForCurrFile;
-};
-
-// dynamically add an ExpectedLine to ExpectedArray->outLines
-void addToExpecteds(ExpectedArray* exps, ExpectedLine* expLine) {
-    if (exps->capacity < exps->count+1) {
-        int oldCapacity = exps->capacity;
-        exps->capacity = GROW_CAPACITY(oldCapacity);
-        exps->outLines = GROW_ARRAY(&vm, ExpectedLine, exps->outLines, oldCapacity, exps->capacity);
-    }
-    exps->outLines[exps->count].output = expLine->output;
-    exps->outLines[exps->count++].type = expLine->type;
+    ResultStatus status;
+    double millis;
+    char detail[RESULT_DETAIL_MAX]; // expected vs. actual, if the test failed
+} TestResult;
+
+static void initTestPaths(TestPaths* tests) {
+    tests->capacity = 0;
+    tests->count = 0;
+    tests->paths = NULL;
 }
 
-// Create a new ExpectedLine from a type, comment[start..len]
-ExpectedLine* newExpectedLine(ExpectedType type, char* comment, uint32_t startAt, uint32_t finalOutputLen) {
-    ExpectedLine* ret = malloc(sizeof(ExpectedLine*));
-    ret->type = type;
-    // ret->output is a char*, which will be freed in getExpectedStrings
-    ret->output = malloc(sizeof(char*) * (finalOutputLen-startAt+1));
-    strlcpy(ret->output, &comment[startAt], finalOutputLen+1);
-    return ret;
+static void addTestPath(TestPaths* tests, const char* dirPath, const char* fileName) {
+    if (tests->capacity < tests->count + 1) {
+        tests->capacity = tests->capacity < 8 ? 8 : tests->capacity * 2;
+        tests->paths = realloc(tests->paths, sizeof(char*) * tests->capacity);
+        if (tests->paths == NULL) exit(74);
+    }
+
+    size_t length = strlen(dirPath) + 1 /* '/' */ + strlen(fileName) + 1 /* NUL */;
+    char* path = malloc(length);
+    if (path == NULL) exit(74);
+    snprintf(path, length, "%s/%s", dirPath, fileName);
+    tests->paths[tests->count++] = path;
 }
 
-// Parse sourceLine and add to exps if we encounter an Expect line like a value or error.
-// ExpectedArray is dynamic: see chunk.c implementation of chunk->code for how to write to it
-static void getExpectedIfAnyFromSourceLine(char* sourceLine, ExpectedArray* exps) {
-    // get pos of a comment
-    // if there is no comment, return
-    // if the comment matches expect value: do stuff
-    // if the comment matches expect error: do stuff
-    // if the comment matches ...
-    char* commentPrefix = "// ";
-    int commentPrefixLen = strlen(commentPrefix);
-    char* comment = strcasestr(sourceLine, commentPrefix);
-    if (comment == NULL) {
-        // no output (expect) comment found
-        return;
+static void freeTestPaths(TestPaths* tests) {
+    for (int i = 0; i < tests->count; i++) {
+        free(tests->paths[i]);
     }
+    free(tests->paths);
+    initTestPaths(tests);
+}
 
-    // Eg: "expect runtime error: msg" --> want prefix + msg (entire comment)
-    char* expectRuntimeErrorPrefix = "expect runtime error: ";
-    uint32_t expectPrefixLen = strlen(expectRuntimeErrorPrefix) + 3; // plus 3 for preceding '// '
-    char* expectRuntimeError = strcasestr(comment, expectRuntimeErrorPrefix);
-    if (expectRuntimeError != NULL) {
-        ExpectedLine* expected = newExpectedLine(EXP_RUNTIME_ERROR, comment, expectPrefixLen, strlen(comment));
-        addToExpecteds(exps, expected);
+// Recursively gathers the paths of all .lox test files within enclosingDirPath
+static void getTestFilepaths(const char* enclosingDirPath, TestPaths* tests) {
+    DIR* dirp = opendir(enclosingDirPath);
+    if (dirp == NULL) {
+        fprintf(stderr, "Could not open directory \"%s\".\n", enclosingDirPath);
         return;
     }
 
-    // Eg: "[line 3] Error at '{': Expect expression." --> want prefix and msg (entire comment)
-    char* expectLineErrorAtPrefix = "[line ";
-    expectPrefixLen = strlen(expectLineErrorAtPrefix);
-    char* expectLineErrorAt = strcasestr(comment, expectLineErrorAtPrefix);
-    if (expectLineErrorAt != NULL) {
-        ExpectedLine* expected = newExpectedLine(EXP_LINE, comment, 0, strlen(comment));
-        addToExpecteds(exps, expected);
-        return;
-    }
+    struct dirent* dir;
+    while ((dir = readdir(dirp)) != NULL) {
+        if (dir->d_name[0] == '.') continue; // ".", "..", ".DS_Store" and friends
 
-    // Eg: "Error at 'return': msg" --> want prefix & msg (entire comment)
-    char* expectErrorAtPrefix = "Error at ";
-    expectPrefixLen = strlen(expectErrorAtPrefix);
-    char* expectErrorAt = strcasestr(comment, expectErrorAtPrefix);
-    if (expectErrorAt != NULL) {
-        ExpectedLine* expected = newExpectedLine(EXP_ERROR, comment, 3, strlen(comment));
-        addToExpecteds(exps, expected);
-        return;
+        char* dot = strrchr(dir->d_name, '.'); // strrchr will get the rightmost '.'
+        if (dot && strcmp(dot, ".lox") == 0) {
+            addTestPath(tests, enclosingDirPath, dir->d_name);
+        } else if (dir->d_type == DT_DIR) {
+            size_t length = strlen(enclosingDirPath) + 1 + strlen(dir->d_name) + 1;
+            char newDirPath[length];
+            snprintf(newDirPath, length, "%s/%s", enclosingDirPath, dir->d_name);
+            getTestFilepaths(newDirPath, tests);
+        }
     }
 
-    char* errorPrefix = "Error: ";
-    expectPrefixLen = strlen(errorPrefix);
-    char* error = strcasestr(comment, errorPrefix);
-    if (error != NULL) {
-        ExpectedLine* expected = newExpectedLine(EXP_ERROR, comment, 3, strlen(comment));
-        addToExpecteds(exps, expected);
+    closedir(dirp);
+}
+
+static int comparePaths(const void* a, const void* b) {
+    return strcmp(*(const char**)a, *(const char**)b);
+}
+
+// Error lines may start with "[line #] ", which we don't care about in this context
+static const char* stripLineNumber(const char* line) {
+    if (strncmp(line, "[line ", 6) != 0) return line;
+    const char* rightBracket = strchr(line, ']');
+    return rightBracket != NULL && rightBracket[1] == ' ' ? rightBracket + 2 : line;
+}
+
+// Parse sourceLine and, if it has an expectation comment like a value or an error,
+// append the expected text to the expected stdout or stderr stream
+static void getExpectedIfAnyFromSourceLine(const char* sourceLine, FILE* outExpected, FILE* errExpected) {
+    const char* comment = strstr(sourceLine, "// ");
+    if (comment == NULL) return; // no expect comment found
+    comment += 3;
+
+    // Eg: "expect runtime error: msg" --> want just the msg
+    const char* expectRuntimeErrorPrefix = "expect runtime error: ";
+    const char* found = strcasestr(comment, expectRuntimeErrorPrefix);
+    if (found != NULL) {
+        fputs(found + strlen(expectRuntimeErrorPrefix), errExpected);
         return;
     }
 
-
-    // Eg: "expect 1" --> just want value
-    char* expectPrefix = "expect: ";
-    expectPrefixLen = strlen(expectPrefix);
-    char* expectValue = strcasestr(comment, expectPrefix);
-    if (expectValue != NULL) {
-        ExpectedLine* expected = newExpectedLine(EXP_OUTPUT, comment, commentPrefixLen+expectPrefixLen, strlen(comment)-commentPrefixLen-expectPrefixLen);
-        addToExpecteds(exps, expected);
+    // Eg: "[line 3] Error at '{': Expect expression." --> want "Error at ..." (the line number is stripped from actual output too)
+    if (strcasestr(comment, "[line ") != NULL) {
+        fputs(stripLineNumber(comment), errExpected);
         return;
     }
-}
 
-// A recursive function that gathers names of all .lox test files within enclosingDirPath, adds them to testFiles
-static void getTestFilepaths(char* enclosingDirPath, char** loxFilePaths) {
-    DIR* dirp;
-    struct dirent* dir;
-    dirp = opendir(enclosingDirPath);
-    if (dirp == NULL) {
-        fprintf(stderr, "Could not open directory \"%s\".\n", enclosingDirPath);
+    // Eg: "Error at 'return': msg" or "Error: msg" --> want prefix & msg (entire comment)
+    if (strcasestr(comment, "Error at ") != NULL || strcasestr(comment, "Error: ") != NULL) {
+        fputs(comment, errExpected);
+        return;
     }
-    while ((dir = readdir(dirp)) != NULL) {
-        int enclosingDirPathLen = strlen(enclosingDirPath);
 
-        char* dot = strrchr(dir->d_name, '.'); // strrchr will get the rightmost '.'
-        if (dot && strcmp(dot, ".lox") == 0) {
-            // Add .lox files to loxFiles
-            // plus one for separating slash, one for null term
-            char testFile[enclosingDirPathLen + 2];
-            // make copy of enclosingDirPath b/c we want to use it in its unaltered state
-            // for other .lox file iterations of this loop & recursive searching.
-            strlcpy(testFile, enclosingDirPath, enclosingDirPathLen + 1);
-            testFile[enclosingDirPathLen] = '/';
-            testFile[enclosingDirPathLen+1] = '\0';
-
-            // TODO (remove) we're good above here, assume
-            // TODO (remove) what is the goal with the following lines?
-            // copy next filename (not path) from dir
-            uint32_t testFileLen = strlcat(testFile, dir->d_name, enclosingDirPathLen + 1 /*for ending '/'*/ + strlen(dir->d_name) + 1 /* for NUL*/);
-            char* loxFilePathPtr = malloc(testFileLen*sizeof(char*));
-            strlcpy(loxFilePathPtr, testFile, testFileLen + 1);
-            loxFilePaths[numTests++] = loxFilePathPtr;
-        } else if (dir->d_type == DT_DIR) {
-            // recursively search any directories found here
-            if (strcmp(dir->d_name, ".") == 0 || strcmp(dir->d_name, "..") == 0 || strcmp(dir->d_name, ".DS_Store") == 0) {
-                continue;
-            }
-            // concat new dir name to original enclosingDirPath
-            // but first make copy of enclosingDirPath so original is unaltered
-            char newDirpath[enclosingDirPathLen + 2];
-            strlcpy(newDirpath, enclosingDirPath, enclosingDirPathLen+1);
-            newDirpath[enclosingDirPathLen] = '/';
-            strlcat(newDirpath, dir->d_name, enclosingDirPathLen + strlen(dir->d_name) + 2);
-            getTestFilepaths(newDirpath, loxFilePaths);
-        }
+    // Eg: "expect: 1" --> just want value
+    const char* expectPrefix = "expect: ";
+    found = strcasestr(comment, expectPrefix);
+    if (found != NULL) {
+        fputs(found + strlen(expectPrefix), outExpected);
     }
 }
 
 // Reads file line by line. For each line, gather any expected values/errors, add to source buffer, which will be returned.
-static char* parseFileForTesting(const char* path, ExpectedArray* expectedsForThisFile) {
+static char* parseFileForTesting(const char* path, FILE* outExpected, FILE* errExpected) {
     FILE* file = fopen(path, "rb");
-
     if (file == NULL) {
         fprintf(stderr, "Could not open file \"%s\".\n", path);
-        exit(74);
+        return NULL;
     }
 
-    // get size of file, use it to allocate sourceBuffer
-    fseek(file, 0L, SEEK_END);
-    size_t fileSize = ftell(file);
-    rewind(file);
-    char* sourceBuffer = (char*)malloc(fileSize + 1);
-    if (sourceBuffer == NULL) {
-        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-        exit(74);
-    }
+    MemBuf source;
+    initMemBuf(&source);
 
     char* line = NULL;
     size_t lineCapp = 0;
     ssize_t read; // will be -1 at eof, or at error
-    size_t sourceBufferSize = 0;
-    sourceBuffer[0] = '\0';
-
     while ((read = getline(&line, &lineCapp, file)) != -1) {
-        getExpectedIfAnyFromSourceLine(line, expectedsForThisFile);
-        // strlcat takes null-terminated baseString, null-term toAppendString, and total size of new string (base size + toAppend size + 1 for null term)
-        sourceBufferSize = strlcat(sourceBuffer, line, read + sourceBufferSize + 1);
+        getExpectedIfAnyFromSourceLine(line, outExpected, errExpected);
+        fwrite(line, sizeof(char), read, source.fptr);
     }
 
     fclose(file);
     free(line);
 
-    return sourceBuffer;
-}
-
-static void getExpectedStrings(ExpectedArray* exps, MemBuf outExp, MemBuf errExp) {
-    // convert exps struct into expected out & expected err strings
-    // from exps, compose char* for expectedOutput, char* for expectedErrs
-    // loop over all exps, which is for this current file.
-    // switch on type of expLine
-    uint32_t outLen = 0;
-    uint32_t errLen = 0;
-    for (int i = 0; i < exps->count; i++) {
-        switch (exps->outLines[i].type) {
-            case EXP_OUTPUT:
-                fprintf(outExp.fptr, "%s", exps->outLines[i].output);
-                free(exps->outLines[i].output);
-                break;
-            case EXP_ERROR:
-            case EXP_LINE:
-            case EXP_RUNTIME_ERROR:
-            case EXP_SYNTAX_ERROR:
-            case EXP_STACK_TRACE_ERROR:
-                fprintf(errExp.fptr, "%s", exps->outLines[i].output);
-                free(exps->outLines[i].output);
-                break;
-        }
-    }
+    // closing the stream finalizes bufp, which the caller now owns
+    fclose(source.fptr);
+    return source.bufp;
 }
 
-static void freeTestPaths(char** testPaths, int count) {
-    for (int i = 0; i < count; i++) {
-        free((void*) testPaths[i]);
-    }
+// Only the first line of what the VM wrote to ferr is compared
+static char* getFirstLineOnly(char* lines) {
+    char* firstNewline = strchr(lines, '\n');
+    if (firstNewline) firstNewline[1] = '\0';
+    return lines;
 }
 
-void initFileExpecteds(ExpectedArray* exps) {
-    // A dynamically growing array since we have no way of knowing how many expectedValues we'll have
-    exps->capacity = 0;
-    exps->count = 0;
-    exps->outLines = NULL;
+static double elapsedMillis(struct timespec* start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (double)(end.tv_sec - start->tv_sec) * 1000.0 + (double)(end.tv_nsec - start->tv_nsec) / 1e6;
 }
 
-// Another global, the length of which is number of test files
-char* testPaths[TEST_FILE_COUNTS];
-ExpectedArray exps;
+// Runs a single test file in a fresh VM and records the outcome in result
+static void runTest(const char* path, TestResult* result) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-UTEST_I_SETUP(FixtureData) {
+    MemBuf outActual, errActual, outExpected, errExpected;
     initMemBuf(&outActual);
     initMemBuf(&errActual);
     initMemBuf(&outExpected);
     initMemBuf(&errExpected);
-    outActual.fptr = open_memstream(&outActual.bufp, &outActual.size);
-    errActual.fptr = open_memstream(&errActual.bufp, &errActual.size);
-    outExpected.fptr = open_memstream(&outExpected.bufp, &outExpected.size);
-    errExpected.fptr = open_memstream(&errExpected.bufp, &errExpected.size);
 
-    initVM(&vm, outActual.fptr, errActual.fptr);
-
-    initFileExpecteds(&exps); // a struct that holds cap of, count of, and expectedArrays;
-    utest_fixture->expectedsForCurrFile = &exps;
-    printf("Test: %s (%i)\n", testPaths[utest_index], (u_int32_t) utest_index);
-}
-char* getFirstLineOnly(char* errActualMultipleLines) {
-    // find index of first '\n'
-    char* firstNewline = strchr(errActualMultipleLines, '\n');
-
-    // if found, add a '\0' after it
-    if (firstNewline) {
-        uint16_t firstNewline_i = firstNewline - errActualMultipleLines;
-        errActualMultipleLines[firstNewline_i+1] = '\0';
-    }
-
-    return errActualMultipleLines;
-}
-
-char* stripLineNumber(char* errActualWithLineInfo) {
-    // find index of ']'
-    char* rightBracket = strchr(errActualWithLineInfo, ']');
-
-    // if found, return char* from that index+2
-    if (rightBracket) {
-        return rightBracket + 2;
-    } else {
-        return errActualWithLineInfo;
+    char* source = parseFileForTesting(path, outExpected.fptr, errExpected.fptr);
+    if (source != NULL) {
+        VM vm;
+        initVM(&vm, outActual.fptr, errActual.fptr);
+        vm.optimize = optimizeTests;
+        interpret(&vm, source);
+        freeVM(&vm);
+        free(source);
     }
-}
-
-UTEST_I_TEARDOWN(FixtureData) {
-    char* source = parseFileForTesting(testPaths[utest_index], utest_fixture->expectedsForCurrFile);
-    interpret(&vm, source);
-
-    getExpectedStrings(utest_fixture->expectedsForCurrFile, outExpected, errExpected);
 
     fflush(outActual.fptr);
     fflush(errActual.fptr);
     fflush(outExpected.fptr);
     fflush(errExpected.fptr);
 
-    // errActual.bufp could be multiple lines. We only care about the first one.
-    char* errActualSingleLine = getFirstLineOnly(errActual.bufp);
-
-    // errActualSingleLine could start with "[line #]" which we don't actually care about in this context. strip it before comparing to outExpected
-    char* errActualWithoutLineNumber = stripLineNumber(errActualSingleLine);
+    const char* errActualFirstLine = stripLineNumber(getFirstLineOnly(errActual.bufp));
 
-    EXPECT_STREQ(outExpected.bufp, outActual.bufp);
-    EXPECT_STREQ(errExpected.bufp, errActualWithoutLineNumber);
+    if (source != NULL && strcmp(outExpected.bufp, outActual.bufp) == 0 && strcmp(errExpected.bufp, errActualFirstLine) == 0) {
+        result->status = RESULT_PASSED;
+        result->detail[0] = '\0';
+    } else {
+        result->status = RESULT_FAILED;
+        snprintf(result->detail, RESULT_DETAIL_MAX,
+                 "  expected stdout:\n%s\n  actual stdout:\n%s\n  expected stderr:\n%s\n  actual stderr:\n%s\n",
+                 outExpected.bufp, outActual.bufp, errExpected.bufp, errActualFirstLine);
+    }
 
     fclose(outActual.fptr);
     fclose(errActual.fptr);
@@ -338,27 +263,152 @@ UTEST_I_TEARDOWN(FixtureData) {
     free(errActual.bufp);
     free(outExpected.bufp);
     free(errExpected.bufp);
+
+    result->millis = elapsedMillis(&start);
 }
 
-UTEST_I(FixtureData, LoxTest, TEST_FILE_COUNTS) {}
+// A worker keeps claiming the next unclaimed test until there are none left
+static void runWorker(TestPaths* tests, TestResult* results, int* nextTest) {
+    for (;;) {
+        int index = __atomic_fetch_add(nextTest, 1, __ATOMIC_RELAXED);
+        if (index >= tests->count) return;
 
-UTEST_STATE();
+        results[index].status = RESULT_RUNNING;
+        runTest(tests->paths[index], &results[index]);
+    }
+}
 
-int main(int argc, const char* argv[]) {
-    // TODO: Refactor so that MemBufs are used instead of ExpectedArray?
+// Forks `jobs` workers, which share the results array and next-test counter via an anonymous shared mapping,
+// then waits for all of them to finish
+static void runAllTests(TestPaths* tests, TestResult* results, int* nextTest, int jobs) {
+    pid_t workers[jobs];
+    int started = 0;
+
+    fflush(stdout);
+    fflush(stderr);
+    for (int i = 0; i < jobs; i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            runWorker(tests, results, nextTest);
+            _exit(0);
+        }
+        if (pid < 0) {
+            perror("fork");
+            break;
+        }
+        workers[started++] = pid;
+    }
+
+    // if we couldn't start any workers, run everything in this process instead
+    if (started == 0) runWorker(tests, results, nextTest);
+
+    for (int i = 0; i < started; i++) {
+        int status;
+        waitpid(workers[i], &status, 0);
+        if (WIFSIGNALED(status)) {
+            fprintf(stderr, "Worker %d killed by signal %d.\n", (int)workers[i], WTERMSIG(status));
+        }
+    }
+}
+
+typedef struct {
+    double millis;
+    int index;
+} TestTiming;
+
+static int compareByMillisDesc(const void* a, const void* b) {
+    double left = ((const TestTiming*)a)->millis;
+    double right = ((const TestTiming*)b)->millis;
+    return (left < right) - (left > right);
+}
+
+// Prints a line per test, the details of each failure, then the slowest tests. Returns the failure count.
+static int reportResults(TestPaths* tests, TestResult* results, double totalMillis, int jobs) {
+    int failed = 0;
+    double cpuMillis = 0;
+
+    for (int i = 0; i < tests->count; i++) {
+        TestResult* result = &results[i];
+        cpuMillis += result->millis;
+
+        switch (result->status) {
+            case RESULT_PASSED:
+                printf("[      OK ] %s (%.3fms)\n", tests->paths[i], result->millis);
+                break;
+            case RESULT_FAILED:
+                failed++;
+                printf("[  FAILED ] %s (%.3fms)\n%s", tests->paths[i], result->millis, result->detail);
+                break;
+            case RESULT_RUNNING:
+                failed++;
+                printf("[ CRASHED ] %s\n", tests->paths[i]);
+                break;
+            case RESULT_PENDING:
+                failed++;
+                printf("[ NOT RUN ] %s\n", tests->paths[i]);
+                break;
+        }
+    }
+
+    TestTiming* timings = malloc(sizeof(TestTiming) * tests->count);
+    for (int i = 0; i < tests->count; i++) {
+        timings[i].millis = results[i].millis;
+        timings[i].index = i;
+    }
+    qsort(timings, tests->count, sizeof(TestTiming), compareByMillisDesc);
 
-//    // 1. Setup before all tests
-    *testPaths = malloc(sizeof(char*) * TEST_FILE_COUNTS);
+    int shown = tests->count < SLOWEST_TESTS_SHOWN ? tests->count : SLOWEST_TESTS_SHOWN;
+    printf("\nSlowest %d tests:\n", shown);
+    for (int i = 0; i < shown; i++) {
+        printf("  %9.3fms  %s\n", timings[i].millis, tests->paths[timings[i].index]);
+    }
+    free(timings);
 
-    // If running/debugging from clion:
-    getTestFilepaths("../test", testPaths);
+    printf("\n%d tests, %d passed, %d failed, %.3fms wall (%.3fms summed over %d jobs)\n",
+           tests->count, tests->count - failed, failed, totalMillis, cpuMillis, jobs);
+    return failed;
+}
 
-    // If running with leaks: ($ leaks --atExit -- /Users/rita/Documents/Projects-Code/teachYourselfCSdotcom/08_languages/lox/clox/cmake-build-leaks/integrationTests)
-//    getTestFilepaths("./test", testPaths);
+int main(int argc, const char* argv[]) {
+    const char* testDir = DEFAULT_TEST_DIR; // relative to the build dir, e.g. when running from clion
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            jobs = strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-O") == 0) {
+            optimizeTests = true;
+        } else {
+            testDir = argv[i];
+        }
+    }
+    if (jobs < 1) jobs = 1;
+
+    TestPaths tests;
+    initTestPaths(&tests);
+    getTestFilepaths(testDir, &tests);
+    if (tests.count == 0) {
+        fprintf(stderr, "No .lox tests found under \"%s\".\n", testDir);
+        return 1;
+    }
+    qsort(tests.paths, tests.count, sizeof(char*), comparePaths);
+    if (jobs > tests.count) jobs = tests.count;
+
+    // the next-test counter lives right after the results, in the same shared mapping
+    size_t sharedSize = sizeof(TestResult) * tests.count + sizeof(int);
+    TestResult* results = mmap(NULL, sharedSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (results == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    int* nextTest = (int*)&results[tests.count];
 
-    // 2. Run all tests
-    utest_main(argc, argv);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    runAllTests(&tests, results, nextTest, (int)jobs);
+    int failed = reportResults(&tests, results, elapsedMillis(&start), (int)jobs);
 
-    // 3. Teardown after all tests
-    freeTestPaths(testPaths, numTests);
-}
\ No newline at end of file
+    munmap(results, sharedSize);
+    freeTestPaths(&tests);
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,477 @@
+//
+// See ir.h. Decoding and encoding, and the bits of analysis every pass needs: how deep the stack is at each
+// instruction, the basic blocks, and which local slots closures capture.
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ir.h"
+#include "memory.h"
+
+bool isConditionalJump(uint8_t op) {
+    switch (op) {
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_TRUE:
+        case OP_JUMP_IF_EQUAL:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_GREATER:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_LESS:
+        case OP_JUMP_IF_NOT_LESS:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool isJump(uint8_t op) {
+    return op == OP_JUMP || op == OP_LOOP || op == OP_FOR_LOOP || isConditionalJump(op);
+}
+
+bool isBackwardJump(uint8_t op) {
+    return op == OP_LOOP || op == OP_FOR_LOOP;
+}
+
+// The conditional jumps that leave the condition on the stack
+bool keepsCondition(uint8_t op) {
+    return op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_TRUE;
+}
+
+bool isPopJump(uint8_t op) {
+    return op == OP_POP_JUMP_IF_FALSE || op == OP_POP_JUMP_IF_TRUE;
+}
+
+static int instructionLength(Chunk* chunk, int offset) {
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_GET_SUPER:
+        case OP_BUILD_LIST:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CLASS:
+        case OP_METHOD:
+            return 2;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_TRUE:
+        case OP_JUMP_IF_EQUAL:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_GREATER:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_LESS:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_LOOP:
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+            return 3;
+        case OP_CLOSURE: {
+            ObjFunction* function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+            return 2 + 2 * function->upvalueCount;
+        }
+        case OP_FOR_LOOP:
+            return 7;
+        default:
+            return 1;
+    }
+}
+
+// Returns false if the chunk has something in it this doesn't understand, in which case it has to be left alone
+bool decodeProgram(Program* program, VM* vm, ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+    program->vm = vm;
+    program->function = function;
+    program->chunk = chunk;
+    program->capacity = chunk->count;
+    program->code = malloc(sizeof(Instruction) * program->capacity);
+    int* indexAt = malloc(sizeof(int) * (chunk->count + 1));
+    if (indexAt == NULL || program->code == NULL) exit(1);
+
+    program->count = 0;
+    for (int offset = 0; offset < chunk->count;) {
+        Instruction* instruction = &program->code[program->count];
+        instruction->op = chunk->code[offset];
+        instruction->offset = offset;
+        instruction->length = instructionLength(chunk, offset);
+        instruction->arg = instruction->length > 1 ? chunk->code[offset + 1] : 0;
+        instruction->line = chunk->lines[offset];
+        instruction->target = -1;
+        instruction->deleted = false;
+        instruction->isTemp = false;
+        indexAt[offset] = program->count++;
+        for (int i = 1; i < instruction->length; i++) indexAt[offset + i] = -1;
+        offset += instruction->length;
+    }
+    indexAt[chunk->count] = -1;
+
+    bool ok = true;
+    for (int i = 0; i < program->count; i++) {
+        Instruction* instruction = &program->code[i];
+        if (!isJump(instruction->op)) continue;
+        // the jump's always the last two bytes
+        int after = instruction->offset + instruction->length;
+        int jump = (chunk->code[after - 2] << 8) | chunk->code[after - 1];
+        int target = isBackwardJump(instruction->op) ? after - jump : after + jump;
+        if (target < 0 || target >= chunk->count || indexAt[target] < 0) {
+            ok = false;
+            break;
+        }
+        instruction->target = indexAt[target];
+    }
+
+    free(indexAt);
+    return ok;
+}
+
+// Writes the surviving instructions back over the chunk. Returns false, leaving the chunk as it was, if passes made
+// some jump longer than the 16 bits its offset has.
+bool encodeProgram(Program* program) {
+    Chunk* chunk = program->chunk;
+    int* newOffset = malloc(sizeof(int) * (program->count + 1));
+    if (newOffset == NULL) exit(1);
+
+    int count = 0;
+    for (int i = 0; i < program->count; i++) {
+        newOffset[i] = count;
+        if (!program->code[i].deleted) count += program->code[i].length;
+    }
+    newOffset[program->count] = count;
+
+    uint8_t* code = malloc(count + 1);
+    int* lines = malloc(sizeof(int) * (count + 1));
+    if (code == NULL || lines == NULL) exit(1);
+
+    bool fits = true;
+    for (int i = 0; i < program->count && fits; i++) {
+        Instruction* instruction = &program->code[i];
+        if (instruction->deleted) continue;
+        int offset = newOffset[i];
+        code[offset] = instruction->op;
+        if (instruction->length > 1) code[offset + 1] = instruction->arg;
+        for (int j = 2; j < instruction->length; j++) code[offset + j] = chunk->code[instruction->offset + j];
+        for (int j = 0; j < instruction->length; j++) lines[offset + j] = instruction->line;
+        if (instruction->op == OP_FOR_LOOP) {
+            // its bytes have different lines (see emitCountedLoop)
+            memcpy(lines + offset, chunk->lines + instruction->offset, sizeof(int) * instruction->length);
+        }
+
+        if (isJump(instruction->op)) {
+            // deleted targets have already been moved on to the next live instruction
+            int after = offset + instruction->length;
+            int jump = newOffset[instruction->target] - after;
+            if (instruction->op == OP_JUMP || instruction->op == OP_LOOP) code[offset] = jump < 0 ? OP_LOOP : OP_JUMP;
+            if (jump < 0) jump = -jump;
+            if (jump > UINT16_MAX) fits = false;
+            code[after - 2] = (jump >> 8) & 0xff;
+            code[after - 1] = jump & 0xff;
+        }
+    }
+
+    if (!fits) {
+        free(code);
+        free(lines);
+        free(newOffset);
+        return false;
+    }
+
+    // passes can insert code, so it doesn't always get shorter
+    if (count > chunk->capacity) {
+        int oldCapacity = chunk->capacity;
+        chunk->capacity = count;
+        chunk->code = GROW_ARRAY(program->vm, uint8_t, chunk->code, oldCapacity, chunk->capacity);
+        chunk->lines = GROW_ARRAY(program->vm, int, chunk->lines, oldCapacity, chunk->capacity);
+    }
+    memcpy(chunk->code, code, count);
+    memcpy(chunk->lines, lines, sizeof(int) * count);
+    chunk->count = count;
+
+    free(code);
+    free(lines);
+    free(newOffset);
+    return true;
+}
+
+void freeProgram(Program* program) {
+    free(program->code);
+    program->code = NULL;
+    program->count = 0;
+}
+
+// The first instruction at or after index that's still there. Deleting an instruction moves anything that jumped to
+// it on to the next one, so every rewrite has to make sure that's what the jump would have wanted.
+int liveInstruction(Program* program, int index) {
+    while (index < program->count && program->code[index].deleted) index++;
+    return index;
+}
+
+void countIncoming(Program* program) {
+    for (int i = 0; i < program->count; i++) program->code[i].incoming = 0;
+    for (int i = 0; i < program->count; i++) {
+        Instruction* instruction = &program->code[i];
+        if (instruction->deleted || !isJump(instruction->op)) continue;
+        instruction->target = liveInstruction(program, instruction->target);
+        if (instruction->target < program->count) program->code[instruction->target].incoming++;
+    }
+}
+
+// Inserts count instructions before the one at index. Jumps to that instruction (or to deleted ones just before it)
+// still go to it, after the new ones.
+void insertInstructions(Program* program, int index, const Instruction* added, int count) {
+    for (int i = 0; i < program->count; i++) {
+        Instruction* instruction = &program->code[i];
+        if (isJump(instruction->op)) instruction->target = liveInstruction(program, instruction->target);
+    }
+
+    if (program->count + count > program->capacity) {
+        program->capacity = GROW_CAPACITY(program->count + count);
+        program->code = realloc(program->code, sizeof(Instruction) * program->capacity);
+        if (program->code == NULL) exit(1);
+    }
+    memmove(&program->code[index + count], &program->code[index], sizeof(Instruction) * (program->count - index));
+    memcpy(&program->code[index], added, sizeof(Instruction) * count);
+    program->count += count;
+
+    for (int i = 0; i < program->count; i++) {
+        if (i >= index && i < index + count) continue;
+        Instruction* instruction = &program->code[i];
+        if (isJump(instruction->op) && instruction->target >= index) instruction->target += count;
+    }
+}
+
+// How many values an instruction takes off the stack and how many it puts back. The ones that only peek at a value
+// (SET_LOCAL, JUMP_IF_FALSE...) count as taking it and putting it back.
+void stackEffect(Program* program, Instruction* instruction, int* pops, int* pushes) {
+    *pops = 0;
+    *pushes = 1;
+    switch (instruction->op) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_CLOSURE:
+        case OP_CLASS:
+            break;
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_PRINT:
+        case OP_CLOSE_UPVALUE:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_TRUE:
+        case OP_FOR_LOOP:
+        case OP_RETURN:
+            *pops = 1;
+            *pushes = 0;
+            break;
+        case OP_JUMP_IF_EQUAL:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_GREATER:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_LESS:
+        case OP_JUMP_IF_NOT_LESS:
+            *pops = 2;
+            *pushes = 0;
+            break;
+        case OP_JUMP:
+        case OP_LOOP:
+            *pushes = 0;
+            break;
+        case OP_SET_LOCAL:
+        case OP_SET_GLOBAL:
+        case OP_SET_UPVALUE:
+        case OP_GET_PROPERTY:
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_NEGATE_NUMBER:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+            *pops = 1;
+            break;
+        case OP_SET_PROPERTY:
+        case OP_GET_SUPER:
+        case OP_GET_INDEX:
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_GREATER_NUMBER:
+        case OP_LESS_NUMBER:
+        case OP_ADD_NUMBER:
+        case OP_SUBTRACT_NUMBER:
+        case OP_MULTIPLY_NUMBER:
+        case OP_DIVIDE_NUMBER:
+        case OP_INHERIT: // the superclass stays
+        case OP_METHOD:  // and so does the class
+            *pops = 2;
+            break;
+        case OP_SET_INDEX:
+            *pops = 3;
+            break;
+        case OP_BUILD_LIST:
+            *pops = instruction->arg;
+            break;
+        case OP_CALL:
+        case OP_TAIL_CALL: // followed by the OP_RETURN it stands in for, so the rest is the same as a call
+            *pops = instruction->arg + 1;
+            break;
+        case OP_INVOKE:
+            *pops = program->chunk->code[instruction->offset + 2] + 1;
+            break;
+        case OP_SUPER_INVOKE:
+            *pops = program->chunk->code[instruction->offset + 2] + 2;
+            break;
+    }
+}
+
+// The depth of the stack, counting the function and its parameters, before each instruction, or -1 for ones that
+// can't be reached. Returns NULL if the depths don't add up, which they always should for compiled code.
+int* computeDepths(Program* program) {
+    int* depths = malloc(sizeof(int) * (program->count + 1));
+    int* worklist = malloc(sizeof(int) * (program->count + 1));
+    if (depths == NULL || worklist == NULL) exit(1);
+    for (int i = 0; i < program->count; i++) depths[i] = -1;
+
+    int pending = 0;
+    int first = liveInstruction(program, 0);
+    if (first < program->count) {
+        depths[first] = program->function->arity + 1;
+        worklist[pending++] = first;
+    }
+
+    bool ok = true;
+    while (pending > 0 && ok) {
+        int index = worklist[--pending];
+        Instruction* instruction = &program->code[index];
+        int pops, pushes;
+        stackEffect(program, instruction, &pops, &pushes);
+        int after = depths[index] - pops + pushes;
+        if (depths[index] - pops < 0) {
+            ok = false;
+            break;
+        }
+
+        int next[2];
+        int nextCount = 0;
+        if (instruction->op != OP_JUMP && instruction->op != OP_LOOP && instruction->op != OP_RETURN) {
+            next[nextCount++] = liveInstruction(program, index + 1);
+        }
+        if (isJump(instruction->op)) next[nextCount++] = liveInstruction(program, instruction->target);
+
+        for (int i = 0; i < nextCount; i++) {
+            if (next[i] >= program->count) {
+                ok = false;
+            } else if (depths[next[i]] == -1) {
+                depths[next[i]] = after;
+                worklist[pending++] = next[i];
+            } else if (depths[next[i]] != after) {
+                ok = false;
+            }
+        }
+    }
+
+    free(worklist);
+    if (!ok) {
+        free(depths);
+        return NULL;
+    }
+    return depths;
+}
+
+static bool endsBlock(uint8_t op) {
+    return isJump(op) || op == OP_RETURN;
+}
+
+void findBlocks(Program* program, Blocks* blocks) {
+    bool* leader = calloc(program->count + 1, sizeof(bool));
+    blocks->blockOf = malloc(sizeof(int) * (program->count + 1));
+    if (leader == NULL || blocks->blockOf == NULL) exit(1);
+
+    int first = liveInstruction(program, 0);
+    leader[first] = true;
+    for (int i = first; i < program->count; i = liveInstruction(program, i + 1)) {
+        Instruction* instruction = &program->code[i];
+        if (isJump(instruction->op)) leader[liveInstruction(program, instruction->target)] = true;
+        if (endsBlock(instruction->op)) leader[liveInstruction(program, i + 1)] = true;
+    }
+
+    blocks->count = 0;
+    for (int i = first; i < program->count; i = liveInstruction(program, i + 1)) {
+        if (leader[i]) blocks->count++;
+    }
+    blocks->blocks = malloc(sizeof(Block) * (blocks->count + 1));
+    if (blocks->blocks == NULL) exit(1);
+
+    int current = -1;
+    for (int i = 0; i < program->count; i++) {
+        blocks->blockOf[i] = -1;
+        if (program->code[i].deleted) continue;
+        if (leader[i]) {
+            current++;
+            blocks->blocks[current].start = i;
+            if (current > 0) blocks->blocks[current - 1].end = i;
+        }
+        blocks->blockOf[i] = current;
+    }
+    if (current >= 0) blocks->blocks[current].end = program->count;
+
+    for (int b = 0; b < blocks->count; b++) {
+        Block* block = &blocks->blocks[b];
+        block->successorCount = 0;
+        int last = block->start;
+        for (int i = block->start; i < block->end; i = liveInstruction(program, i + 1)) last = i;
+        Instruction* instruction = &program->code[last];
+        if (instruction->op != OP_JUMP && instruction->op != OP_LOOP && instruction->op != OP_RETURN) {
+            int next = liveInstruction(program, last + 1);
+            if (next < program->count) block->successors[block->successorCount++] = blocks->blockOf[next];
+        }
+        if (isJump(instruction->op)) {
+            int target = liveInstruction(program, instruction->target);
+            if (target < program->count) block->successors[block->successorCount++] = blocks->blockOf[target];
+        }
+    }
+
+    free(leader);
+}
+
+void freeBlocks(Blocks* blocks) {
+    free(blocks->blocks);
+    free(blocks->blockOf);
+    blocks->blocks = NULL;
+    blocks->blockOf = NULL;
+    blocks->count = 0;
+}
+
+// The local slots any closure made in the function captures. A closure can change those behind the function's back,
+// so passes can't assume anything about them.
+bool* findCapturedSlots(Program* program) {
+    bool* captured = calloc(UINT8_COUNT, sizeof(bool));
+    if (captured == NULL) exit(1);
+    for (int i = 0; i < program->count; i++) {
+        Instruction* instruction = &program->code[i];
+        if (instruction->deleted || instruction->op != OP_CLOSURE) continue;
+        uint8_t* upvalues = program->chunk->code + instruction->offset + 2;
+        for (int j = 0; j < instruction->length - 2; j += 2) {
+            if (upvalues[j]) captured[upvalues[j + 1]] = true;
+        }
+    }
+    return captured;
+}
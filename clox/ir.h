@@ -0,0 +1,69 @@
+//
+// The optimizer's view of a function: its finished bytecode decoded into a list of instructions, with jumps pointing at
+// instructions rather than byte offsets, so that passes can rewrite, delete and insert instructions freely. Once
+// they're done, the surviving instructions are encoded back over the chunk.
+//
+
+#ifndef CLOX_IR_H
+#define CLOX_IR_H
+
+#include "chunk.h"
+#include "object.h"
+
+typedef struct {
+    uint8_t op;
+    uint8_t arg;     // the first operand byte (a slot, a constant, an argument count...), which passes can change
+    int offset;      // in the original code, where the rest of its operands still are
+    int length;
+    int line;
+    int target;      // for jumps, the index of the instruction jumped to
+    int incoming;    // how many jumps land here
+    bool deleted;
+    bool reachable;
+    bool isTemp;     // a GET_LOCAL or SET_LOCAL of one of the temporaries passes.c adds, rather than of a local
+} Instruction;
+
+typedef struct {
+    VM* vm;
+    ObjFunction* function;
+    Chunk* chunk;
+    Instruction* code;
+    int count;
+    int capacity;
+} Program;
+
+// Basic blocks: a block starts at the first instruction, at every jump target, and after every jump or return
+typedef struct {
+    int start;
+    int end;          // one past the last instruction
+    int successors[2];
+    int successorCount;
+} Block;
+
+typedef struct {
+    Block* blocks;
+    int count;
+    int* blockOf;     // the block each instruction is in, or -1 for deleted ones
+} Blocks;
+
+bool isConditionalJump(uint8_t op);
+bool isJump(uint8_t op);
+bool isBackwardJump(uint8_t op);
+bool keepsCondition(uint8_t op);
+bool isPopJump(uint8_t op);
+
+bool decodeProgram(Program* program, VM* vm, ObjFunction* function);
+bool encodeProgram(Program* program);
+void freeProgram(Program* program);
+
+int liveInstruction(Program* program, int index);
+void countIncoming(Program* program);
+void insertInstructions(Program* program, int index, const Instruction* added, int count);
+
+void stackEffect(Program* program, Instruction* instruction, int* pops, int* pushes);
+int* computeDepths(Program* program);
+void findBlocks(Program* program, Blocks* blocks);
+void freeBlocks(Blocks* blocks);
+bool* findCapturedSlots(Program* program);
+
+#endif //CLOX_IR_H
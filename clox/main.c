@@ -1,12 +1,31 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "common.h"
+#include "compiler.h"
+#include "pool.h"
+#include "server.h"
 #include "vm.h"
 
-static void repl() {
+// A dynamic array of script paths for batch mode
+typedef struct {
+    int capacity;
+    int count;
+    char** paths;
+} ScriptPaths;
+
+static void repl(bool disassemble, bool optimize) {
     VM vm;
     initVM(&vm, stdout, stderr);
+    vm.disassemble = disassemble;
+    vm.optimize = optimize;
 
     char line[1024];
     for (;;) {
@@ -24,58 +43,237 @@ static void repl() {
 
 }
 
-static char* readFile(const char* path) {
-    FILE* file = fopen(path, "rb");
-    if (file == NULL) {
-        fprintf(stderr, "Could not open file \"%s\".\n", path);
-        exit(74);
-    }
+// A script's source, NUL terminated the way the scanner expects
+typedef struct {
+    char* chars;
+    size_t length;
+    size_t mappedSize; // 0 if chars was read into a malloc'd buffer instead
+} Source;
 
-    fseek(file, 0L, SEEK_END);
-    size_t fileSize = ftell(file);
-    rewind(file);
+// Reads everything left in fd, for files that can't be mapped (pipes, ttys, /proc files that claim to be empty...)
+static Source readSource(int fd, const char* path) {
+    size_t capacity = 4096;
+    size_t length = 0;
+    char* buffer = malloc(capacity);
+    for (;;) {
+        if (buffer == NULL) {
+            fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
+            exit(74);
+        }
+        if (length + 1 == capacity) {
+            capacity *= 2;
+            buffer = realloc(buffer, capacity);
+            continue;
+        }
 
-    char* buffer = (char*)malloc(fileSize + 1);
-    if (buffer == NULL) {
-        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-        exit(74);
+        ssize_t got = read(fd, buffer + length, capacity - length - 1);
+        if (got == 0) break;
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Could not read file \"%s\".\n", path);
+            exit(74);
+        }
+        length += got;
     }
+    buffer[length] = '\0';
+    return (Source){buffer, length, 0};
+}
 
-    size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-    if (bytesRead < fileSize) {
-        fprintf(stderr, "Could not read file \"%s\".\n", path);
+/*
+ * Regular files are mapped rather than read, so the source is never copied and its pages can be dropped again
+ * under memory pressure. The scanner stops at a '\0', so the mapping needs one after the last char: the file goes
+ * over the start of an anonymous (so zero-filled) mapping one page longer than it, which leaves at least one zero
+ * byte after it whatever its length.
+ * The file shouldn't be truncated while it's mapped, which isn't a problem in practice since it's only mapped until
+ * it's been compiled.
+ */
+static Source loadSource(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
         exit(74);
     }
 
+    struct stat info;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        size_t length = (size_t)info.st_size;
+        size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+        size_t mappedSize = (length / pageSize + 1) * pageSize;
+        char* chars = mmap(NULL, mappedSize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (chars != MAP_FAILED) {
+            if (mmap(chars, length, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED) {
+                // the scanner goes through it once, front to back
+                madvise(chars, length, MADV_SEQUENTIAL);
+                close(fd);
+                return (Source){chars, length, mappedSize};
+            }
+            munmap(chars, mappedSize);
+        }
+    }
 
-    buffer[bytesRead] = '\0';
+    Source source = readSource(fd, path);
+    close(fd);
+    return source;
+}
 
-    fclose(file);
-    return buffer;
+static void freeSource(Source* source) {
+    if (source->mappedSize > 0) {
+        munmap(source->chars, source->mappedSize);
+    } else {
+        free(source->chars);
+    }
+    source->chars = NULL;
 }
 
-static void runFile(const char* path) {
-    char* source = readFile(path);
+static void runFile(const char* path, bool disassemble, bool optimize) {
+    Source source = loadSource(path);
 
     VM vm;
     initVM(&vm, stdout, stderr);
+    vm.disassemble = disassemble;
+    vm.optimize = optimize;
+    // someone's watching, so show each line as it's printed, like stdio would
+    if (isatty(STDOUT_FILENO)) configureOutput(&vm, OUTPUT_BUFFER_SIZE, FLUSH_PER_LINE);
 
-    InterpretResult result = interpret(&vm, source);
-    free(source);
+    // nothing compiled points back into the source, so it can go before the script runs
+    ObjFunction* function = compile(&vm, source.chars);
+    freeSource(&source);
+    InterpretResult result = function == NULL ? INTERPRET_COMPILE_ERROR : interpretFunction(&vm, function);
     freeVM(&vm);
 
     if (result == INTERPRET_COMPILE_ERROR) exit(65);
     if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+static void addScriptPath(ScriptPaths* scripts, const char* path) {
+    if (scripts->capacity < scripts->count + 1) {
+        scripts->capacity = scripts->capacity < 8 ? 8 : scripts->capacity * 2;
+        scripts->paths = (char**)realloc(scripts->paths, sizeof(char*) * scripts->capacity);
+        if (scripts->paths == NULL) exit(74);
+    }
+    scripts->paths[scripts->count++] = strdup(path);
+}
+
+static int comparePaths(const void* a, const void* b) {
+    return strcmp(*(const char**)a, *(const char**)b);
+}
+
+// Adds path if it's a file, or every .lox file under it (in sorted order) if it's a directory
+static void collectScripts(ScriptPaths* scripts, const char* path) {
+    struct stat info;
+    if (stat(path, &info) != 0 || !S_ISDIR(info.st_mode)) {
+        addScriptPath(scripts, path);
+        return;
+    }
+
+    DIR* dirp = opendir(path);
+    if (dirp == NULL) {
+        fprintf(stderr, "Could not open directory \"%s\".\n", path);
+        exit(74);
+    }
+
+    int first = scripts->count;
+    struct dirent* entry;
+    while ((entry = readdir(dirp)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+
+        size_t length = strlen(path) + 1 + strlen(entry->d_name) + 1;
+        char child[length];
+        snprintf(child, length, "%s/%s", path, entry->d_name);
+
+        char* dot = strrchr(entry->d_name, '.');
+        if (dot != NULL && strcmp(dot, ".lox") == 0) {
+            addScriptPath(scripts, child);
+        } else if (stat(child, &info) == 0 && S_ISDIR(info.st_mode)) {
+            collectScripts(scripts, child);
+        }
+    }
+    closedir(dirp);
+
+    qsort(scripts->paths + first, scripts->count - first, sizeof(char*), comparePaths);
+}
+
+// Runs every script on a pool of `jobs` threads.
+// Each script's output is printed as a whole, in the order the scripts were given, once it's finished.
+static void runBatch(int jobs, int pathCount, const char* paths[]) {
+    ScriptPaths scripts = {0, 0, NULL};
+    for (int i = 0; i < pathCount; i++) {
+        collectScripts(&scripts, paths[i]);
+    }
+
+    ScriptPool pool;
+    initScriptPool(&pool, jobs);
+
+    ScriptJob** submitted = (ScriptJob**)malloc(sizeof(ScriptJob*) * scripts.count);
+    for (int i = 0; i < scripts.count; i++) {
+        Source source = loadSource(scripts.paths[i]);
+        submitted[i] = submitScript(&pool, scripts.paths[i], source.chars);
+        freeSource(&source);
+    }
+
+    int exitCode = 0;
+    for (int i = 0; i < scripts.count; i++) {
+        ScriptJob* job = submitted[i];
+        waitForScript(&pool, job);
+        // a script that printed nothing may have no buffer at all
+        if (job->outSize > 0) fwrite(job->out, sizeof(char), job->outSize, stdout);
+        if (job->errSize > 0) fwrite(job->err, sizeof(char), job->errSize, stderr);
+
+        if (exitCode == 0 && job->result == INTERPRET_COMPILE_ERROR) exitCode = 65;
+        if (exitCode == 0 && job->result == INTERPRET_RUNTIME_ERROR) exitCode = 70;
+        freeScriptJob(job);
+        free(scripts.paths[i]);
+    }
+
+    free(submitted);
+    free(scripts.paths);
+    freeScriptPool(&pool);
+
+    if (exitCode != 0) exit(exitCode);
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: clox [-O] [--disassemble] [path]   (-O optimizes whole functions, --disassemble prints the bytecode before and after optimizing)\n");
+    fprintf(stderr, "       clox --jobs N path...   (paths may be .lox files or directories)\n");
+    fprintf(stderr, "       clox --serve socket [--jobs N]   (run scripts for clox-client)\n");
+    exit(64);
+}
+
 int main(int argc, const char* argv[]) {
-    if (argc == 1) {
-        repl();
+    // -O and --disassemble can come in either order, before the path if there is one
+    bool disassemble = false;
+    bool optimize = false;
+    int arg = 1;
+    for (; arg < argc; arg++) {
+        if (strcmp(argv[arg], "--disassemble") == 0 && !disassemble) {
+            disassemble = true;
+        } else if (strcmp(argv[arg], "-O") == 0 && !optimize) {
+            optimize = true;
+        } else {
+            break;
+        }
+    }
+
+    if (arg == argc) {
+        // the REPL compiles every line on its own, so it's single-pass unless asked otherwise
+        repl(disassemble, optimize);
+    } else if (disassemble || optimize) {
+        if (argc > arg + 1) usage();
+        runFile(argv[arg], disassemble, optimize);
+    } else if (strcmp(argv[1], "--jobs") == 0) {
+        if (argc < 4) usage();
+        int jobs = atoi(argv[2]);
+        if (jobs < 1) usage();
+        runBatch(jobs, argc - 3, &argv[3]);
+    } else if (strcmp(argv[1], "--serve") == 0) {
+        if (argc != 3 && !(argc == 5 && strcmp(argv[3], "--jobs") == 0)) usage();
+        int jobs = argc == 5 ? atoi(argv[4]) : 1;
+        if (jobs < 1) usage();
+        serve(argv[2], jobs);
     } else if (argc == 2) {
-        runFile(argv[1]);
+        runFile(argv[1], false, false);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        usage();
     }
 
     return 0;
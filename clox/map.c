@@ -0,0 +1,212 @@
+//
+// A map keeps its entries in an array, in insertion order, and finds them through a separate open addressing
+// index of slots holding entry numbers. Each entry caches its key's hash, so a probe only compares keys whose hashes match,
+// and growing the index never has to rehash a key.
+// Deleting an entry leaves a hole in the entries array and a tombstone in the index. Both get squeezed out the next
+// time the map is rebuilt, which happens whenever the index (counting tombstones) gets too full.
+//
+
+#include <math.h>
+#include <string.h>
+
+#include "map.h"
+#include "memory.h"
+#include "table.h"
+#include "vm.h"
+
+// the index's load limit, counting tombstones: past this the map is rebuilt
+#define MAP_MAX_LOAD_NUMERATOR 3
+#define MAP_MAX_LOAD_DENOMINATOR 4
+
+#define SLOT_EMPTY (-1)
+#define SLOT_DELETED (-2)
+
+// The finalizer from MurmurHash3: spreads every input bit over the whole result, so nearby numbers and
+// addresses don't pile up in the same corner of the index
+static uint32_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ull;
+    x ^= x >> 33;
+    return (uint32_t)x;
+}
+
+// key must already be normalized. Keys that are equal by keysEqual must hash the same.
+static uint32_t hashValue(Value key) {
+    if (IS_STRING(key)) return AS_STRING(key)->hash;
+
+    if (IS_NUMBER(key)) {
+        double number = AS_NUMBER(key);
+        if (number == 0) number = 0; // -0 == 0, so they must hash the same too
+        uint64_t bits;
+        memcpy(&bits, &number, sizeof(bits));
+        return mix64(bits);
+    }
+
+    if (IS_OBJ(key)) return mix64((uint64_t)(uintptr_t)AS_OBJ(key));
+    if (IS_BOOL(key)) return AS_BOOL(key) ? 1 : 2;
+    return 3; // nil
+}
+
+// String keys are always interned, so that every key, strings included, can be compared by identity (or number value).
+// Every NaN becomes the same NaN, so that they all hash alike (see keysEqual). For a lookup, a string that has no interned copy can't be a key in any map, so that's reported (returning false)
+// rather than interning a string just to not find it.
+static bool normalizeKey(VM* vm, Value* key, bool intern) {
+    if (IS_NUMBER(*key) && isnan(AS_NUMBER(*key))) {
+        *key = NUMBER_VAL(NAN);
+        return true;
+    }
+    if (IS_ROPE(*key)) *key = OBJ_VAL(flattenRope(vm, AS_ROPE(*key)));
+    if (IS_STRING(*key) && AS_STRING(*key)->isInterned) return true;
+    if (!IS_STRING(*key) && !IS_SLICE(*key)) return true;
+
+    if (intern && IS_STRING(*key)) {
+        *key = OBJ_VAL(internString(vm, AS_STRING(*key)));
+        return true;
+    }
+
+    int length = stringLength(*key);
+    ObjString* interned = tableFindString(&vm->strings, stringChars(*key), length,
+                                          hashString(stringChars(*key), length));
+    if (interned != NULL) {
+        *key = OBJ_VAL(interned);
+        return true;
+    }
+    if (!intern) return false;
+
+    // only slices get this far: a slice can't go in the intern table, so its chars are copied into a string that can
+    ObjString* string = allocateString(vm, length);
+    memcpy(string->chars, stringChars(*key), length);
+    *key = OBJ_VAL(internString(vm, string));
+    return true;
+}
+
+// valuesEqual, except that NaN is the same key as NaN, or it could never be found again.
+// Together with -0 being the same key as 0, that's JavaScript's SameValueZero, which its Map uses too.
+static bool keysEqual(Value a, Value b) {
+    if (IS_NUMBER(a) && IS_NUMBER(b) && isnan(AS_NUMBER(a)) && isnan(AS_NUMBER(b))) return true;
+    return valuesEqual(a, b);
+}
+
+// The slot whose entry has key, or -1 if the map doesn't have it
+static int findSlot(ObjMap* map, Value key, uint32_t hash) {
+    if (map->slotCapacity == 0) return -1;
+
+    uint32_t mask = map->slotCapacity - 1;
+    for (uint32_t index = hash & mask;; index = (index + 1) & mask) {
+        int32_t slot = map->slots[index];
+        if (slot == SLOT_EMPTY) return -1;
+        if (slot != SLOT_DELETED) {
+            MapEntry* entry = &map->entries[slot];
+            if (entry->hash == hash && keysEqual(entry->key, key)) return (int)index;
+        }
+    }
+}
+
+// The first empty or deleted slot on hash's probe sequence
+static int findFreeSlot(int32_t* slots, int capacity, uint32_t hash) {
+    uint32_t mask = capacity - 1;
+    for (uint32_t index = hash & mask;; index = (index + 1) & mask) {
+        if (slots[index] < 0) return (int)index;
+    }
+}
+
+// Reallocates the map with an index of slotCapacity slots, compacting the live entries to the front in their original order
+static void rebuild(VM* vm, ObjMap* map, int slotCapacity) {
+    int entryCapacity = slotCapacity / MAP_MAX_LOAD_DENOMINATOR * MAP_MAX_LOAD_NUMERATOR;
+    MapEntry* entries = ALLOCATE(vm, MapEntry, entryCapacity);
+    int32_t* slots = ALLOCATE(vm, int32_t, slotCapacity);
+    for (int i = 0; i < slotCapacity; i++) slots[i] = SLOT_EMPTY;
+
+    int count = 0;
+    for (int i = 0; i < map->entryCount; i++) {
+        MapEntry* entry = &map->entries[i];
+        if (entry->isDeleted) continue;
+
+        entries[count] = *entry;
+        slots[findFreeSlot(slots, slotCapacity, entry->hash)] = count;
+        count++;
+    }
+
+    freeMap(vm, map);
+    map->entries = entries;
+    map->entryCount = count;
+    map->entryCapacity = entryCapacity;
+    map->slots = slots;
+    map->slotCapacity = slotCapacity;
+    map->count = count;
+}
+
+bool mapGet(VM* vm, ObjMap* map, Value key, Value* value) {
+    if (map->count == 0 || !normalizeKey(vm, &key, false)) return false;
+
+    int slot = findSlot(map, key, hashValue(key));
+    if (slot < 0) return false;
+
+    *value = map->entries[map->slots[slot]].value;
+    return true;
+}
+
+// Returns true if key wasn't in the map before
+bool mapSet(VM* vm, ObjMap* map, Value key, Value value) {
+    normalizeKey(vm, &key, true);
+    uint32_t hash = hashValue(key);
+
+    int slot = findSlot(map, key, hash);
+    if (slot >= 0) {
+        map->entries[map->slots[slot]].value = value;
+        return false;
+    }
+
+    // every entry, deleted or not, is holding on to a slot
+    if ((map->entryCount + 1) * MAP_MAX_LOAD_DENOMINATOR > map->slotCapacity * MAP_MAX_LOAD_NUMERATOR) {
+        int capacity = 8;
+        while ((map->count + 1) * 2 > capacity) capacity *= 2;
+
+        // the interned copy of a string key may not be reachable from anywhere else yet
+        push(vm, key);
+        rebuild(vm, map, capacity);
+        pop(vm);
+    }
+
+    MapEntry* entry = &map->entries[map->entryCount];
+    entry->key = key;
+    entry->value = value;
+    entry->hash = hash;
+    entry->isDeleted = false;
+    map->slots[findFreeSlot(map->slots, map->slotCapacity, hash)] = map->entryCount++;
+    map->count++;
+    return true;
+}
+
+bool mapDelete(VM* vm, ObjMap* map, Value key) {
+    if (map->count == 0 || !normalizeKey(vm, &key, false)) return false;
+
+    int slot = findSlot(map, key, hashValue(key));
+    if (slot < 0) return false;
+
+    MapEntry* entry = &map->entries[map->slots[slot]];
+    entry->isDeleted = true;
+    // let go of whatever the entry referenced
+    entry->key = NIL_VAL;
+    entry->value = NIL_VAL;
+    map->slots[slot] = SLOT_DELETED;
+    map->count--;
+    return true;
+}
+
+// Frees the map's arrays (not the map object itself)
+void freeMap(VM* vm, ObjMap* map) {
+    FREE_ARRAY(vm, MapEntry, map->entries, map->entryCapacity);
+    FREE_ARRAY(vm, int32_t, map->slots, map->slotCapacity);
+}
+
+void markMap(VM* vm, ObjMap* map) {
+    for (int i = 0; i < map->entryCount; i++) {
+        MapEntry* entry = &map->entries[i];
+        if (entry->isDeleted) continue;
+        markValue(vm, entry->key);
+        markValue(vm, entry->value);
+    }
+}
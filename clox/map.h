@@ -0,0 +1,23 @@
+//
+// ObjMap's hash table. Unlike Table, whose keys are only ever interned strings, a map's keys can be any Value.
+//
+
+#ifndef CLOX_MAP_H
+#define CLOX_MAP_H
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+/*
+ * All of these take the VM because string keys are interned before they're hashed or compared (see normalizeKey),
+ * which can allocate. So the map, key and value must all be reachable by the GC, e.g. on the stack.
+ */
+bool mapGet(VM* vm, ObjMap* map, Value key, Value* value);
+bool mapSet(VM* vm, ObjMap* map, Value key, Value value);
+bool mapDelete(VM* vm, ObjMap* map, Value key);
+
+void freeMap(VM* vm, ObjMap* map);
+void markMap(VM* vm, ObjMap* map);
+
+#endif //CLOX_MAP_H
@@ -5,6 +5,7 @@
 #include <stdlib.h>
 
 #include "compiler.h"
+#include "map.h"
 #include "memory.h"
 #include "vm.h"
 
@@ -15,6 +16,9 @@
 
 #define GC_HEAP_GROW_FACTOR 2
 
+// Slices of strings shorter than this always keep their parent alive
+#define SLICE_WEAK_MIN_PARENT 256
+
 /*
  * Reallocates any block stored at pointer.
  * Converts the block from oldSize bytes large to newSize bytes large.
@@ -49,6 +53,31 @@ void* reallocate(VM* vm, void* pointer, size_t oldSize, size_t newSize) {
    return result;
 }
 
+/*
+ * Like reallocate, but the block is aligned to alignment (a power of two, at least sizeof(void*)).
+ * There's no way to grow an aligned block in place, so aligned blocks are only ever allocated and freed.
+ */
+void* allocateAligned(VM* vm, size_t alignment, size_t size) {
+    vm->bytesAllocated += size;
+#ifdef DEBUG_STRESS_GC
+    collectGarbage(vm);
+#endif
+    if (vm->bytesAllocated > vm->nextGC) {
+        collectGarbage(vm);
+    }
+    if (size == 0) return NULL;
+
+    // aligned_alloc wants the size to be a multiple of the alignment
+    void* result = aligned_alloc(alignment, (size + alignment - 1) & ~(alignment - 1));
+    if (result == NULL) exit(1);
+    return result;
+}
+
+void freeAligned(VM* vm, void* pointer, size_t size) {
+    vm->bytesAllocated -= size;
+    free(pointer);
+}
+
 void markObject(VM* vm, Obj* object) {
     if (object == NULL) return;
     if (object->isMarked) return; // avoid cycles
@@ -122,9 +151,34 @@ static void blackenObject(VM* vm, Obj* object) {
             markTable(vm, &instance->fields);
             break;
         }
+        case OBJ_LIST:
+            markArray(vm, &((ObjList*)object)->items);
+            break;
+        case OBJ_MAP:
+            markMap(vm, (ObjMap*)object);
+            break;
+        case OBJ_ROPE: {
+            ObjRope* rope = (ObjRope*)object;
+            markObject(vm, rope->left);
+            markObject(vm, rope->right);
+            markObject(vm, (Obj*)rope->flat);
+            break;
+        }
+        case OBJ_SLICE: {
+            ObjSlice* slice = (ObjSlice*)object;
+            // a tiny slice of a huge string only holds its parent weakly (see compactSlices)
+            if (slice->parent->length >= SLICE_WEAK_MIN_PARENT && slice->length <= slice->parent->length / 8) {
+                slice->nextWeak = vm->weakSlices;
+                vm->weakSlices = slice;
+            } else {
+                markObject(vm, (Obj*)slice->parent);
+            }
+            break;
+        }
         case OBJ_UPVALUE:
             markValue(vm, ((ObjUpvalue*)object)->closed);
             break;
+        case OBJ_FLOAT64_ARRAY:
         case OBJ_NATIVE:
         case OBJ_STRING:
             // No outgoing references here
@@ -148,8 +202,7 @@ static void freeObject(VM* vm, Obj* object) {
         }
         case OBJ_CLOSURE: {
             ObjClosure* closure = (ObjClosure*) object;
-            FREE_ARRAY(vm, ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-            FREE(vm, ObjClosure, object);
+            reallocate(vm, object, FLEX_SIZE(ObjClosure, ObjUpvalue*, closure->upvalueCount), 0);
             break;
         }
         case OBJ_FUNCTION: {
@@ -164,13 +217,32 @@ static void freeObject(VM* vm, Obj* object) {
             FREE(vm, ObjInstance, object);
             break;
         }
+        case OBJ_LIST:
+            freeValueArray(vm, &((ObjList*)object)->items);
+            FREE(vm, ObjList, object);
+            break;
+        case OBJ_FLOAT64_ARRAY: {
+            ObjFloat64Array* array = (ObjFloat64Array*)object;
+            freeAligned(vm, array->values, sizeof(double) * array->count);
+            FREE(vm, ObjFloat64Array, object);
+            break;
+        }
+        case OBJ_MAP:
+            freeMap(vm, (ObjMap*)object);
+            FREE(vm, ObjMap, object);
+            break;
         case OBJ_NATIVE:
             FREE(vm, ObjNative, object);
             break;
+        case OBJ_SLICE:
+            FREE(vm, ObjSlice, object);
+            break;
+        case OBJ_ROPE:
+            FREE(vm, ObjRope, object);
+            break;
         case OBJ_STRING: {
             ObjString* string = (ObjString*)object;
-            FREE_ARRAY(vm, char, string->chars, string->length+1);
-            FREE(vm, ObjString, object);
+            reallocate(vm, object, FLEX_SIZE(ObjString, char, string->length+1), 0);
             break;
         }
         case OBJ_UPVALUE:
@@ -195,6 +267,8 @@ static void markRoots(VM* vm) {
 
     // globals
     markTable(vm, &vm->globals);
+    markTable(vm, &vm->natives);
+    markTable(vm, &vm->scripts);
 
     // compiler has/uses roots too
     markCompilerRoots(vm);
@@ -208,6 +282,15 @@ static void traceReferences(VM* vm) {
     }
 }
 
+// Once everything reachable is marked: a weak slice whose parent got marked anyway goes on sharing its chars,
+// while the others are all that's keeping their parents alive, so they get copies of their own and the parents are swept
+static void compactSlices(VM* vm) {
+    for (ObjSlice* slice = vm->weakSlices; slice != NULL; slice = slice->nextWeak) {
+        if (!slice->parent->obj.isMarked) detachSlice(vm, slice);
+    }
+    vm->weakSlices = NULL;
+}
+
 static void sweep(VM* vm) {
     Obj* previous = NULL;
     Obj* object = vm->objects;
@@ -237,9 +320,12 @@ void collectGarbage(VM* vm) {
 
     markRoots(vm);
     traceReferences(vm);
+    compactSlices(vm);
     tableRemoveWhite(&vm->strings);
     sweep(vm);
 
+    tableCompact(vm, &vm->strings);
+
     vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
 
 #ifdef DEBUG_LOG_GC
@@ -12,6 +12,9 @@
 // using reallocate here instead of free() helps the VM track how much memory is still being used
 #define FREE(vm, type, pointer) reallocate(vm, pointer, sizeof(type), 0)
 
+// The size of an object that ends in a flexible array member holding count elements
+#define FLEX_SIZE(type, elementType, count) (sizeof(type) + sizeof(elementType) * (count))
+
 #define GROW_CAPACITY(capacity) ((capacity) < 8 ? 8 : (capacity) * 2)
 
 /*
@@ -26,6 +29,8 @@
     reallocate(vm, pointer, sizeof(type) * (oldCount), 0)
 
 void* reallocate(VM* vm, void* pointer, size_t oldSize, size_t newSize);
+void* allocateAligned(VM* vm, size_t alignment, size_t size);
+void freeAligned(VM* vm, void* pointer, size_t size);
 void markObject(VM* vm, Obj* object);
 void markValue(VM* vm, Value value);
 void collectGarbage(VM* vm);
@@ -0,0 +1,487 @@
+//
+// Natives follow NativeFn's contract (see object.h): the result goes in args[-1],
+// and on bad arguments they report a runtime error and return false.
+//
+
+#include <string.h>
+#include <time.h>
+
+#include "float64.h"
+#include "map.h"
+#include "memory.h"
+#include "natives.h"
+#include "object.h"
+
+static bool clockNative(VM* vm, int argCount, Value* args) {
+    args[-1] = NUMBER_VAL((double) clock() / CLOCKS_PER_SEC);
+    return true;
+}
+
+// Lists
+
+static bool checkList(VM* vm, Value value, const char* native) {
+    if (IS_LIST(value)) return true;
+    runtimeError(vm, "%s() expects a list as its first argument.", native);
+    return false;
+}
+
+// append(list, value): adds value to the end of list
+static bool appendNative(VM* vm, int argCount, Value* args) {
+    if (!checkList(vm, args[0], "append")) return false;
+
+    // both are still on the stack, so they're safe if growing the list runs the GC
+    writeValueArray(vm, &AS_LIST(args[0])->items, args[1]);
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+// insert(list, index, value): inserts value so that it ends up at index, shifting the ones after it along.
+// index can be the list's length, to insert at the end.
+static bool insertNative(VM* vm, int argCount, Value* args) {
+    if (!checkList(vm, args[0], "insert")) return false;
+    ValueArray* items = &AS_LIST(args[0])->items;
+
+    if (!IS_NUMBER(args[1])) {
+        runtimeError(vm, "List index must be a number.");
+        return false;
+    }
+    double number = AS_NUMBER(args[1]);
+    if (number < 0 || number > items->count || number != (int)number) {
+        runtimeError(vm, "List index out of range.");
+        return false;
+    }
+    int index = (int)number;
+
+    // append to make room, then slide everything from index on along by one
+    writeValueArray(vm, items, NIL_VAL);
+    memmove(&items->values[index + 1], &items->values[index], sizeof(Value) * (items->count - 1 - index));
+    items->values[index] = args[2];
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+// length(list): the number of elements in list (or in a Float64Array, or chars in a string)
+static bool lengthNative(VM* vm, int argCount, Value* args) {
+    if (IS_ANY_STRING(args[0])) {
+        args[-1] = NUMBER_VAL(stringLength(args[0]));
+        return true;
+    }
+    if (IS_FLOAT64_ARRAY(args[0])) {
+        args[-1] = NUMBER_VAL(AS_FLOAT64_ARRAY(args[0])->count);
+        return true;
+    }
+    if (!checkList(vm, args[0], "length")) return false;
+    args[-1] = NUMBER_VAL(AS_LIST(args[0])->items.count);
+    return true;
+}
+
+// pop(list): removes the last element of list, and returns it
+static bool popNative(VM* vm, int argCount, Value* args) {
+    if (!checkList(vm, args[0], "pop")) return false;
+    ValueArray* items = &AS_LIST(args[0])->items;
+
+    if (items->count == 0) {
+        runtimeError(vm, "Can't pop from an empty list.");
+        return false;
+    }
+    args[-1] = items->values[--items->count];
+    return true;
+}
+
+// Strings
+// Substrings are slices of the original's chars (see newSubstring), so taking strings apart doesn't copy them.
+// Anything that holds on to a string's chars has to fetch them again after allocating (see detachSlice).
+
+// Also flattens a rope, in its argument slot, since the natives below all work on a string's chars
+static bool checkString(VM* vm, Value* value, const char* native) {
+    if (!IS_ANY_STRING(*value)) {
+        runtimeError(vm, "%s() expects a string.", native);
+        return false;
+    }
+    if (IS_ROPE(*value)) *value = OBJ_VAL(flattenRope(vm, AS_ROPE(*value)));
+    return true;
+}
+
+// Checks that index is a whole number from 0 up to and including max
+static bool checkStringIndex(VM* vm, Value index, int max, int* result) {
+    if (!IS_NUMBER(index)) {
+        runtimeError(vm, "String index must be a number.");
+        return false;
+    }
+    double number = AS_NUMBER(index);
+    if (number < 0 || number > max || number != (int)number) {
+        runtimeError(vm, "String index out of range.");
+        return false;
+    }
+    *result = (int)number;
+    return true;
+}
+
+// Where needle first appears in haystack at or after from, or -1
+static int findChars(const char* haystack, int length, const char* needle, int needleLength, int from) {
+    if (needleLength == 0) return from;
+    if (needleLength > length - from) return -1;
+    const char* end = haystack + length - needleLength + 1;
+    for (const char* at = haystack + from; at < end; at++) {
+        at = memchr(at, needle[0], end - at);
+        if (at == NULL) return -1;
+        if (memcmp(at, needle, needleLength) == 0) return (int)(at - haystack);
+    }
+    return -1;
+}
+
+// substring(string, start, end): the chars from start up to (but not including) end
+static bool substringNative(VM* vm, int argCount, Value* args) {
+    if (!checkString(vm, &args[0], "substring")) return false;
+    int length = stringLength(args[0]);
+    int start;
+    int end;
+    if (!checkStringIndex(vm, args[1], length, &start) || !checkStringIndex(vm, args[2], length, &end)) return false;
+    if (end < start) {
+        runtimeError(vm, "String index out of range.");
+        return false;
+    }
+    args[-1] = newSubstring(vm, args[0], start, end - start);
+    return true;
+}
+
+// indexOf(string, needle): where needle first appears in string, or -1 if it doesn't
+static bool indexOfNative(VM* vm, int argCount, Value* args) {
+    if (!checkString(vm, &args[0], "indexOf") || !checkString(vm, &args[1], "indexOf")) return false;
+    args[-1] = NUMBER_VAL(findChars(stringChars(args[0]), stringLength(args[0]),
+                                    stringChars(args[1]), stringLength(args[1]), 0));
+    return true;
+}
+
+// split(string, separator): a list of the pieces of string between the separators
+static bool splitNative(VM* vm, int argCount, Value* args) {
+    if (!checkString(vm, &args[0], "split") || !checkString(vm, &args[1], "split")) return false;
+    int length = stringLength(args[0]);
+    int separatorLength = stringLength(args[1]);
+    if (separatorLength == 0) {
+        runtimeError(vm, "split() separator can't be empty.");
+        return false;
+    }
+
+    // the result's slot keeps the list safe from the GC while it's filled in
+    ObjList* list = newList(vm);
+    args[-1] = OBJ_VAL(list);
+    int start = 0;
+    for (;;) {
+        int found = findChars(stringChars(args[0]), length, stringChars(args[1]), separatorLength, start);
+        int end = found < 0 ? length : found;
+
+        push(vm, newSubstring(vm, args[0], start, end - start));
+        writeValueArray(vm, &list->items, vm->stackTop[-1]);
+        pop(vm);
+
+        if (found < 0) break;
+        start = found + separatorLength;
+    }
+    return true;
+}
+
+// join(list, separator): the strings in list, with separator between each of them
+static bool joinNative(VM* vm, int argCount, Value* args) {
+    if (!checkList(vm, args[0], "join") || !checkString(vm, &args[1], "join")) return false;
+    ValueArray* items = &AS_LIST(args[0])->items;
+
+    int separatorLength = stringLength(args[1]);
+    int length = 0;
+    for (int i = 0; i < items->count; i++) {
+        if (!IS_ANY_STRING(items->values[i])) {
+            runtimeError(vm, "join() expects a list of strings.");
+            return false;
+        }
+        // a rope's flat string stays alive as long as the rope does, and the rope is in the list
+        if (IS_ROPE(items->values[i])) flattenRope(vm, AS_ROPE(items->values[i]));
+        length += stringLength(items->values[i]) + (i > 0 ? separatorLength : 0);
+    }
+
+    ObjString* result = allocateString(vm, length);
+    char* dest = result->chars;
+    for (int i = 0; i < items->count; i++) {
+        if (i > 0) {
+            memcpy(dest, stringChars(args[1]), separatorLength);
+            dest += separatorLength;
+        }
+        Value item = items->values[i];
+        if (IS_ROPE(item)) item = OBJ_VAL(AS_ROPE(item)->flat);
+        memcpy(dest, stringChars(item), stringLength(item));
+        dest += stringLength(item);
+    }
+    args[-1] = OBJ_VAL(result);
+    return true;
+}
+
+static bool isWhitespace(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// trim(string): string without any whitespace at its start or end
+static bool trimNative(VM* vm, int argCount, Value* args) {
+    if (!checkString(vm, &args[0], "trim")) return false;
+    const char* chars = stringChars(args[0]);
+    int start = 0;
+    int end = stringLength(args[0]);
+    while (start < end && isWhitespace(chars[start])) start++;
+    while (end > start && isWhitespace(chars[end - 1])) end--;
+    args[-1] = newSubstring(vm, args[0], start, end - start);
+    return true;
+}
+
+// charCode(string, index): the byte at index, as a number from 0 to 255
+static bool charCodeNative(VM* vm, int argCount, Value* args) {
+    if (!checkString(vm, &args[0], "charCode")) return false;
+    int length = stringLength(args[0]);
+    int index;
+    if (!checkStringIndex(vm, args[1], length - 1, &index)) return false;
+    args[-1] = NUMBER_VAL((unsigned char)stringChars(args[0])[index]);
+    return true;
+}
+
+// fromCharCode(code): a one char string holding the byte code
+static bool fromCharCodeNative(VM* vm, int argCount, Value* args) {
+    if (!IS_NUMBER(args[0]) || AS_NUMBER(args[0]) < 0 || AS_NUMBER(args[0]) > 255
+        || AS_NUMBER(args[0]) != (int)AS_NUMBER(args[0])) {
+        runtimeError(vm, "fromCharCode() expects a whole number from 0 to 255.");
+        return false;
+    }
+    char c = (char)(int)AS_NUMBER(args[0]);
+    args[-1] = OBJ_VAL(copyString(vm, &c, 1));
+    return true;
+}
+
+// Maps
+
+static bool checkMap(VM* vm, Value value, const char* native) {
+    if (IS_MAP(value)) return true;
+    runtimeError(vm, "%s() expects a map as its first argument.", native);
+    return false;
+}
+
+// Map(): a new, empty map
+static bool mapNative(VM* vm, int argCount, Value* args) {
+    args[-1] = OBJ_VAL(newMap(vm));
+    return true;
+}
+
+// has(map, key): whether map has an entry for key, even one whose value is nil
+static bool hasNative(VM* vm, int argCount, Value* args) {
+    if (!checkMap(vm, args[0], "has")) return false;
+    Value value;
+    args[-1] = BOOL_VAL(mapGet(vm, AS_MAP(args[0]), args[1], &value));
+    return true;
+}
+
+// remove(map, key): removes key's entry from map, returning whether there was one
+static bool removeNative(VM* vm, int argCount, Value* args) {
+    if (!checkMap(vm, args[0], "remove")) return false;
+    args[-1] = BOOL_VAL(mapDelete(vm, AS_MAP(args[0]), args[1]));
+    return true;
+}
+
+// size(map): the number of entries in map
+static bool sizeNative(VM* vm, int argCount, Value* args) {
+    if (!checkMap(vm, args[0], "size")) return false;
+    args[-1] = NUMBER_VAL(AS_MAP(args[0])->count);
+    return true;
+}
+
+// A new list of map's keys, or its values, in the order they were first added
+static bool mapToList(VM* vm, Value* args, const char* native, bool wantKeys) {
+    if (!checkMap(vm, args[0], native)) return false;
+    ObjMap* map = AS_MAP(args[0]);
+
+    // the result's slot keeps the list safe from the GC while it's filled in
+    ObjList* list = newList(vm);
+    args[-1] = OBJ_VAL(list);
+    for (int i = 0; i < map->entryCount; i++) {
+        MapEntry* entry = &map->entries[i];
+        if (entry->isDeleted) continue;
+        writeValueArray(vm, &list->items, wantKeys ? entry->key : entry->value);
+    }
+    return true;
+}
+
+// keys(map): a list of map's keys, in insertion order
+static bool keysNative(VM* vm, int argCount, Value* args) {
+    return mapToList(vm, args, "keys", true);
+}
+
+// values(map): a list of map's values, in the same order as keys(map)
+static bool valuesNative(VM* vm, int argCount, Value* args) {
+    return mapToList(vm, args, "values", false);
+}
+
+// Float64Arrays
+
+static bool checkFloat64Array(VM* vm, Value value, const char* native) {
+    if (IS_FLOAT64_ARRAY(value)) return true;
+    runtimeError(vm, "%s() expects a Float64Array.", native);
+    return false;
+}
+
+static bool checkSameLength(VM* vm, ObjFloat64Array* a, ObjFloat64Array* b, const char* native) {
+    if (a->count == b->count) return true;
+    runtimeError(vm, "%s() expects Float64Arrays of the same length.", native);
+    return false;
+}
+
+static bool checkNumber(VM* vm, Value value, const char* native) {
+    if (IS_NUMBER(value)) return true;
+    runtimeError(vm, "%s() expects a number.", native);
+    return false;
+}
+
+// Float64Array(length): a new array of that many zeros.
+// Float64Array(list): a new array holding a copy of list's elements, which must all be numbers.
+static bool float64ArrayNative(VM* vm, int argCount, Value* args) {
+    if (IS_LIST(args[0])) {
+        ValueArray* items = &AS_LIST(args[0])->items;
+        for (int i = 0; i < items->count; i++) {
+            if (!IS_NUMBER(items->values[i])) {
+                runtimeError(vm, "Float64Array elements must be numbers.");
+                return false;
+            }
+        }
+        ObjFloat64Array* array = newFloat64Array(vm, items->count);
+        for (int i = 0; i < items->count; i++) array->values[i] = AS_NUMBER(items->values[i]);
+        args[-1] = OBJ_VAL(array);
+        return true;
+    }
+
+    if (!IS_NUMBER(args[0]) || AS_NUMBER(args[0]) < 0 || AS_NUMBER(args[0]) > INT32_MAX / sizeof(double)
+        || AS_NUMBER(args[0]) != (int)AS_NUMBER(args[0])) {
+        runtimeError(vm, "Float64Array() expects a list or a non-negative whole number.");
+        return false;
+    }
+    args[-1] = OBJ_VAL(newFloat64Array(vm, (int)AS_NUMBER(args[0])));
+    return true;
+}
+
+// sum(array): the sum of array's elements
+static bool sumNative(VM* vm, int argCount, Value* args) {
+    if (!checkFloat64Array(vm, args[0], "sum")) return false;
+    ObjFloat64Array* array = AS_FLOAT64_ARRAY(args[0]);
+    args[-1] = NUMBER_VAL(float64Kernels()->sum(array->values, array->count));
+    return true;
+}
+
+// dot(x, y): the dot product of two arrays of the same length
+static bool dotNative(VM* vm, int argCount, Value* args) {
+    if (!checkFloat64Array(vm, args[0], "dot") || !checkFloat64Array(vm, args[1], "dot")) return false;
+    ObjFloat64Array* x = AS_FLOAT64_ARRAY(args[0]);
+    ObjFloat64Array* y = AS_FLOAT64_ARRAY(args[1]);
+    if (!checkSameLength(vm, x, y, "dot")) return false;
+    args[-1] = NUMBER_VAL(float64Kernels()->dot(x->values, y->values, x->count));
+    return true;
+}
+
+// scale(array, factor): multiplies every element of array by factor, in place
+static bool scaleNative(VM* vm, int argCount, Value* args) {
+    if (!checkFloat64Array(vm, args[0], "scale") || !checkNumber(vm, args[1], "scale")) return false;
+    ObjFloat64Array* array = AS_FLOAT64_ARRAY(args[0]);
+    float64Kernels()->scale(array->values, AS_NUMBER(args[1]), array->count);
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+// axpy(a, x, y): adds a * x to y, in place (BLAS's name for it)
+static bool axpyNative(VM* vm, int argCount, Value* args) {
+    if (!checkNumber(vm, args[0], "axpy")
+        || !checkFloat64Array(vm, args[1], "axpy") || !checkFloat64Array(vm, args[2], "axpy")) {
+        return false;
+    }
+    ObjFloat64Array* x = AS_FLOAT64_ARRAY(args[1]);
+    ObjFloat64Array* y = AS_FLOAT64_ARRAY(args[2]);
+    if (!checkSameLength(vm, x, y, "axpy")) return false;
+    float64Kernels()->axpy(AS_NUMBER(args[0]), x->values, y->values, x->count);
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+static bool checkNotEmpty(VM* vm, ObjFloat64Array* array, const char* native) {
+    if (array->count > 0) return true;
+    runtimeError(vm, "%s() of an empty Float64Array.", native);
+    return false;
+}
+
+// min(array): array's smallest element
+static bool minNative(VM* vm, int argCount, Value* args) {
+    if (!checkFloat64Array(vm, args[0], "min")) return false;
+    ObjFloat64Array* array = AS_FLOAT64_ARRAY(args[0]);
+    if (!checkNotEmpty(vm, array, "min")) return false;
+    args[-1] = NUMBER_VAL(float64Kernels()->min(array->values, array->count));
+    return true;
+}
+
+// max(array): array's largest element
+static bool maxNative(VM* vm, int argCount, Value* args) {
+    if (!checkFloat64Array(vm, args[0], "max")) return false;
+    ObjFloat64Array* array = AS_FLOAT64_ARRAY(args[0]);
+    if (!checkNotEmpty(vm, array, "max")) return false;
+    args[-1] = NUMBER_VAL(float64Kernels()->max(array->values, array->count));
+    return true;
+}
+
+// prefixSum(array): replaces each element with the sum of it and every element before it
+static bool prefixSumNative(VM* vm, int argCount, Value* args) {
+    if (!checkFloat64Array(vm, args[0], "prefixSum")) return false;
+    ObjFloat64Array* array = AS_FLOAT64_ARRAY(args[0]);
+    float64Kernels()->prefixSum(array->values, array->count);
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+// sort(array): sorts array ascending, in place
+static bool sortNative(VM* vm, int argCount, Value* args) {
+    if (!checkFloat64Array(vm, args[0], "sort")) return false;
+    ObjFloat64Array* array = AS_FLOAT64_ARRAY(args[0]);
+    float64Sort(array->values, array->count);
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+static void defineNative(VM* vm, const char* name, NativeFn function, int arity) {
+    push(vm, OBJ_VAL(copyString(vm, name, (int) strlen(name))));
+    push(vm, OBJ_VAL(newNative(vm, function, arity)));
+    tableSet(vm, &vm->globals, AS_STRING(vm->stack[0]), vm->stack[1]);
+    tableSet(vm, &vm->natives, AS_STRING(vm->stack[0]), vm->stack[1]);
+    pop(vm);
+    pop(vm);
+}
+
+void defineNatives(VM* vm) {
+    defineNative(vm, "clock", clockNative, 0);
+
+    defineNative(vm, "append", appendNative, 2);
+    defineNative(vm, "insert", insertNative, 3);
+    defineNative(vm, "length", lengthNative, 1);
+    defineNative(vm, "pop", popNative, 1);
+
+    defineNative(vm, "charCode", charCodeNative, 2);
+    defineNative(vm, "fromCharCode", fromCharCodeNative, 1);
+    defineNative(vm, "indexOf", indexOfNative, 2);
+    defineNative(vm, "join", joinNative, 2);
+    defineNative(vm, "split", splitNative, 2);
+    defineNative(vm, "substring", substringNative, 3);
+    defineNative(vm, "trim", trimNative, 1);
+
+    defineNative(vm, "Map", mapNative, 0);
+    defineNative(vm, "has", hasNative, 2);
+    defineNative(vm, "keys", keysNative, 1);
+    defineNative(vm, "remove", removeNative, 2);
+    defineNative(vm, "size", sizeNative, 1);
+    defineNative(vm, "values", valuesNative, 1);
+
+    defineNative(vm, "Float64Array", float64ArrayNative, 1);
+    defineNative(vm, "axpy", axpyNative, 3);
+    defineNative(vm, "dot", dotNative, 2);
+    defineNative(vm, "max", maxNative, 1);
+    defineNative(vm, "min", minNative, 1);
+    defineNative(vm, "prefixSum", prefixSumNative, 1);
+    defineNative(vm, "scale", scaleNative, 2);
+    defineNative(vm, "sort", sortNative, 1);
+    defineNative(vm, "sum", sumNative, 1);
+}
@@ -0,0 +1,12 @@
+//
+// The functions every VM starts out with as globals
+//
+
+#ifndef CLOX_NATIVES_H
+#define CLOX_NATIVES_H
+
+#include "vm.h"
+
+void defineNatives(VM* vm);
+
+#endif //CLOX_NATIVES_H
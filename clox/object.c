@@ -3,8 +3,10 @@
 //
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "float64.h"
 #include "memory.h"
 #include "object.h"
 #include "table.h"
@@ -42,15 +44,14 @@ ObjClass* newClass(VM* vm, ObjString* name) {
 }
 
 ObjClosure* newClosure(VM* vm, ObjFunction* function) {
-    ObjUpvalue** upvalues = ALLOCATE(vm, ObjUpvalue*, function->upvalueCount);
+    ObjClosure* closure = (ObjClosure*)allocateObject(
+            vm, FLEX_SIZE(ObjClosure, ObjUpvalue*, function->upvalueCount), OBJ_CLOSURE);
+    closure->function = function;
+    closure->upvalueCount = function->upvalueCount;
     for (int i = 0; i < function->upvalueCount; i++) {
         // ensure the memory manager never sees uninit'ed memory
-        upvalues[i] = NULL;
+        closure->upvalues[i] = NULL;
     }
-    ObjClosure* closure = ALLOCATE_OBJ(vm, ObjClosure, OBJ_CLOSURE);
-    closure->function = function;
-    closure->upvalues = upvalues;
-    closure->upvalueCount = function->upvalueCount;
     return closure;
 }
 
@@ -73,20 +74,175 @@ ObjInstance* newInstance(VM* vm, ObjClass* klass) {
 
 // Constructor for native function
 // Takes a C function pointer to wrap in an ObjNative
-ObjNative* newNative(VM* vm, NativeFn function) {
+ObjNative* newNative(VM* vm, NativeFn function, int arity) {
     ObjNative* native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
     native->function = function;
+    native->arity = arity;
     return native;
 }
 
-// create a new ObjString on the heap, initialize its fields
-// kinda like an OOP constructor, so first calls 'base class' constructor to init Obj state
-// only called for new strings (if they already exist in our vm.strings hash Set, allocateString won't have been called)
-static ObjString* allocateString(VM* vm, char* chars, int length, uint32_t hash) {
-    ObjString* string = ALLOCATE_OBJ(vm, ObjString, OBJ_STRING);
+ObjList* newList(VM* vm) {
+    ObjList* list = ALLOCATE_OBJ(vm, ObjList, OBJ_LIST);
+    initValueArray(&list->items);
+    return list;
+}
+
+// A new array of count zeros
+ObjFloat64Array* newFloat64Array(VM* vm, int count) {
+    ObjFloat64Array* array = ALLOCATE_OBJ(vm, ObjFloat64Array, OBJ_FLOAT64_ARRAY);
+    array->count = 0;
+    array->values = NULL;
+
+    push(vm, OBJ_VAL(array)); // allocating the storage may run the GC
+    array->values = allocateAligned(vm, FLOAT64_ALIGNMENT, sizeof(double) * count);
+    if (count > 0) memset(array->values, 0, sizeof(double) * count);
+    array->count = count;
+    pop(vm);
+    return array;
+}
+
+ObjMap* newMap(VM* vm) {
+    ObjMap* map = ALLOCATE_OBJ(vm, ObjMap, OBJ_MAP);
+    map->count = 0;
+    map->entryCount = 0;
+    map->entryCapacity = 0;
+    map->entries = NULL;
+    map->slotCapacity = 0;
+    map->slots = NULL;
+    return map;
+}
+
+// left and right are both Lox strings (flat or ropes) and must be reachable by the GC, e.g. on the stack
+ObjRope* newRope(VM* vm, Value left, Value right) {
+    ObjRope* rope = ALLOCATE_OBJ(vm, ObjRope, OBJ_ROPE);
+    rope->length = stringLength(left) + stringLength(right);
+    // a rope that's already been flattened is better linked to by its flat string, which keeps the tree shallow
+    rope->left = IS_ROPE(left) && AS_ROPE(left)->flat != NULL ? (Obj*)AS_ROPE(left)->flat : AS_OBJ(left);
+    rope->right = IS_ROPE(right) && AS_ROPE(right)->flat != NULL ? (Obj*)AS_ROPE(right)->flat : AS_OBJ(right);
+    rope->flat = NULL;
+    return rope;
+}
+
+// Writes rope's text to dest (which has room for rope->length chars).
+// Ropes built in a loop are as deep as the loop is long, so this walks the tree with an explicit stack rather than recursing.
+// Filling dest from the back means the usual left-leaning rope only ever has one node on the stack at a time.
+static void fillRope(ObjRope* rope, char* dest) {
+    int capacity = 8;
+    int count = 0;
+    Obj** pending = malloc(sizeof(Obj*) * capacity); // not GC managed, so filling can never trigger a collection
+    if (pending == NULL) exit(1);
+
+    char* end = dest + rope->length;
+    Obj* node = (Obj*)rope;
+    for (;;) {
+        if (node->type == OBJ_ROPE && ((ObjRope*)node)->flat != NULL) {
+            node = (Obj*)((ObjRope*)node)->flat;
+        }
+
+        if (node->type != OBJ_ROPE) {
+            int length = stringLength(OBJ_VAL(node));
+            end -= length;
+            memcpy(end, stringChars(OBJ_VAL(node)), length);
+            if (count == 0) break;
+            node = pending[--count];
+        } else {
+            ObjRope* inner = (ObjRope*)node;
+            if (capacity < count + 1) {
+                capacity *= 2;
+                pending = realloc(pending, sizeof(Obj*) * capacity);
+                if (pending == NULL) exit(1);
+            }
+            pending[count++] = inner->left;
+            node = inner->right;
+        }
+    }
+
+    free(pending);
+}
+
+ObjString* flattenRope(VM* vm, ObjRope* rope) {
+    if (rope->flat != NULL) return rope->flat;
+
+    // the rope has to survive the allocation below, even if the caller already popped it
+    push(vm, OBJ_VAL(rope));
+    ObjString* string = allocateString(vm, rope->length);
+    fillRope(rope, string->chars);
+
+    rope->flat = string;
+    rope->left = NULL;
+    rope->right = NULL;
+    pop(vm);
+    return rope->flat;
+}
+
+// The length chars of string (any Lox string, reachable by the GC) from start on, which the caller has checked are in range.
+// Empty and single char substrings come from the intern table, so taking a string apart char by char doesn't allocate.
+// Anything longer is a slice sharing string's chars.
+Value newSubstring(VM* vm, Value string, int start, int length) {
+    if (IS_ROPE(string)) string = OBJ_VAL(flattenRope(vm, AS_ROPE(string)));
+    if (start == 0 && length == stringLength(string)) return string;
+    if (length <= 1) {
+        // copied out first: copyString can allocate, and a collection can detach a slice from its parent (see below)
+        char chars[1];
+        memcpy(chars, stringChars(string) + start, length);
+        return OBJ_VAL(copyString(vm, chars, length));
+    }
+
+    ObjSlice* slice = ALLOCATE_OBJ(vm, ObjSlice, OBJ_SLICE);
+    // only look at string's parent now that the allocation (and any collection) is done
+    if (IS_SLICE(string)) {
+        slice->parent = AS_SLICE(string)->parent;
+        slice->start = AS_SLICE(string)->start + start;
+    } else {
+        slice->parent = AS_STRING(string);
+        slice->start = start;
+    }
+    slice->length = length;
+    slice->nextWeak = NULL;
+    return OBJ_VAL(slice);
+}
+
+/*
+ * Gives slice its own copy of its chars, letting go of its parent.
+ * Only for the GC, in the middle of a collection: it allocates without going through reallocate, so it can't start
+ * another collection, and it marks the copy so the sweep that's about to run keeps it.
+ * Anything holding on to a slice's chars across an allocation has to fetch them again afterwards.
+ */
+void detachSlice(VM* vm, ObjSlice* slice) {
+    size_t size = FLEX_SIZE(ObjString, char, slice->length + 1);
+    ObjString* string = malloc(size);
+    if (string == NULL) exit(1);
+    vm->bytesAllocated += size;
+
+    string->obj.type = OBJ_STRING;
+    string->obj.isMarked = true;
+    string->obj.next = vm->objects;
+    vm->objects = (Obj*)string;
+
+    string->length = slice->length;
+    string->isInterned = false;
+    memcpy(string->chars, slice->parent->chars + slice->start, slice->length);
+    string->chars[slice->length] = '\0';
+
+    slice->parent = string;
+    slice->start = 0;
+}
+
+// Allocates an uninterned string with room for length chars, for the caller to write into.
+// Strings made while running (by concatenation, say) stay uninterned unless they're needed as a table key,
+// so the many that are only printed or thrown away never cost a hash or a slot in vm.strings.
+ObjString* allocateString(VM* vm, int length) {
+    ObjString* string = (ObjString*)allocateObject(vm, FLEX_SIZE(ObjString, char, length+1), OBJ_STRING);
     string->length = length;
-    string->chars = chars;
+    string->isInterned = false;
+    string->chars[length] = '\0';
+    return string;
+}
+
+// Adds a brand new string (one that isn't in vm.strings yet) to the intern table
+static ObjString* addString(VM* vm, ObjString* string, uint32_t hash) {
     string->hash = hash;
+    string->isInterned = true;
 
     // push & pop ensures the string is safe while the table is being resized
     push(vm, OBJ_VAL(string));
@@ -96,14 +252,78 @@ static ObjString* allocateString(VM* vm, char* chars, int length, uint32_t hash)
     return string;
 }
 
-// Using FNV-1a hash function
-static uint32_t hashString(const char* key, int length) {
-    uint32_t hash = 2166136261u;
-    for (int i = 0; i < length; i++) {
-        hash ^= (uint8_t)key[i];
-        hash *= 16777619;
+// Returns the interned string with the same text as string: string itself, or one interned earlier.
+// Anything used as a table key has to go through here first.
+ObjString* internString(VM* vm, ObjString* string) {
+    if (string->isInterned) return string;
+
+    uint32_t hash = hashString(string->chars, string->length);
+    ObjString* interned = tableFindString(&vm->strings, string->chars, string->length, hash);
+    if (interned != NULL) return interned;
+
+    return addString(vm, string, hash);
+}
+
+// Multiplies a and b into 128 bits and folds the halves together. A single multiply that mixes every input bit into
+// every output bit, which is what makes the hash below both fast and well distributed.
+static inline uint64_t mix(uint64_t a, uint64_t b) {
+    __uint128_t product = (__uint128_t)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+// unaligned reads, which compile down to plain loads
+static inline uint64_t read64(const char* p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint64_t read32(const char* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+// wyhash: hashes 8 or 16 bytes at a time instead of FNV-1a's one, and short strings (most identifiers) in a
+// couple of overlapping reads without any loop at all.
+// Tables pick buckets with the low bits of the hash, and these are as good as the high ones.
+uint32_t hashString(const char* key, int length) {
+    static const uint64_t secret[] = {0xa0761d6478bd642full, 0xe7037ed1a0b428dbull, 0x8ebc6af09c88c6e3ull};
+    const char* p = key;
+    uint64_t seed = secret[2] ^ mix(secret[2] ^ secret[0], secret[1]);
+    uint64_t a, b;
+
+    if (length <= 16) {
+        if (length >= 4) {
+            // two pairs of (possibly overlapping) 4 byte reads cover every byte of 4..16 byte strings
+            int offset = (length >> 3) << 2;
+            a = (read32(p) << 32) | read32(p + offset);
+            b = (read32(p + length - 4) << 32) | read32(p + length - 4 - offset);
+        } else if (length > 0) {
+            a = ((uint64_t)(uint8_t)p[0] << 16) | ((uint64_t)(uint8_t)p[length >> 1] << 8) | (uint8_t)p[length - 1];
+            b = 0;
+        } else {
+            a = 0;
+            b = 0;
+        }
+    } else {
+        int remaining = length;
+        while (remaining > 16) {
+            seed = mix(read64(p) ^ secret[1], read64(p + 8) ^ seed);
+            p += 16;
+            remaining -= 16;
+        }
+        // the last 16 bytes, overlapping what the loop already consumed if need be
+        a = read64(p + remaining - 16);
+        b = read64(p + remaining - 8);
     }
-    return hash;
+
+    a ^= secret[1];
+    b ^= seed;
+    __uint128_t product = (__uint128_t)a * b;
+    a = (uint64_t)product;
+    b = (uint64_t)(product >> 64);
+    return (uint32_t)mix(a ^ secret[0] ^ (uint64_t)length, b ^ secret[1]);
 }
 
 // public facing function that assumes it CANNOT take ownership of the chars passed in,
@@ -114,10 +334,9 @@ ObjString* copyString(VM* vm, const char* chars, int length) {
     ObjString* interned = tableFindString(&vm->strings, chars, length, hash);
     if (interned != NULL) return interned;
 
-    char* heapChars = ALLOCATE(vm, char, length+1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
-    return allocateString(vm, heapChars, length, hash);
+    ObjString* string = allocateString(vm, length);
+    memcpy(string->chars, chars, length);
+    return addString(vm, string, hash);
 }
 
 ObjUpvalue * newUpvalue(VM* vm, Value* slot) {
@@ -128,56 +347,118 @@ ObjUpvalue * newUpvalue(VM* vm, Value* slot) {
     return upvalue;
 }
 
-static void printFunction(ObjFunction* function, FILE* fd) {
+static void writeFunction(Output* out, ObjFunction* function) {
     if (function->name == NULL) {
-        printf("<script>");
+        writeString(out, "<script>");
         return;
     }
-    fprintf(fd, "<fn %s>", function->name->chars);
+    writeString(out, "<fn ");
+    writeChars(out, function->name->chars, function->name->length);
+    writeString(out, ">");
+}
+
+// Whether container is already being written further out, as when a list contains itself
+static bool isBeingWritten(Output* out, const void* container) {
+    for (Printing* printing = out->printing; printing != NULL; printing = printing->enclosing) {
+        if (printing->container == container) return true;
+    }
+    return false;
 }
 
-void printObject(Value value, FILE* fd) {
+void writeObject(Output* out, Value value) {
     switch (OBJ_TYPE(value)) {
         case OBJ_BOUND_METHOD:
-            printFunction(AS_BOUND_METHOD(value)->method->function, fd);
+            writeFunction(out, AS_BOUND_METHOD(value)->method->function);
             break;
         case OBJ_CLASS:
-            fprintf(fd, "%s", AS_CLASS(value)->name->chars);
+            writeChars(out, AS_CLASS(value)->name->chars, AS_CLASS(value)->name->length);
             break;
         case OBJ_CLOSURE:
-            printFunction(AS_CLOSURE(value)->function, fd);
+            writeFunction(out, AS_CLOSURE(value)->function);
             break;
+        case OBJ_FLOAT64_ARRAY: {
+            ObjFloat64Array* array = AS_FLOAT64_ARRAY(value);
+            writeString(out, "Float64Array[");
+            for (int i = 0; i < array->count; i++) {
+                if (i > 0) writeString(out, ", ");
+                writeValue(out, NUMBER_VAL(array->values[i]));
+            }
+            writeString(out, "]");
+            break;
+        }
         case OBJ_FUNCTION:
-            printFunction(AS_FUNCTION(value), fd);
+            writeFunction(out, AS_FUNCTION(value));
             break;
         case OBJ_INSTANCE:
-            fprintf(fd, "%s instance", AS_INSTANCE(value)->klass->name->chars);
+            ObjString* name = AS_INSTANCE(value)->klass->name;
+            writeChars(out, name->chars, name->length);
+            writeString(out, " instance");
+            break;
+        case OBJ_LIST: {
+            ObjList* list = AS_LIST(value);
+            if (isBeingWritten(out, list)) {
+                writeString(out, "[...]");
+                break;
+            }
+            Printing printing = {list, out->printing};
+            out->printing = &printing;
+            writeString(out, "[");
+            for (int i = 0; i < list->items.count; i++) {
+                if (i > 0) writeString(out, ", ");
+                writeValue(out, list->items.values[i]);
+            }
+            writeString(out, "]");
+            out->printing = printing.enclosing;
             break;
+        }
+        case OBJ_MAP: {
+            ObjMap* map = AS_MAP(value);
+            if (isBeingWritten(out, map)) {
+                writeString(out, "{...}");
+                break;
+            }
+            Printing printing = {map, out->printing};
+            out->printing = &printing;
+            writeString(out, "{");
+            bool first = true;
+            for (int i = 0; i < map->entryCount; i++) {
+                MapEntry* entry = &map->entries[i];
+                if (entry->isDeleted) continue;
+                if (!first) writeString(out, ", ");
+                first = false;
+                writeValue(out, entry->key);
+                writeString(out, ": ");
+                writeValue(out, entry->value);
+            }
+            writeString(out, "}");
+            out->printing = printing.enclosing;
+            break;
+        }
         case OBJ_NATIVE:
-            fprintf(fd, "<native fn>");
+            writeString(out, "<native fn>");
+            break;
+        case OBJ_SLICE:
+            writeChars(out, stringChars(value), AS_SLICE(value)->length);
             break;
+        case OBJ_ROPE: {
+            // no VM to flatten with here, so just assemble the text for the occasion
+            ObjRope* rope = AS_ROPE(value);
+            if (rope->flat != NULL) {
+                writeChars(out, rope->flat->chars, rope->flat->length);
+                break;
+            }
+            char* chars = malloc(rope->length);
+            if (chars == NULL) exit(1);
+            fillRope(rope, chars);
+            writeChars(out, chars, rope->length);
+            free(chars);
+            break;
+        }
         case OBJ_STRING:
-            fprintf(fd, "%s", AS_CSTRING(value));
+            writeChars(out, AS_CSTRING(value), AS_STRING(value)->length);
             break;
         case OBJ_UPVALUE:
-            fprintf(fd, "upvalue");
+            writeString(out, "upvalue");
             break;
     }
 }
-
-// public facing function used for concatenation,
-// for concatenating, we've already dynamically allocated a char array on the heap
-// of the summed size,
-// so takeString claims ownership of the string you give it
-// meaning that if we actually already have the string's text in our vm.strings hash Set, we must free the string that was passed in (b/c we 'own' it)
-ObjString* takeString(VM* vm, char* chars, int length) {
-    uint32_t hash = hashString(chars, length);
-    ObjString* interned = tableFindString(&vm->strings, chars, length, hash);
-
-    if (interned != NULL) {
-        FREE_ARRAY(vm, char, chars, length+1);
-        return interned;
-    }
-
-    return allocateString(vm, chars, length, hash);
-}
@@ -6,6 +6,7 @@
 #define CLOX_OBJECT_H
 
 #include <stdio.h>
+#include <string.h>
 
 #include "common.h"
 #include "value.h"
@@ -19,8 +20,15 @@
 #define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
 #define IS_CLASS(value)     isObjType(value, OBJ_CLASS)
 #define IS_STRING(value)    isObjType(value, OBJ_STRING)
+#define IS_ROPE(value)      isObjType(value, OBJ_ROPE)
+#define IS_SLICE(value)     isObjType(value, OBJ_SLICE)
+// any Lox string: flat, a rope or a slice
+#define IS_ANY_STRING(value) (IS_STRING(value) || IS_ROPE(value) || IS_SLICE(value))
+#define IS_FLOAT64_ARRAY(value) isObjType(value, OBJ_FLOAT64_ARRAY)
 #define IS_FUNCTION(value)  isObjType(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value)  isObjType(value, OBJ_INSTANCE)
+#define IS_LIST(value)      isObjType(value, OBJ_LIST)
+#define IS_MAP(value)       isObjType(value, OBJ_MAP)
 #define IS_NATIVE(value)    isObjType(value, OBJ_NATIVE)
 #define IS_CLOSURE(value)   isObjType(value, OBJ_CLOSURE)
 
@@ -28,18 +36,28 @@
 #define AS_CLASS(value)    ((ObjClass*)AS_OBJ(value))
 #define AS_CLOSURE(value)  ((ObjClosure*)AS_OBJ(value))
 #define AS_STRING(value)   ((ObjString*)AS_OBJ(value))
+#define AS_ROPE(value)     ((ObjRope*)AS_OBJ(value))
+#define AS_SLICE(value)    ((ObjSlice*)AS_OBJ(value))
 #define AS_CSTRING(value)  (((ObjString*)AS_OBJ(value))->chars)
+#define AS_FLOAT64_ARRAY(value) ((ObjFloat64Array*)AS_OBJ(value))
 #define AS_FUNCTION(value) ((ObjFunction*)AS_OBJ(value))
 #define AS_INSTANCE(value) ((ObjInstance*)AS_OBJ(value))
-#define AS_NATIVE(value)   (((ObjNative*)AS_OBJ(value))->function)
+#define AS_LIST(value)     ((ObjList*)AS_OBJ(value))
+#define AS_MAP(value)      ((ObjMap*)AS_OBJ(value))
+#define AS_NATIVE(value)   ((ObjNative*)AS_OBJ(value))
 
 typedef enum {
     OBJ_BOUND_METHOD,
     OBJ_CLASS,
     OBJ_CLOSURE,
+    OBJ_FLOAT64_ARRAY,
     OBJ_FUNCTION,
     OBJ_INSTANCE,
+    OBJ_LIST,
+    OBJ_MAP,
     OBJ_NATIVE,
+    OBJ_ROPE,
+    OBJ_SLICE,
     OBJ_STRING,
     OBJ_UPVALUE
 } ObjType;
@@ -60,22 +78,57 @@ struct ObjFunction {
 
 typedef struct ObjFunction ObjFunction;
 
-typedef Value (*NativeFn)(int argCount, Value* args);
+// A native is handed its arguments in args, and leaves its result in args[-1] (the slot the native itself was called from).
+// If it fails, it reports a runtimeError and returns false.
+typedef bool (*NativeFn)(VM* vm, int argCount, Value* args);
 
 typedef struct {
     Obj obj;
 
     // a pointer to the C function that implements the native behavior
     NativeFn function;
+    int arity; // -1 if it checks its arguments itself
 } ObjNative;
 
+// The chars live in the same allocation as the header, right after it
 struct ObjString {
     Obj obj;
     int length;
-    char* chars;
-    uint32_t hash; // cache the hash, so we don't have to recompute it - works because ObjStrings are immutable
+    uint32_t hash; // cache the hash, so we don't have to recompute it - works because ObjStrings are immutable. Only set once interned
+    bool isInterned; // in vm.strings, and so the only string with its text that is
+    char chars[];
 };
 
+/*
+ * A string made by concatenation whose text hasn't been needed yet.
+ * Concatenating with `+` just links the two sides together, so building up a string piece by piece
+ * is linear instead of copying (and interning) every intermediate string.
+ * left and right are each an ObjString, an ObjSlice or another ObjRope.
+ * The text is only assembled when something needs the whole string (printing it, comparing it...),
+ * after which flat holds it as an ObjString and the children are let go.
+ */
+typedef struct ObjRope {
+    Obj obj;
+    int length;
+    Obj* left;
+    Obj* right;
+    ObjString* flat;
+} ObjRope;
+
+/*
+ * A substring that shares its parent's chars instead of copying them.
+ * The parent is always a flat ObjString: a slice of a slice points at the original.
+ * A tiny slice would keep a huge parent alive, so if nothing else is holding on to the parent,
+ * the GC gives such a slice its own copy of its chars instead (see compactSlices in memory.c).
+ */
+typedef struct ObjSlice {
+    Obj obj;
+    int length;
+    int start;
+    ObjString* parent;
+    struct ObjSlice* nextWeak; // in vm.weakSlices, during a collection
+} ObjSlice;
+
 typedef struct ObjUpvalue {
     Obj obj;
     Value* location;
@@ -86,8 +139,8 @@ typedef struct ObjUpvalue {
 typedef struct ObjClosure {
     Obj obj;
     ObjFunction* function;
-    ObjUpvalue** upvalues;
     int upvalueCount;
+    ObjUpvalue* upvalues[]; // allocated along with the closure, function->upvalueCount of them
 } ObjClosure;
 
 typedef struct {
@@ -108,20 +161,81 @@ typedef struct {
     ObjClosure* method;
 } ObjBoundMethod;
 
+// A list's elements are stored contiguously, so indexing is a bounds check and a load
+typedef struct {
+    Obj obj;
+    ValueArray items;
+} ObjList;
+
+// A fixed-length array of unboxed doubles, aligned to FLOAT64_ALIGNMENT for the bulk kernels in float64.c
+typedef struct {
+    Obj obj;
+    int count;
+    double* values;
+} ObjFloat64Array;
+
+typedef struct {
+    Value key;
+    Value value;
+    uint32_t hash; // cached, so probing and rebuilding never rehash a key
+    bool isDeleted;
+} MapEntry;
+
+// A hash map from any Value to any Value, which remembers insertion order (see map.c)
+typedef struct {
+    Obj obj;
+    int count; // live entries
+    int entryCount; // entries used so far, deleted ones included
+    int entryCapacity;
+    MapEntry* entries; // in insertion order
+    int slotCapacity;
+    int32_t* slots; // the index: each slot is an entry number, or empty or deleted
+} ObjMap;
+
 ObjBoundMethod* newBoundMethod(VM* vm, Value receiver, ObjClosure* method);
 ObjClass* newClass(VM* vm, ObjString* name);
 ObjClosure* newClosure(VM* vm, ObjFunction* function);
+ObjFloat64Array* newFloat64Array(VM* vm, int count);
 ObjFunction* newFunction(VM* vm);
 ObjInstance* newInstance(VM* vm, ObjClass* klass);
-ObjNative* newNative(VM* vm, NativeFn function);
-ObjString* takeString(VM* vm, char* chars, int length);
+ObjList* newList(VM* vm);
+ObjMap* newMap(VM* vm);
+ObjNative* newNative(VM* vm, NativeFn function, int arity);
+ObjRope* newRope(VM* vm, Value left, Value right);
+ObjString* flattenRope(VM* vm, ObjRope* rope);
+Value newSubstring(VM* vm, Value string, int start, int length);
+void detachSlice(VM* vm, ObjSlice* slice);
+ObjString* allocateString(VM* vm, int length);
+ObjString* internString(VM* vm, ObjString* string);
 ObjString* copyString(VM* vm, const char* chars, int length);
+uint32_t hashString(const char* key, int length);
 ObjUpvalue* newUpvalue(VM* vm, Value* slot);
 
-void printObject(Value value, FILE* fd);
+void writeObject(Output* out, Value value);
 
 static inline bool isObjType(Value value, ObjType type) {
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+static inline int stringLength(Value value) {
+    switch (AS_OBJ(value)->type) {
+        case OBJ_ROPE: return AS_ROPE(value)->length;
+        case OBJ_SLICE: return AS_SLICE(value)->length;
+        default: return AS_STRING(value)->length;
+    }
+}
+
+// The chars of a flat string or a slice. A slice's aren't NUL-terminated. Ropes have to be flattened first.
+static inline const char* stringChars(Value value) {
+    if (IS_SLICE(value)) return AS_SLICE(value)->parent->chars + AS_SLICE(value)->start;
+    return AS_STRING(value)->chars;
+}
+
+// Two distinct interned strings can't have the same text, so chars only need comparing when one of them isn't interned
+static inline bool stringsEqual(ObjString* a, ObjString* b) {
+    if (a == b) return true;
+    if (a->isInterned && b->isInterned) return false;
+    return a->length == b->length && memcmp(a->chars, b->chars, a->length) == 0;
+}
+
 #endif //CLOX_OBJECT_H
@@ -0,0 +1,260 @@
+//
+// See optimizer.h. The chunk is decoded into a list of instructions (see ir.h), the peephole rewrites are repeated
+// until none of them apply any more, and then the surviving instructions are written back over the chunk, with their
+// jumps re-encoded for the new offsets and their lines kept.
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ir.h"
+#include "optimizer.h"
+#include "passes.h"
+
+// Whether a jump on the condition goes when it's truthy, for the four that just test it
+static bool jumpsIfTrue(uint8_t op) {
+    return op == OP_JUMP_IF_TRUE || op == OP_POP_JUMP_IF_TRUE;
+}
+
+// The fused jump for a comparison followed by a jump that pops its result, or 0 if there isn't one
+static uint8_t fuseComparison(uint8_t compare, uint8_t jump) {
+    bool ifTrue = jump == OP_POP_JUMP_IF_TRUE;
+    switch (compare) {
+        case OP_EQUAL:          return ifTrue ? OP_JUMP_IF_EQUAL : OP_JUMP_IF_NOT_EQUAL;
+        case OP_NOT_EQUAL:      return ifTrue ? OP_JUMP_IF_NOT_EQUAL : OP_JUMP_IF_EQUAL;
+        case OP_GREATER:
+        case OP_GREATER_NUMBER: return ifTrue ? OP_JUMP_IF_GREATER : OP_JUMP_IF_NOT_GREATER;
+        case OP_LESS:
+        case OP_LESS_NUMBER:    return ifTrue ? OP_JUMP_IF_LESS : OP_JUMP_IF_NOT_LESS;
+        default:                return 0;
+    }
+}
+
+static Instruction* at(Program* program, int index) {
+    return index < program->count ? &program->code[index] : NULL;
+}
+
+static bool isOp(Program* program, int index, uint8_t op) {
+    Instruction* instruction = at(program, index);
+    return instruction != NULL && instruction->op == op;
+}
+
+// Marks everything that can't be reached from the start as deleted
+static bool removeDeadCode(Program* program) {
+    for (int i = 0; i < program->count; i++) program->code[i].reachable = false;
+
+    int* worklist = malloc(sizeof(int) * (program->count + 1));
+    if (worklist == NULL) exit(1);
+    int pending = 0;
+    worklist[pending++] = liveInstruction(program, 0);
+    while (pending > 0) {
+        int index = worklist[--pending];
+        while (index < program->count && !program->code[index].reachable) {
+            Instruction* instruction = &program->code[index];
+            instruction->reachable = true;
+            if (isJump(instruction->op)) worklist[pending++] = instruction->target;
+            if (instruction->op == OP_JUMP || instruction->op == OP_LOOP || instruction->op == OP_RETURN) break;
+            index = liveInstruction(program, index + 1);
+        }
+    }
+    free(worklist);
+
+    bool changed = false;
+    for (int i = 0; i < program->count; i++) {
+        if (!program->code[i].deleted && !program->code[i].reachable) {
+            program->code[i].deleted = true;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+// A value that's pushed only to be popped straight off again
+static bool isPurePush(uint8_t op) {
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_UPVALUE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Whether the jump at from can be pointed at the instruction at index: conditional jumps can only go forwards, and no
+// jump can go further than 16 bits can say. Rewrites only ever make the code shorter, so where everything was at the
+// start of the round is near enough.
+static bool canJumpTo(Program* program, const int* positions, int from, int index) {
+    if (index >= program->count) return false;
+    if (isConditionalJump(program->code[from].op) && index <= from) return false;
+    int after = positions[from] + program->code[from].length;
+    return abs(positions[index] - after) <= UINT16_MAX;
+}
+
+static bool rewrite(Program* program) {
+    bool changed = false;
+    countIncoming(program);
+
+    int* positions = malloc(sizeof(int) * (program->count + 1));
+    if (positions == NULL) exit(1);
+    int position = 0;
+    for (int i = 0; i < program->count; i++) {
+        positions[i] = position;
+        if (!program->code[i].deleted) position += program->code[i].length;
+    }
+
+    for (int i = liveInstruction(program, 0); i < program->count; i = liveInstruction(program, i + 1)) {
+        Instruction* instruction = &program->code[i];
+        int nextIndex = liveInstruction(program, i + 1);
+        Instruction* next = at(program, nextIndex);
+
+        // `a != b` compiles to OP_EQUAL, OP_NOT
+        if (instruction->op == OP_EQUAL && next != NULL && next->op == OP_NOT && next->incoming == 0) {
+            instruction->op = OP_NOT_EQUAL;
+            next->deleted = true;
+            changed = true;
+            continue;
+        }
+
+        // Branch inversion: a condition that's negated only to be jumped on is jumped on the other way instead.
+        // The jump leaves the condition on the stack though, so this only works if both ways it can go pop it
+        // straight away, without looking at it. A jump to the negation still does the same thing afterwards.
+        if ((instruction->op == OP_NOT || instruction->op == OP_NOT_EQUAL) && next != NULL
+            && keepsCondition(next->op) && next->incoming == 0
+            && isOp(program, liveInstruction(program, nextIndex + 1), OP_POP) && isOp(program, liveInstruction(program, next->target), OP_POP)) {
+            next->op = next->op == OP_JUMP_IF_FALSE ? OP_JUMP_IF_TRUE : OP_JUMP_IF_FALSE;
+            if (instruction->op == OP_NOT) {
+                instruction->deleted = true;
+            } else {
+                instruction->op = OP_EQUAL;
+            }
+            changed = true;
+            continue;
+        }
+
+        // A negated condition that's popped by the jump on it is jumped on the other way instead
+        if (instruction->op == OP_NOT && next != NULL && isPopJump(next->op) && next->incoming == 0) {
+            next->op = next->op == OP_POP_JUMP_IF_FALSE ? OP_POP_JUMP_IF_TRUE : OP_POP_JUMP_IF_FALSE;
+            instruction->deleted = true;
+            changed = true;
+            continue;
+        }
+
+        // A comparison whose result is only jumped on and popped becomes one fused instruction. If the operands are
+        // the wrong type, the error is still reported on the comparison's line.
+        uint8_t fused = next != NULL && isPopJump(next->op) && next->incoming == 0
+                        ? fuseComparison(instruction->op, next->op) : 0;
+        if (fused != 0) {
+            next->op = fused;
+            next->line = instruction->line;
+            instruction->deleted = true;
+            changed = true;
+            continue;
+        }
+
+        // OP_FOR_LOOP always goes back to the top of its loop's body
+        if (isJump(instruction->op) && instruction->op != OP_FOR_LOOP) {
+            // Jump threading: a jump to an unconditional jump can go straight to where that one goes. A conditional
+            // jump that keeps its condition can go straight on through the same conditional jump too, since the
+            // condition it finds there is the one it jumped on.
+            int target = liveInstruction(program, instruction->target);
+            for (int hops = 0; hops < 16; hops++) {
+                Instruction* landing = at(program, target);
+                if (landing == NULL || landing == instruction) break;
+                bool follow = landing->op == OP_JUMP || landing->op == OP_LOOP
+                              || (keepsCondition(instruction->op) && landing->op == instruction->op);
+                if (!follow) break;
+                int further = liveInstruction(program, landing->target);
+                if (!canJumpTo(program, positions, i, further)) break;
+                target = further;
+            }
+            if (target != instruction->target) {
+                instruction->target = target;
+                changed = true;
+            }
+
+            // A jump that keeps its condition, followed by a POP for when it doesn't jump, can pop the condition
+            // itself if wherever it jumps to pops it too without looking at anything but its truthiness. That's what
+            // `and` and `or` look like when they're a statement's condition.
+            if (keepsCondition(instruction->op) && isOp(program, nextIndex, OP_POP) && next->incoming == 0) {
+                Instruction* landing = at(program, instruction->target);
+                int popped = -1;
+                if (landing != NULL && landing->op == OP_POP) {
+                    popped = liveInstruction(program, instruction->target + 1);
+                } else if (landing != NULL && isPopJump(landing->op)) {
+                    // the condition's the same one, so we know which way that jump goes
+                    popped = jumpsIfTrue(landing->op) == jumpsIfTrue(instruction->op)
+                             ? landing->target : liveInstruction(program, instruction->target + 1);
+                }
+                if (popped >= 0 && canJumpTo(program, positions, i, popped)) {
+                    instruction->op = jumpsIfTrue(instruction->op) ? OP_POP_JUMP_IF_TRUE : OP_POP_JUMP_IF_FALSE;
+                    instruction->target = popped;
+                    next->deleted = true;
+                    changed = true;
+                    continue;
+                }
+            }
+
+            // A jump to the very next instruction does nothing, except pop the condition if it's one that does that.
+            // A fused comparison still has to check its operands' types, so those are left alone.
+            if (instruction->op != OP_LOOP && instruction->target == nextIndex) {
+                if (isPopJump(instruction->op)) {
+                    instruction->op = OP_POP;
+                    instruction->length = 1;
+                    changed = true;
+                } else if (instruction->op == OP_JUMP || keepsCondition(instruction->op)) {
+                    instruction->deleted = true;
+                    changed = true;
+                }
+            }
+            continue;
+        }
+
+        // An expression statement with nothing to it, like `x;`, pushes a value and pops it
+        if (isPurePush(instruction->op) && next != NULL && next->op == OP_POP && next->incoming == 0) {
+            instruction->deleted = true;
+            next->deleted = true;
+            changed = true;
+            continue;
+        }
+    }
+
+    free(positions);
+    if (changed) countIncoming(program);
+    return removeDeadCode(program) || changed;
+}
+
+void optimizeFunction(VM* vm, ObjFunction* function, bool wholeFunction) {
+    if (function->chunk.count == 0) return;
+
+    // passes.c renumbers closure captures in the original code, so keep a copy to go back to
+    uint8_t* original = NULL;
+    if (wholeFunction) {
+        original = malloc(function->chunk.count);
+        if (original == NULL) exit(1);
+        memcpy(original, function->chunk.code, function->chunk.count);
+    }
+
+    Program program;
+    bool encoded = true;
+    if (decodeProgram(&program, vm, function)) {
+        bool changed = wholeFunction && runPasses(&program);
+        // every rewrite only ever deletes or changes instructions, so this is bound to stop
+        while (rewrite(&program)) changed = true;
+        if (changed) encoded = encodeProgram(&program);
+    }
+    freeProgram(&program);
+
+    // A jump pushed out of range leaves the chunk as compiled. If the whole-function passes did it, by adding code,
+    // the peephole pass alone may still manage.
+    if (!encoded && wholeFunction) {
+        memcpy(function->chunk.code, original, function->chunk.count);
+        free(original);
+        optimizeFunction(vm, function, false);
+        return;
+    }
+    free(original);
+}
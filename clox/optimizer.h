@@ -0,0 +1,14 @@
+//
+// A peephole pass over a finished chunk. The compiler emits code in one pass as it parses, so it can't see that a jump
+// lands on another jump, that the code after a return can never run, and so on. Once a function is done, this cleans
+// that up. With wholeFunction (clox -O), the passes in passes.h that look at the whole function run first.
+//
+
+#ifndef CLOX_OPTIMIZER_H
+#define CLOX_OPTIMIZER_H
+
+#include "object.h"
+
+void optimizeFunction(VM* vm, ObjFunction* function, bool wholeFunction);
+
+#endif //CLOX_OPTIMIZER_H
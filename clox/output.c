@@ -0,0 +1,254 @@
+//
+// See output.h.
+//
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "output.h"
+
+OutputSink fileSink(FILE* file) {
+    OutputSink sink;
+    sink.type = SINK_FILE;
+    sink.as.file = file;
+    return sink;
+}
+
+OutputSink fdSink(int fd) {
+    OutputSink sink;
+    sink.type = SINK_FD;
+    sink.as.fd = fd;
+    return sink;
+}
+
+// Starts *chars off as an empty string, which every flush appends to
+OutputSink memorySink(char** chars, size_t* length) {
+    OutputSink sink;
+    sink.type = SINK_MEMORY;
+    sink.as.memory.chars = chars;
+    sink.as.memory.length = length;
+    sink.as.memory.capacity = 64;
+    *chars = malloc(sink.as.memory.capacity);
+    if (*chars == NULL) exit(1);
+    (*chars)[0] = '\0';
+    *length = 0;
+    return sink;
+}
+
+OutputSink callbackSink(OutputCallback function, void* context) {
+    OutputSink sink;
+    sink.type = SINK_CALLBACK;
+    sink.as.callback.function = function;
+    sink.as.callback.context = context;
+    return sink;
+}
+
+static void sinkWrite(OutputSink* sink, const char* chars, size_t length) {
+    switch (sink->type) {
+        case SINK_FILE:
+            fwrite(chars, sizeof(char), length, sink->as.file);
+            break;
+        case SINK_FD:
+            while (length > 0) {
+                ssize_t wrote = write(sink->as.fd, chars, length);
+                if (wrote < 0 && errno == EINTR) continue;
+                if (wrote <= 0) return; // like a FILE, a sink that's gone away just loses what's written to it
+                chars += wrote;
+                length -= wrote;
+            }
+            break;
+        case SINK_MEMORY: {
+            size_t used = *sink->as.memory.length;
+            if (sink->as.memory.capacity < used + length + 1) {
+                while (sink->as.memory.capacity < used + length + 1) sink->as.memory.capacity *= 2;
+                *sink->as.memory.chars = realloc(*sink->as.memory.chars, sink->as.memory.capacity);
+                if (*sink->as.memory.chars == NULL) exit(1);
+            }
+            memcpy(*sink->as.memory.chars + used, chars, length);
+            *sink->as.memory.length = used + length;
+            (*sink->as.memory.chars)[used + length] = '\0';
+            break;
+        }
+        case SINK_CALLBACK:
+            sink->as.callback.function(sink->as.callback.context, chars, length);
+            break;
+    }
+}
+
+// A capacity of 0 means unbuffered: everything goes straight to the sink
+void initOutput(Output* output, OutputSink sink, FlushPolicy policy, char* buffer, size_t capacity) {
+    output->sink = sink;
+    output->policy = policy;
+    output->buffer = buffer;
+    output->capacity = capacity;
+    output->count = 0;
+    output->printing = NULL;
+}
+
+void flushOutput(Output* output) {
+    if (output->count == 0) return;
+    sinkWrite(&output->sink, output->buffer, output->count);
+    output->count = 0;
+}
+
+void writeChars(Output* output, const char* chars, size_t length) {
+    if (output->capacity - output->count < length) {
+        flushOutput(output);
+        // too big to be worth buffering
+        if (length >= output->capacity) {
+            sinkWrite(&output->sink, chars, length);
+            return;
+        }
+    }
+    memcpy(output->buffer + output->count, chars, length);
+    output->count += length;
+    if (output->policy == FLUSH_ALWAYS) flushOutput(output);
+}
+
+void writeString(Output* output, const char* chars) {
+    writeChars(output, chars, strlen(chars));
+}
+
+void writeNumber(Output* output, double number) {
+    char chars[NUMBER_FORMAT_MAX];
+    writeChars(output, chars, formatNumber(number, chars));
+}
+
+void writeNewline(Output* output) {
+    writeChars(output, "\n", 1);
+    if (output->policy == FLUSH_PER_LINE) flushOutput(output);
+}
+
+// Number formatting: "%g" means six significant digits, in plain notation for decimal exponents from -4 to 5 and
+// in scientific notation otherwise, either way without trailing zeros. Going through snprintf costs a format string
+// parse, a lock and a multi-precision conversion for every number, so the digits are worked out here instead,
+// falling back to snprintf only for the rare numbers where a quick answer could round differently than it does.
+
+static const double powersOf10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static const uint64_t integerPowersOf10[] = {
+        1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull, 10000000ull, 100000000ull,
+        1000000000ull, 10000000000ull, 100000000000ull, 1000000000000ull, 10000000000000ull,
+        100000000000000ull, 1000000000000000ull
+};
+
+// Rounds magnitude (finite, above 0) to six significant digits, as printf would, leaving them in digits as an integer
+// from 100000 to 999999, and the decimal exponent of the first one in exponent.
+// Returns false if it can't be sure it's done what printf would.
+static bool sixDigits(double magnitude, uint64_t* digits, int* exponent) {
+    uint64_t d;
+    int e;
+
+    if (magnitude < 1e15 && magnitude == (double)(uint64_t)magnitude) {
+        // whole numbers can be rounded exactly in integer arithmetic
+        uint64_t n = (uint64_t)magnitude;
+        int count = 1;
+        while (count < 16 && n >= integerPowersOf10[count]) count++;
+        e = count - 1;
+        if (count <= 6) {
+            d = n * integerPowersOf10[6 - count];
+        } else {
+            uint64_t divisor = integerPowersOf10[count - 6];
+            uint64_t remainder = n % divisor;
+            d = n / divisor;
+            // an exact tie goes to even, like printf in the default rounding mode
+            if (remainder * 2 > divisor || (remainder * 2 == divisor && (d & 1))) d++;
+        }
+    } else {
+        // scale by a power of ten into [100000, 1000000), starting from a guess based on the binary exponent
+        int binaryExponent;
+        frexp(magnitude, &binaryExponent);
+        int scale = 5 - ((binaryExponent - 1) * 78913 >> 18); // floor(log10(2^(binaryExponent - 1))), near enough
+        double scaled;
+        for (;;) {
+            if (scale > 22 || scale < -22) return false;
+            scaled = scale >= 0 ? magnitude * powersOf10[scale] : magnitude / powersOf10[-scale];
+            if (scaled < 100000) {
+                scale++;
+            } else if (scaled >= 1000000) {
+                scale--;
+            } else {
+                break;
+            }
+        }
+
+        // Powers of ten up to 1e22 are exact, so scaled is the exact product or quotient rounded once: off by at most
+        // half an ulp, about 1e-10 at this size. Unless it's that close to halfway, it rounds the way the exact value does.
+        uint64_t whole = (uint64_t)scaled;
+        double fraction = scaled - (double)whole;
+        if (fabs(fraction - 0.5) < 1e-6) return false;
+        d = whole + (fraction > 0.5);
+        e = 5 - scale;
+    }
+
+    if (d == 1000000) {
+        // rounded up into the next power of ten
+        d = 100000;
+        e++;
+    }
+    *digits = d;
+    *exponent = e;
+    return true;
+}
+
+int formatNumber(double number, char* dest) {
+    if (!isfinite(number)) return snprintf(dest, NUMBER_FORMAT_MAX, "%g", number);
+
+    char* out = dest;
+    if (signbit(number)) *out++ = '-';
+    if (number == 0) {
+        *out++ = '0';
+        *out = '\0';
+        return (int)(out - dest);
+    }
+
+    uint64_t d;
+    int exponent;
+    if (!sixDigits(fabs(number), &d, &exponent)) return snprintf(dest, NUMBER_FORMAT_MAX, "%g", number);
+
+    char digits[6];
+    for (int i = 5; i >= 0; i--) {
+        digits[i] = (char)('0' + d % 10);
+        d /= 10;
+    }
+    int significant = 6; // how many digits are left once trailing zeros go
+    while (digits[significant - 1] == '0') significant--;
+
+    if (exponent < -4 || exponent >= 6) {
+        *out++ = digits[0];
+        if (significant > 1) {
+            *out++ = '.';
+            memcpy(out, digits + 1, significant - 1);
+            out += significant - 1;
+        }
+        *out++ = 'e';
+        *out++ = exponent < 0 ? '-' : '+';
+        int magnitude = abs(exponent);
+        if (magnitude >= 100) *out++ = (char)('0' + magnitude / 100);
+        *out++ = (char)('0' + magnitude / 10 % 10);
+        *out++ = (char)('0' + magnitude % 10);
+    } else if (exponent >= 0) {
+        memcpy(out, digits, exponent + 1);
+        out += exponent + 1;
+        if (significant > exponent + 1) {
+            *out++ = '.';
+            memcpy(out, digits + exponent + 1, significant - exponent - 1);
+            out += significant - exponent - 1;
+        }
+    } else {
+        *out++ = '0';
+        *out++ = '.';
+        for (int i = -1; i > exponent; i--) *out++ = '0';
+        memcpy(out, digits, significant);
+        out += significant;
+    }
+
+    *out = '\0';
+    return (int)(out - dest);
+}
@@ -0,0 +1,81 @@
+//
+// Buffered output for print. Rather than going through stdio for every value, a VM formats everything it prints
+// into its own buffer, which is handed to a sink in one go when it fills up (or at the end of every line, or after
+// every write, depending on the flush policy).
+//
+
+#ifndef CLOX_OUTPUT_H
+#define CLOX_OUTPUT_H
+
+#include <stdio.h>
+
+#include "common.h"
+
+#define OUTPUT_BUFFER_SIZE 8192
+
+typedef void (*OutputCallback)(void* context, const char* chars, size_t length);
+
+typedef enum {
+    SINK_FILE,
+    SINK_FD,
+    SINK_MEMORY,
+    SINK_CALLBACK
+} OutputSinkType;
+
+// Where flushed output ends up
+typedef struct {
+    OutputSinkType type;
+    union {
+        FILE* file;
+        int fd;
+        // like open_memstream: *chars is malloc'd, grows as needed, and is kept NUL terminated. The caller frees it.
+        struct {
+            char** chars;
+            size_t* length;
+            size_t capacity;
+        } memory;
+        struct {
+            OutputCallback function;
+            void* context;
+        } callback;
+    } as;
+} OutputSink;
+
+typedef enum {
+    FLUSH_WHEN_FULL, // and when the script finishes
+    FLUSH_PER_LINE,
+    FLUSH_ALWAYS // after every write, so nothing waits in the buffer
+} FlushPolicy;
+
+// A list or map in the middle of being written, linked to the one it's inside of. These live on the C stack of writeObject.
+typedef struct Printing {
+    const void* container;
+    struct Printing* enclosing;
+} Printing;
+
+typedef struct Output {
+    OutputSink sink;
+    FlushPolicy policy;
+    char* buffer; // belongs to whoever set up the Output
+    size_t capacity;
+    size_t count;
+    Printing* printing; // innermost first, so a container that holds itself is written as [...] or {...} rather than forever
+} Output;
+
+OutputSink fileSink(FILE* file);
+OutputSink fdSink(int fd);
+OutputSink memorySink(char** chars, size_t* length);
+OutputSink callbackSink(OutputCallback function, void* context);
+
+void initOutput(Output* output, OutputSink sink, FlushPolicy policy, char* buffer, size_t capacity);
+void flushOutput(Output* output);
+void writeChars(Output* output, const char* chars, size_t length);
+void writeString(Output* output, const char* chars);
+void writeNumber(Output* output, double number);
+void writeNewline(Output* output);
+
+// Formats number the way printf's "%g" would, into dest (which needs room for NUMBER_FORMAT_MAX chars). Returns the length.
+#define NUMBER_FORMAT_MAX 32
+int formatNumber(double number, char* dest);
+
+#endif //CLOX_OUTPUT_H
@@ -0,0 +1,1193 @@
+//
+// See passes.h. Everything here works on the stack positions of the function's frame: slot 0 is the function itself,
+// then the parameters, then locals and the values expressions are working on, which are all just positions on the
+// stack. computeDepths says how deep the stack is before each instruction, so each pass knows which position every
+// instruction reads and writes.
+//
+// Local slots that a closure captures are left strictly alone, since the closure can read and write them whenever it
+// gets called. Temporaries are numbered from 0 while the passes run (their GET_LOCALs and SET_LOCALs are marked
+// isTemp), and only get real slots at the end, in addTemps.
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "passes.h"
+
+// The most temporaries a function's frame gets, which is also the most values CSE and LICM can keep
+#define MAX_TEMPS 8
+
+// Each pass goes round until it stops finding things to do, but never more than this many times
+#define MAX_ROUNDS 64
+
+// From most to least known. The types are for when we know what type a value is, but not which one.
+typedef enum {
+    VALUE_CONSTANT,
+    VALUE_NUMBER,
+    VALUE_BOOL,
+    VALUE_STRING,   // any kind of string: a plain one, a rope or a slice
+    VALUE_UNKNOWN,
+} ValueKind;
+
+// What constant propagation and type inference know about the value in a stack position
+typedef struct {
+    ValueKind kind;
+    Value constant;
+    int copyOf;     // the local slot it's a copy of, or -1
+} AbstractValue;
+
+typedef struct {
+    Program* program;
+    int* depths;
+    Blocks blocks;
+    bool* captured;
+    int width;                // how many stack positions the function ever uses
+    AbstractValue* entries;   // for constant propagation, what's in each position at the start of each block
+    bool* reached;
+} Analysis;
+
+typedef struct {
+    Program* program;
+    int tempCount;
+    int maxTemps;
+} Passes;
+
+static bool beginAnalysis(Program* program, Analysis* analysis) {
+    analysis->program = program;
+    analysis->entries = NULL;
+    analysis->reached = NULL;
+    analysis->depths = computeDepths(program);
+    if (analysis->depths == NULL) return false;
+    findBlocks(program, &analysis->blocks);
+    analysis->captured = findCapturedSlots(program);
+
+    analysis->width = program->function->arity + 2;
+    for (int i = liveInstruction(program, 0); i < program->count; i = liveInstruction(program, i + 1)) {
+        if (analysis->depths[i] < 0) continue;
+        int pops, pushes;
+        stackEffect(program, &program->code[i], &pops, &pushes);
+        if (analysis->depths[i] + pushes + 1 > analysis->width) analysis->width = analysis->depths[i] + pushes + 1;
+    }
+    return true;
+}
+
+static void endAnalysis(Analysis* analysis) {
+    free(analysis->depths);
+    freeBlocks(&analysis->blocks);
+    free(analysis->captured);
+    free(analysis->entries);
+    free(analysis->reached);
+}
+
+static Instruction newInstruction(uint8_t op, uint8_t arg, int line) {
+    Instruction instruction;
+    instruction.op = op;
+    instruction.arg = arg;
+    instruction.offset = -1;
+    instruction.length = op == OP_POP || op == OP_NIL ? 1 : 2;
+    instruction.line = line;
+    instruction.target = -1;
+    instruction.incoming = 0;
+    instruction.deleted = false;
+    instruction.reachable = true;
+    instruction.isTemp = false;
+    return instruction;
+}
+
+static int previousLive(Program* program, int index) {
+    do {
+        index--;
+    } while (index >= 0 && program->code[index].deleted);
+    return index;
+}
+
+// How many operands a pure instruction takes, or 0 for ones that aren't pure. Pure ones can fail if their operands
+// are the wrong type, but they don't do anything else.
+static int pureOperands(uint8_t op) {
+    switch (op) {
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_NEGATE_NUMBER:
+            return 1;
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_GREATER_NUMBER:
+        case OP_LESS_NUMBER:
+        case OP_ADD_NUMBER:
+        case OP_SUBTRACT_NUMBER:
+        case OP_MULTIPLY_NUMBER:
+        case OP_DIVIDE_NUMBER:
+            return 2;
+        default:
+            return 0;
+    }
+}
+
+static bool isConstantLoad(Instruction* instruction) {
+    switch (instruction->op) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static Value loadedConstant(Program* program, Instruction* instruction) {
+    switch (instruction->op) {
+        case OP_NIL:   return NIL_VAL;
+        case OP_TRUE:  return BOOL_VAL(true);
+        case OP_FALSE: return BOOL_VAL(false);
+        default:       return program->chunk->constants.values[instruction->arg];
+    }
+}
+
+static bool isFalseyValue(Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// The same value down to the bit, so 0 and -0 are different, and NaN is itself
+static bool sameValue(Value a, Value b) {
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        double x = AS_NUMBER(a);
+        double y = AS_NUMBER(b);
+        return memcmp(&x, &y, sizeof(double)) == 0;
+    }
+    if (IS_OBJ(a) || IS_OBJ(b)) return IS_OBJ(a) && IS_OBJ(b) && AS_OBJ(a) == AS_OBJ(b);
+    return valuesEqual(a, b);
+}
+
+// The checked instruction an unchecked one stands in for, and the unchecked one for a checked one (or 0 if there
+// isn't one)
+static uint8_t checkedOp(uint8_t op) {
+    switch (op) {
+        case OP_GREATER_NUMBER:  return OP_GREATER;
+        case OP_LESS_NUMBER:     return OP_LESS;
+        case OP_ADD_NUMBER:      return OP_ADD;
+        case OP_SUBTRACT_NUMBER: return OP_SUBTRACT;
+        case OP_MULTIPLY_NUMBER: return OP_MULTIPLY;
+        case OP_DIVIDE_NUMBER:   return OP_DIVIDE;
+        case OP_NEGATE_NUMBER:   return OP_NEGATE;
+        default:                 return op;
+    }
+}
+
+static uint8_t uncheckedOp(uint8_t op) {
+    switch (op) {
+        case OP_GREATER:  return OP_GREATER_NUMBER;
+        case OP_LESS:     return OP_LESS_NUMBER;
+        case OP_ADD:      return OP_ADD_NUMBER;
+        case OP_SUBTRACT: return OP_SUBTRACT_NUMBER;
+        case OP_MULTIPLY: return OP_MULTIPLY_NUMBER;
+        case OP_DIVIDE:   return OP_DIVIDE_NUMBER;
+        case OP_NEGATE:   return OP_NEGATE_NUMBER;
+        default:          return 0;
+    }
+}
+
+// What a pure instruction gives for constant operands, as long as that isn't a runtime error. Anything to do with
+// strings is left for the VM.
+static bool foldConstants(uint8_t op, Value a, Value b, Value* result) {
+    op = checkedOp(op);
+    switch (op) {
+        case OP_NOT:
+            *result = BOOL_VAL(isFalseyValue(a));
+            return true;
+        case OP_NEGATE:
+            if (!IS_NUMBER(a)) return false;
+            *result = NUMBER_VAL(-AS_NUMBER(a));
+            return true;
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+            if (IS_OBJ(a) || IS_OBJ(b)) return false;
+            *result = BOOL_VAL(valuesEqual(a, b) == (op == OP_EQUAL));
+            return true;
+        default:
+            break;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (op) {
+        case OP_ADD:      *result = NUMBER_VAL(x + y); return true;
+        case OP_SUBTRACT: *result = NUMBER_VAL(x - y); return true;
+        case OP_MULTIPLY: *result = NUMBER_VAL(x * y); return true;
+        case OP_DIVIDE:   *result = NUMBER_VAL(x / y); return true;
+        case OP_GREATER:  *result = BOOL_VAL(x > y); return true;
+        case OP_LESS:     *result = BOOL_VAL(x < y); return true;
+        default:          return false;
+    }
+}
+
+// The comparison a fused jump does, and whether it jumps when that's true
+static uint8_t fusedComparison(uint8_t op, bool* ifTrue) {
+    *ifTrue = op == OP_JUMP_IF_EQUAL || op == OP_JUMP_IF_GREATER || op == OP_JUMP_IF_LESS;
+    switch (op) {
+        case OP_JUMP_IF_EQUAL:
+        case OP_JUMP_IF_NOT_EQUAL:   return OP_EQUAL;
+        case OP_JUMP_IF_GREATER:
+        case OP_JUMP_IF_NOT_GREATER: return OP_GREATER;
+        case OP_JUMP_IF_LESS:
+        case OP_JUMP_IF_NOT_LESS:    return OP_LESS;
+        default:                     return 0;
+    }
+}
+
+static int findConstant(Program* program, Value value) {
+    ValueArray* constants = &program->chunk->constants;
+    for (int i = 0; i < constants->count; i++) {
+        if (sameValue(constants->values[i], value)) return i;
+    }
+    if (constants->count >= UINT8_COUNT) return -1;
+    return addConstant(program->vm, program->chunk, value);
+}
+
+// Turns instruction into one that pushes value, if there's room in the constant table for it
+static bool loadConstant(Program* program, Instruction* instruction, Value value) {
+    if (IS_NIL(value)) {
+        instruction->op = OP_NIL;
+        instruction->length = 1;
+    } else if (IS_BOOL(value)) {
+        instruction->op = AS_BOOL(value) ? OP_TRUE : OP_FALSE;
+        instruction->length = 1;
+    } else {
+        int constant = findConstant(program, value);
+        if (constant < 0) return false;
+        instruction->op = OP_CONSTANT;
+        instruction->arg = (uint8_t) constant;
+        instruction->length = 2;
+    }
+    instruction->isTemp = false;
+    return true;
+}
+
+// Constant and copy propagation
+
+static AbstractValue unknownValue() {
+    AbstractValue value = {VALUE_UNKNOWN, NIL_VAL, -1};
+    return value;
+}
+
+static AbstractValue typedValue(ValueKind kind) {
+    AbstractValue value = {kind, NIL_VAL, -1};
+    return value;
+}
+
+static AbstractValue constantValue(Value constant) {
+    AbstractValue value = {VALUE_CONSTANT, constant, -1};
+    return value;
+}
+
+static bool isNumberValue(AbstractValue* value) {
+    return value->kind == VALUE_NUMBER || (value->kind == VALUE_CONSTANT && IS_NUMBER(value->constant));
+}
+
+static bool isBoolValue(AbstractValue* value) {
+    return value->kind == VALUE_BOOL || (value->kind == VALUE_CONSTANT && IS_BOOL(value->constant));
+}
+
+static bool isStringValue(AbstractValue* value) {
+    return value->kind == VALUE_STRING || (value->kind == VALUE_CONSTANT && IS_ANY_STRING(value->constant));
+}
+
+static AbstractValue* entryOf(Analysis* analysis, int block) {
+    return &analysis->entries[block * analysis->width];
+}
+
+// The value in slot is about to change, so nothing's a copy of it any more
+static void forgetCopies(AbstractValue* state, int depth, int slot) {
+    for (int i = 0; i < depth; i++) {
+        if (state[i].copyOf == slot) state[i].copyOf = -1;
+    }
+}
+
+static int popValues(AbstractValue* state, int depth, int count) {
+    for (int i = 0; i < count; i++) {
+        depth--;
+        forgetCopies(state, depth, depth);
+    }
+    return depth;
+}
+
+// Runs instruction over state, returning the new depth
+static int transfer(Analysis* analysis, Instruction* instruction, AbstractValue* state, int depth) {
+    Program* program = analysis->program;
+    AbstractValue result = unknownValue();
+    switch (instruction->op) {
+        case OP_CONSTANT: result = constantValue(program->chunk->constants.values[instruction->arg]); break;
+        case OP_NIL:      result = constantValue(NIL_VAL); break;
+        case OP_TRUE:     result = constantValue(BOOL_VAL(true)); break;
+        case OP_FALSE:    result = constantValue(BOOL_VAL(false)); break;
+        case OP_GET_LOCAL:
+            if (!instruction->isTemp && !analysis->captured[instruction->arg]) {
+                result = state[instruction->arg];
+                if (result.copyOf < 0) result.copyOf = instruction->arg;
+            }
+            break;
+        case OP_SET_LOCAL: {
+            int slot = instruction->arg;
+            if (instruction->isTemp || analysis->captured[slot] || state[depth - 1].copyOf == slot) return depth;
+            forgetCopies(state, depth, slot);
+            state[slot] = state[depth - 1];
+            return depth;
+        }
+        case OP_SET_GLOBAL:
+        case OP_SET_UPVALUE:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+            // these leave the value they looked at where it was
+            return depth;
+        case OP_FOR_LOOP:
+            if (!analysis->captured[instruction->arg]) {
+                forgetCopies(state, depth, instruction->arg);
+                state[instruction->arg] = typedValue(VALUE_NUMBER); // or it'd have been a runtime error
+            }
+            break;
+        default: {
+            int operands = pureOperands(instruction->op);
+            if (operands == 0) break;
+            AbstractValue* a = &state[depth - operands];
+            AbstractValue* b = &state[depth - 1];
+            Value folded;
+            uint8_t op = checkedOp(instruction->op);
+            if (a->kind == VALUE_CONSTANT && b->kind == VALUE_CONSTANT
+                && foldConstants(op, a->constant, b->constant, &folded)) {
+                result = constantValue(folded);
+            } else if (op == OP_SUBTRACT || op == OP_MULTIPLY || op == OP_DIVIDE || op == OP_NEGATE) {
+                result = typedValue(VALUE_NUMBER); // again, or it was an error
+            } else if (op == OP_ADD && isNumberValue(a) && isNumberValue(b)) {
+                result = typedValue(VALUE_NUMBER);
+            } else if (op == OP_ADD && isStringValue(a) && isStringValue(b)) {
+                result = typedValue(VALUE_STRING);
+            } else if (op != OP_ADD) {
+                result = typedValue(VALUE_BOOL); // the comparisons and OP_NOT
+            }
+            break;
+        }
+    }
+
+    int pops, pushes;
+    stackEffect(program, instruction, &pops, &pushes);
+    depth = popValues(state, depth, pops);
+    if (pushes > 0) state[depth++] = result;
+    return depth;
+}
+
+// Merges what's known about a value coming into a block one way with what's known about it coming in another.
+// Returns whether that lost anything.
+static bool meetValues(AbstractValue* into, AbstractValue* from) {
+    AbstractValue merged = *into;
+    if (merged.copyOf != from->copyOf) merged.copyOf = -1;
+    if (into->kind == VALUE_CONSTANT && from->kind == VALUE_CONSTANT && sameValue(into->constant, from->constant)) {
+        // still the same constant
+    } else if (isNumberValue(into) && isNumberValue(from)) {
+        merged.kind = VALUE_NUMBER;
+    } else if (isBoolValue(into) && isBoolValue(from)) {
+        merged.kind = VALUE_BOOL;
+    } else if (isStringValue(into) && isStringValue(from)) {
+        merged.kind = VALUE_STRING;
+    } else {
+        merged.kind = VALUE_UNKNOWN;
+    }
+    bool changed = merged.kind != into->kind || merged.copyOf != into->copyOf;
+    *into = merged;
+    return changed;
+}
+
+// Works out the state at the start of every block, going round until nothing changes. The values can only ever go
+// from a constant to a type to unknown, and copies can only be forgotten, so that doesn't take long.
+static void analyzeValues(Analysis* analysis) {
+    Program* program = analysis->program;
+    Blocks* blocks = &analysis->blocks;
+    int width = analysis->width;
+    analysis->entries = malloc(sizeof(AbstractValue) * width * (blocks->count + 1));
+    analysis->reached = calloc(blocks->count + 1, sizeof(bool));
+    AbstractValue* state = malloc(sizeof(AbstractValue) * width);
+    int* worklist = malloc(sizeof(int) * (blocks->count + 1));
+    bool* pending = calloc(blocks->count + 1, sizeof(bool));
+    if (analysis->entries == NULL || analysis->reached == NULL || state == NULL || worklist == NULL
+        || pending == NULL) {
+        exit(1);
+    }
+    for (int i = 0; i < width * blocks->count; i++) analysis->entries[i] = unknownValue();
+
+    int count = 0;
+    if (blocks->count > 0) {
+        // the function and its arguments could be anything
+        analysis->reached[0] = true;
+        pending[0] = true;
+        worklist[count++] = 0;
+    }
+
+    while (count > 0) {
+        int b = worklist[--count];
+        pending[b] = false;
+        Block* block = &blocks->blocks[b];
+        memcpy(state, entryOf(analysis, b), sizeof(AbstractValue) * width);
+        int depth = analysis->depths[block->start];
+        for (int i = block->start; i < block->end; i = liveInstruction(program, i + 1)) {
+            depth = transfer(analysis, &program->code[i], state, depth);
+        }
+
+        for (int s = 0; s < block->successorCount; s++) {
+            int next = block->successors[s];
+            AbstractValue* entry = entryOf(analysis, next);
+            bool changed = false;
+            if (!analysis->reached[next]) {
+                memcpy(entry, state, sizeof(AbstractValue) * width);
+                analysis->reached[next] = true;
+                changed = true;
+            } else {
+                for (int i = 0; i < depth; i++) {
+                    if (meetValues(&entry[i], &state[i])) changed = true;
+                }
+            }
+            if (changed && !pending[next]) {
+                pending[next] = true;
+                worklist[count++] = next;
+            }
+        }
+    }
+
+    free(state);
+    free(worklist);
+    free(pending);
+}
+
+// Rewrites the instruction at index using what's known about the values going into it: a local that's known to be a
+// constant is loaded as one, one that's a copy of another local is loaded from that one, and operations and jumps on
+// constants are done now. Adjusts depth for any operands that were folded away.
+static bool rewriteInstruction(Analysis* analysis, int block, int index, AbstractValue* state, int* depth) {
+    Program* program = analysis->program;
+    Instruction* instruction = &program->code[index];
+    uint8_t op = instruction->op;
+
+    if (op == OP_GET_LOCAL) {
+        if (instruction->isTemp || analysis->captured[instruction->arg]) return false;
+        AbstractValue* value = &state[instruction->arg];
+        if (value->kind == VALUE_CONSTANT && loadConstant(program, instruction, value->constant)) return true;
+        if (value->copyOf >= 0 && value->copyOf != instruction->arg) {
+            instruction->arg = (uint8_t) value->copyOf;
+            return true;
+        }
+        return false;
+    }
+
+    // a jump that leaves its condition there can go or not go without looking at it
+    if (keepsCondition(op)) {
+        AbstractValue* condition = &state[*depth - 1];
+        if (condition->kind != VALUE_CONSTANT) return false;
+        if (isFalseyValue(condition->constant) == (op == OP_JUMP_IF_FALSE)) {
+            instruction->op = OP_JUMP;
+        } else {
+            instruction->deleted = true;
+        }
+        return true;
+    }
+
+    // the rest need their operands to be constants pushed just before them
+    int operands = pureOperands(op);
+    bool ifTrue;
+    uint8_t compare = fusedComparison(op, &ifTrue);
+    if (isPopJump(op)) ifTrue = op == OP_POP_JUMP_IF_TRUE;
+    if (operands == 0) operands = isPopJump(op) ? 1 : compare != 0 ? 2 : 0;
+    if (operands == 0) return false;
+
+    int loads[2];
+    int at = index;
+    for (int n = operands - 1; n >= 0; n--) {
+        at = previousLive(program, at);
+        if (at < 0 || analysis->blocks.blockOf[at] != block || !isConstantLoad(&program->code[at])) return false;
+        loads[n] = at;
+    }
+    Value a = loadedConstant(program, &program->code[loads[0]]);
+    Value b = loadedConstant(program, &program->code[loads[operands - 1]]);
+
+    Value result;
+    if (pureOperands(op) > 0) {
+        if (!foldConstants(op, a, b, &result) || !loadConstant(program, instruction, result)) return false;
+    } else {
+        bool condition;
+        if (compare != 0) {
+            if (!foldConstants(compare, a, b, &result)) return false;
+            condition = AS_BOOL(result);
+        } else {
+            condition = !isFalseyValue(a);
+        }
+        if (condition == ifTrue) {
+            instruction->op = OP_JUMP;
+        } else {
+            instruction->deleted = true;
+        }
+    }
+
+    for (int n = 0; n < operands; n++) program->code[loads[n]].deleted = true;
+    *depth = popValues(state, *depth, operands);
+    return true;
+}
+
+static bool propagateValues(Program* program) {
+    Analysis analysis;
+    if (!beginAnalysis(program, &analysis)) return false;
+    analyzeValues(&analysis);
+
+    bool changed = false;
+    AbstractValue* state = malloc(sizeof(AbstractValue) * analysis.width);
+    if (state == NULL) exit(1);
+    for (int b = 0; b < analysis.blocks.count; b++) {
+        if (!analysis.reached[b]) continue;
+        Block* block = &analysis.blocks.blocks[b];
+        memcpy(state, entryOf(&analysis, b), sizeof(AbstractValue) * analysis.width);
+        int depth = analysis.depths[block->start];
+        for (int i = block->start; i < block->end; i = liveInstruction(program, i + 1)) {
+            if (rewriteInstruction(&analysis, b, i, state, &depth)) changed = true;
+            if (!program->code[i].deleted) depth = transfer(&analysis, &program->code[i], state, depth);
+        }
+    }
+
+    free(state);
+    endAnalysis(&analysis);
+    return changed;
+}
+
+// Dead store elimination
+
+// Turns which positions are live after instruction into which are live before it. A value's live if something might
+// still look at it: a GET_LOCAL of its slot, or any instruction that takes it off the stack, apart from a plain POP.
+static void liveBefore(Instruction* instruction, int depth, int pops, int pushes, bool* live) {
+    switch (instruction->op) {
+        case OP_SET_LOCAL:
+            if (!instruction->isTemp) live[instruction->arg] = false;
+            live[depth - 1] = true;
+            return;
+        case OP_SET_GLOBAL:
+        case OP_SET_UPVALUE:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+            live[depth - 1] = true;
+            return;
+        case OP_POP:
+            live[depth - 1] = false;
+            return;
+        default:
+            break;
+    }
+
+    for (int i = depth - pops; i < depth - pops + pushes; i++) live[i] = false;
+    for (int i = depth - pops; i < depth; i++) live[i] = true;
+    if ((instruction->op == OP_GET_LOCAL && !instruction->isTemp) || instruction->op == OP_FOR_LOOP) {
+        live[instruction->arg] = true;
+    }
+}
+
+// Walks a block backwards from what's live at its end, deleting the stores nothing will look at if asked to, and
+// leaves what's live at its start in live
+static bool walkLiveness(Analysis* analysis, int b, bool* liveIn, bool* live, bool deleteStores) {
+    Program* program = analysis->program;
+    Block* block = &analysis->blocks.blocks[b];
+    int width = analysis->width;
+
+    memset(live, 0, sizeof(bool) * width);
+    for (int s = 0; s < block->successorCount; s++) {
+        bool* successor = &liveIn[block->successors[s] * width];
+        for (int i = 0; i < width; i++) live[i] = live[i] || successor[i];
+    }
+
+    bool deleted = false;
+    int last = block->start;
+    for (int i = block->start; i < block->end; i = liveInstruction(program, i + 1)) last = i;
+    for (int i = last; i >= block->start; i--) {
+        Instruction* instruction = &program->code[i];
+        if (instruction->deleted) continue;
+        if (deleteStores && instruction->op == OP_SET_LOCAL && !instruction->isTemp
+            && !analysis->captured[instruction->arg] && !live[instruction->arg]) {
+            // it only peeks at the value, so it can just go
+            instruction->deleted = true;
+            deleted = true;
+            continue;
+        }
+        int pops, pushes;
+        stackEffect(program, instruction, &pops, &pushes);
+        liveBefore(instruction, analysis->depths[i], pops, pushes, live);
+    }
+    return deleted;
+}
+
+static bool eliminateDeadStores(Program* program) {
+    Analysis analysis;
+    if (!beginAnalysis(program, &analysis)) return false;
+    int width = analysis.width;
+    int blockCount = analysis.blocks.count;
+    bool* liveIn = calloc((size_t) width * (blockCount + 1), sizeof(bool));
+    bool* live = malloc(sizeof(bool) * width);
+    if (liveIn == NULL || live == NULL) exit(1);
+
+    // liveness only ever grows, so this stops
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int b = blockCount - 1; b >= 0; b--) {
+            if (analysis.depths[analysis.blocks.blocks[b].start] < 0) continue;
+            walkLiveness(&analysis, b, liveIn, live, false);
+            if (memcmp(live, &liveIn[b * width], sizeof(bool) * width) != 0) {
+                memcpy(&liveIn[b * width], live, sizeof(bool) * width);
+                changed = true;
+            }
+        }
+    }
+
+    bool deleted = false;
+    for (int b = 0; b < blockCount; b++) {
+        if (analysis.depths[analysis.blocks.blocks[b].start] < 0) continue;
+        if (walkLiveness(&analysis, b, liveIn, live, true)) deleted = true;
+    }
+
+    free(liveIn);
+    free(live);
+    endAnalysis(&analysis);
+    return deleted;
+}
+
+// Common subexpression elimination, within a block. Every value gets a number, so that two values with the same
+// number are bound to be the same: the same constant, the same local with nothing stored into it in between, or the
+// same pure operation on values with the same numbers. When a pure expression's value has been worked out before, it's
+// kept in a temporary the first time and loaded from there the next.
+
+typedef struct {
+    uint8_t op;
+    int arg;
+    int left;
+    int right;
+    int root;     // the first instruction that worked it out
+} ValueKey;
+
+typedef struct {
+    int number;   // the value's number, or -1 if it doesn't have one
+    int start;    // the first of the instructions that work it out, or -1 if those can't just be deleted
+} StackValue;
+
+static int numberValueKey(ValueKey* keys, int* keyCount, uint8_t op, int arg, int left, int right, int root) {
+    for (int i = 0; i < *keyCount; i++) {
+        ValueKey* key = &keys[i];
+        if (key->op == op && key->arg == arg && key->left == left && key->right == right) return i;
+    }
+    ValueKey* key = &keys[(*keyCount)++];
+    key->op = op;
+    key->arg = arg;
+    key->left = left;
+    key->right = right;
+    key->root = root;
+    return *keyCount - 1;
+}
+
+// Loads the value worked out by the instructions from start to root from the temporary the instruction at first
+// stores it in, adding that store if there isn't one. Returns false if there's no temporary for it.
+static bool reuseValue(Passes* passes, int first, int start, int root) {
+    Program* program = passes->program;
+    int next = liveInstruction(program, first + 1);
+    int temp;
+    if (program->code[next].op == OP_SET_LOCAL && program->code[next].isTemp) {
+        temp = program->code[next].arg;
+    } else {
+        if (passes->tempCount == passes->maxTemps) return false;
+        temp = passes->tempCount++;
+        Instruction store = newInstruction(OP_SET_LOCAL, (uint8_t) temp, program->code[first].line);
+        store.isTemp = true;
+        insertInstructions(program, first + 1, &store, 1);
+        start++;
+        root++;
+    }
+
+    for (int i = start; i < root; i++) program->code[i].deleted = true;
+    Instruction* load = &program->code[root];
+    load->op = OP_GET_LOCAL;
+    load->arg = (uint8_t) temp;
+    load->length = 2;
+    load->isTemp = true;
+    return true;
+}
+
+static int liveCount(Program* program, int start, int end) {
+    int count = 0;
+    for (int i = start; i <= end; i++) {
+        if (!program->code[i].deleted) count++;
+    }
+    return count;
+}
+
+// Finds one value that's worked out twice and deals with it, returning whether there was one
+static bool eliminateCommonSubexpression(Passes* passes) {
+    Program* program = passes->program;
+    Analysis analysis;
+    if (!beginAnalysis(program, &analysis)) return false;
+
+    int width = analysis.width;
+    StackValue* stack = malloc(sizeof(StackValue) * width);
+    ValueKey* keys = malloc(sizeof(ValueKey) * (program->count + 1));
+    int* versions = calloc(width, sizeof(int));
+    int tempValues[MAX_TEMPS];
+    if (stack == NULL || keys == NULL || versions == NULL) exit(1);
+    int version = 0;
+
+    bool found = false;
+    for (int b = 0; b < analysis.blocks.count && !found; b++) {
+        Block* block = &analysis.blocks.blocks[b];
+        int depth = analysis.depths[block->start];
+        if (depth < 0) continue;
+        int keyCount = 0;
+        for (int i = 0; i < depth; i++) stack[i] = (StackValue) {-1, -1};
+        for (int t = 0; t < MAX_TEMPS; t++) tempValues[t] = -1;
+
+        for (int i = block->start; i < block->end && !found; i = liveInstruction(program, i + 1)) {
+            Instruction* instruction = &program->code[i];
+            StackValue result = {-1, -1};
+            int operands = pureOperands(instruction->op);
+
+            switch (instruction->op) {
+                case OP_CONSTANT:
+                case OP_NIL:
+                case OP_TRUE:
+                case OP_FALSE: {
+                    // the same number can be in the constant table more than once
+                    int arg = instruction->op == OP_CONSTANT ? findConstant(program, loadedConstant(program, instruction)) : 0;
+                    result.number = numberValueKey(keys, &keyCount, instruction->op, arg, -1, -1, i);
+                    result.start = i;
+                    break;
+                }
+                case OP_GET_LOCAL:
+                    if (instruction->isTemp) {
+                        result.number = tempValues[instruction->arg];
+                        result.start = i;
+                    } else if (!analysis.captured[instruction->arg]) {
+                        result.number = numberValueKey(keys, &keyCount, OP_GET_LOCAL, instruction->arg,
+                                                       versions[instruction->arg], -1, i);
+                        result.start = i;
+                    }
+                    break;
+                case OP_SET_LOCAL:
+                    if (instruction->isTemp) {
+                        tempValues[instruction->arg] = stack[depth - 1].number;
+                    } else {
+                        versions[instruction->arg] = ++version;
+                    }
+                    // the value's still there, but deleting the instructions that made it would take this too
+                    stack[depth - 1].start = -1;
+                    continue;
+                case OP_SET_GLOBAL:
+                case OP_SET_UPVALUE:
+                    stack[depth - 1].start = -1;
+                    continue;
+                case OP_FOR_LOOP:
+                    versions[instruction->arg] = ++version;
+                    break;
+                default:
+                    if (operands == 0) break;
+                    StackValue* left = &stack[depth - operands];
+                    StackValue* right = &stack[depth - 1];
+                    if (left->number < 0 || right->number < 0) break;
+                    result.number = numberValueKey(keys, &keyCount, instruction->op, 0, left->number,
+                                                   operands == 2 ? right->number : -1, i);
+                    result.start = left->start >= 0 && right->start >= 0 ? left->start : -1;
+
+                    int first = keys[result.number].root;
+                    if (first != i && result.start >= 0) {
+                        bool saved = program->code[liveInstruction(program, first + 1)].op == OP_SET_LOCAL
+                                     && program->code[liveInstruction(program, first + 1)].isTemp;
+                        // it has to be worth the store, unless that's already there
+                        if (liveCount(program, result.start, i) >= (saved ? 2 : 3)
+                            && reuseValue(passes, first, result.start, i)) {
+                            found = true;
+                            continue;
+                        }
+                    }
+                    break;
+            }
+
+            int pops, pushes;
+            stackEffect(program, instruction, &pops, &pushes);
+            depth -= pops;
+            if (pushes > 0) {
+                versions[depth] = ++version;
+                stack[depth++] = result;
+            }
+        }
+    }
+
+    free(stack);
+    free(keys);
+    free(versions);
+    endAnalysis(&analysis);
+    return found;
+}
+
+// Loop-invariant code motion. A loop here is the code from the target of a backward jump to the jump, plus any later
+// backward jumps into it (which is what a for loop with an increment clause looks like). If the only way into it is
+// through the top, a pure expression in it that only uses locals the loop never stores into works out the same every
+// time round, so it can be worked out once before the loop instead, in a preheader that keeps it in a temporary. The
+// loop might not run at all, so that's only done for expressions that can't be a runtime error, unless they're at the
+// very top of the loop, where they'd be worked out as soon as it was entered anyway.
+
+typedef struct {
+    int start;
+    int end;
+} Loop;
+
+typedef struct {
+    bool invariant;
+    bool number;
+    int start;
+    int root;
+} LoopValue;
+
+typedef struct {
+    int start;
+    int root;
+} Hoist;
+
+static int compareLoops(const void* a, const void* b) {
+    const Loop* left = a;
+    const Loop* right = b;
+    return (left->end - left->start) - (right->end - right->start);
+}
+
+// Innermost loops first, so anything that can go further out gets another chance when the loop around them is done
+static int findLoops(Program* program, Loop* loops) {
+    int count = 0;
+    for (int i = liveInstruction(program, 0); i < program->count; i = liveInstruction(program, i + 1)) {
+        if (!isBackwardJump(program->code[i].op)) continue;
+        Loop loop = {liveInstruction(program, program->code[i].target), i};
+        if (loop.start > loop.end) continue;
+        bool grew = true;
+        while (grew) {
+            grew = false;
+            for (int j = liveInstruction(program, loop.end + 1); j < program->count; j = liveInstruction(program, j + 1)) {
+                if (!isBackwardJump(program->code[j].op)) continue;
+                int target = liveInstruction(program, program->code[j].target);
+                if (target > loop.start && target <= loop.end) {
+                    loop.end = j;
+                    grew = true;
+                }
+            }
+        }
+        loops[count++] = loop;
+    }
+    qsort(loops, count, sizeof(Loop), compareLoops);
+    return count;
+}
+
+static bool isSimpleLoop(Analysis* analysis, Loop* loop) {
+    Program* program = analysis->program;
+    int entryDepth = analysis->depths[loop->start];
+    if (entryDepth < 0) return false;
+    for (int i = liveInstruction(program, 0); i < program->count; i = liveInstruction(program, i + 1)) {
+        Instruction* instruction = &program->code[i];
+        bool inside = i >= loop->start && i <= loop->end;
+        if (!inside && isJump(instruction->op)) {
+            int target = liveInstruction(program, instruction->target);
+            if (target > loop->start && target <= loop->end) return false;
+        }
+        // nothing in the loop can reach under the stack it started with
+        if (inside && analysis->depths[i] >= 0) {
+            int pops, pushes;
+            stackEffect(program, instruction, &pops, &pushes);
+            if (analysis->depths[i] - pops < entryDepth) return false;
+        }
+    }
+    return true;
+}
+
+// Whether a pure instruction on these operands could be a runtime error
+static bool cannotFail(uint8_t op, LoopValue* left, LoopValue* right) {
+    switch (op) {
+        case OP_NOT:
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+            return true;
+        case OP_NEGATE:
+            return right->number;
+        default:
+            return left->number && right->number;
+    }
+}
+
+static int findHoists(Analysis* analysis, Loop* loop, Hoist* hoists, int maxHoists) {
+    Program* program = analysis->program;
+    int width = analysis->width;
+    int entryDepth = analysis->depths[loop->start];
+    int headerBlock = analysis->blocks.blockOf[loop->start];
+    AbstractValue* header = entryOf(analysis, headerBlock);
+    if (!analysis->reached[headerBlock]) return 0;
+
+    bool* written = calloc(width, sizeof(bool));
+    LoopValue* stack = malloc(sizeof(LoopValue) * width);
+    if (written == NULL || stack == NULL) exit(1);
+    for (int i = loop->start; i <= loop->end; i = liveInstruction(program, i + 1)) {
+        Instruction* instruction = &program->code[i];
+        if ((instruction->op == OP_SET_LOCAL && !instruction->isTemp) || instruction->op == OP_FOR_LOOP) {
+            written[instruction->arg] = true;
+        }
+    }
+
+    int count = 0;
+    for (int b = headerBlock; b <= analysis->blocks.blockOf[loop->end] && count < maxHoists; b++) {
+        Block* block = &analysis->blocks.blocks[b];
+        int blockDepth = analysis->depths[block->start];
+        if (blockDepth < 0) continue;
+        int depth = blockDepth;
+        for (int i = 0; i < depth; i++) stack[i].invariant = false;
+        // Nothing's happened yet at the top of the loop, apart from loading values, so hoisting something from there
+        // that fails just fails before the loop instead, on the same line and with nothing else done in between
+        bool prefix = b == headerBlock;
+
+        for (int i = block->start; i < block->end && count < maxHoists; i = liveInstruction(program, i + 1)) {
+            Instruction* instruction = &program->code[i];
+            LoopValue result = {false, false, i, i};
+            int operands = pureOperands(instruction->op);
+            int pops, pushes;
+            stackEffect(program, instruction, &pops, &pushes);
+
+            if (isConstantLoad(instruction)) {
+                result.invariant = true;
+                result.number = IS_NUMBER(loadedConstant(program, instruction));
+            } else if (instruction->op == OP_GET_LOCAL) {
+                int slot = instruction->arg;
+                if (!instruction->isTemp && slot < entryDepth && !written[slot] && !analysis->captured[slot]) {
+                    result.invariant = true;
+                    result.number = isNumberValue(&header[slot]);
+                }
+            } else if (operands > 0) {
+                LoopValue* left = &stack[depth - operands];
+                LoopValue* right = &stack[depth - 1];
+                if (left->invariant && right->invariant && (prefix || cannotFail(instruction->op, left, right))) {
+                    result.invariant = true;
+                    result.number = instruction->op == OP_ADD || instruction->op == OP_SUBTRACT
+                                    || instruction->op == OP_MULTIPLY || instruction->op == OP_DIVIDE
+                                    || instruction->op == OP_NEGATE;
+                    result.start = left->start;
+                }
+            }
+
+            if (!result.invariant) {
+                // whatever invariant values this uses are as big as they're going to get
+                for (int p = depth - pops; p < depth && count < maxHoists; p++) {
+                    if (stack[p].invariant && stack[p].root != stack[p].start) {
+                        hoists[count++] = (Hoist) {stack[p].start, stack[p].root};
+                    }
+                }
+            }
+            depth -= pops;
+            if (pushes > 0) stack[depth++] = result;
+            bool load = isConstantLoad(instruction) || instruction->op == OP_GET_LOCAL || instruction->op == OP_GET_UPVALUE;
+            if (!result.invariant && !load) prefix = false;
+        }
+
+        // and so are any left for the next block
+        for (int p = blockDepth; p < depth && count < maxHoists; p++) {
+            if (stack[p].invariant && stack[p].root != stack[p].start) {
+                hoists[count++] = (Hoist) {stack[p].start, stack[p].root};
+            }
+        }
+    }
+
+    free(written);
+    free(stack);
+    return count;
+}
+
+static int compareHoists(const void* a, const void* b) {
+    return ((const Hoist*) a)->start - ((const Hoist*) b)->start;
+}
+
+static void hoistOutOfLoop(Passes* passes, Loop* loop, Hoist* hoists, int count) {
+    Program* program = passes->program;
+    qsort(hoists, count, sizeof(Hoist), compareHoists);
+
+    int size = 0;
+    for (int h = 0; h < count; h++) size += hoists[h].root - hoists[h].start + 3;
+    Instruction* preheader = malloc(sizeof(Instruction) * size);
+    if (preheader == NULL) exit(1);
+
+    int added = 0;
+    for (int h = 0; h < count; h++) {
+        int temp = passes->tempCount++;
+        int line = program->code[hoists[h].root].line;
+        for (int i = hoists[h].start; i <= hoists[h].root; i++) {
+            if (!program->code[i].deleted) preheader[added++] = program->code[i];
+        }
+        preheader[added] = newInstruction(OP_SET_LOCAL, (uint8_t) temp, line);
+        preheader[added++].isTemp = true;
+        preheader[added++] = newInstruction(OP_POP, 0, line);
+
+        for (int i = hoists[h].start; i < hoists[h].root; i++) program->code[i].deleted = true;
+        Instruction* load = &program->code[hoists[h].root];
+        load->op = OP_GET_LOCAL;
+        load->arg = (uint8_t) temp;
+        load->length = 2;
+        load->isTemp = true;
+    }
+
+    // the loop's own jumps back to the top skip the preheader, and anything else going in goes through it
+    int header = liveInstruction(program, loop->start) + added;
+    insertInstructions(program, loop->start, preheader, added);
+    for (int i = liveInstruction(program, 0); i < program->count; i = liveInstruction(program, i + 1)) {
+        Instruction* instruction = &program->code[i];
+        bool inside = i >= loop->start + added && i <= loop->end + added;
+        if (!inside && isJump(instruction->op) && instruction->target == header) instruction->target = loop->start;
+    }
+    free(preheader);
+}
+
+// Hoists what it can out of one loop, returning whether there was anything
+static bool hoistLoopInvariants(Passes* passes) {
+    Program* program = passes->program;
+    if (passes->tempCount == passes->maxTemps) return false;
+    Analysis analysis;
+    if (!beginAnalysis(program, &analysis)) return false;
+    analyzeValues(&analysis);
+
+    Loop* loops = malloc(sizeof(Loop) * (program->count + 1));
+    Hoist hoists[MAX_TEMPS];
+    if (loops == NULL) exit(1);
+    int loopCount = findLoops(program, loops);
+
+    bool hoisted = false;
+    for (int l = 0; l < loopCount && !hoisted; l++) {
+        if (!isSimpleLoop(&analysis, &loops[l])) continue;
+        int count = findHoists(&analysis, &loops[l], hoists, passes->maxTemps - passes->tempCount);
+        if (count > 0) {
+            hoistOutOfLoop(passes, &loops[l], hoists, count);
+            hoisted = true;
+        }
+    }
+
+    free(loops);
+    endAnalysis(&analysis);
+    return hoisted;
+}
+
+// Gives the temporaries that are still used real slots, straight after the parameters, where a NIL for each is pushed
+// when the function starts. The function's own locals all move up to make room.
+static bool addTemps(Passes* passes) {
+    Program* program = passes->program;
+    if (passes->tempCount == 0) return false;
+
+    int uses[MAX_TEMPS] = {0};
+    for (int i = liveInstruction(program, 0); i < program->count; i = liveInstruction(program, i + 1)) {
+        Instruction* instruction = &program->code[i];
+        if (instruction->op == OP_GET_LOCAL && instruction->isTemp) uses[instruction->arg]++;
+    }
+
+    // anything a temporary kept that got folded into something bigger doesn't need keeping
+    int slots[MAX_TEMPS];
+    int used = 0;
+    for (int t = 0; t < passes->tempCount; t++) slots[t] = uses[t] > 0 ? used++ : -1;
+    for (int i = liveInstruction(program, 0); i < program->count; i = liveInstruction(program, i + 1)) {
+        Instruction* instruction = &program->code[i];
+        if (instruction->op == OP_SET_LOCAL && instruction->isTemp && slots[instruction->arg] < 0) {
+            instruction->deleted = true;
+        }
+    }
+    if (used == 0) return true;
+
+    int base = program->function->arity + 1;
+    for (int i = liveInstruction(program, 0); i < program->count; i = liveInstruction(program, i + 1)) {
+        Instruction* instruction = &program->code[i];
+        switch (instruction->op) {
+            case OP_GET_LOCAL:
+            case OP_SET_LOCAL:
+            case OP_FOR_LOOP:
+                if (instruction->isTemp) {
+                    instruction->arg = (uint8_t) (base + slots[instruction->arg]);
+                    instruction->isTemp = false;
+                } else if (instruction->arg >= base) {
+                    instruction->arg += used;
+                }
+                break;
+            case OP_CLOSURE: {
+                // the captures are still in the original code, which is where encodeProgram gets them from
+                uint8_t* upvalues = program->chunk->code + instruction->offset + 2;
+                for (int j = 0; j < instruction->length - 2; j += 2) {
+                    if (upvalues[j] && upvalues[j + 1] >= base) upvalues[j + 1] += used;
+                }
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    Instruction nils[MAX_TEMPS];
+    int first = liveInstruction(program, 0);
+    for (int t = 0; t < used; t++) nils[t] = newInstruction(OP_NIL, 0, program->code[first].line);
+    insertInstructions(program, 0, nils, used);
+    return true;
+}
+
+// Type inference: an arithmetic instruction or comparison whose operands are proved to be numbers doesn't need to check
+// them, so it becomes the unchecked version. This runs last, once temporaries are real slots, so that what's known
+// about the values they keep counts too.
+static bool specializeNumbers(Program* program) {
+    Analysis analysis;
+    if (!beginAnalysis(program, &analysis)) return false;
+    analyzeValues(&analysis);
+
+    bool changed = false;
+    AbstractValue* state = malloc(sizeof(AbstractValue) * analysis.width);
+    if (state == NULL) exit(1);
+    for (int b = 0; b < analysis.blocks.count; b++) {
+        if (!analysis.reached[b]) continue;
+        Block* block = &analysis.blocks.blocks[b];
+        memcpy(state, entryOf(&analysis, b), sizeof(AbstractValue) * analysis.width);
+        int depth = analysis.depths[block->start];
+        for (int i = block->start; i < block->end; i = liveInstruction(program, i + 1)) {
+            Instruction* instruction = &program->code[i];
+            uint8_t unchecked = uncheckedOp(instruction->op);
+            int operands = pureOperands(instruction->op);
+            if (unchecked != 0 && isNumberValue(&state[depth - operands]) && isNumberValue(&state[depth - 1])) {
+                instruction->op = unchecked;
+                changed = true;
+            }
+            depth = transfer(&analysis, instruction, state, depth);
+        }
+    }
+
+    free(state);
+    endAnalysis(&analysis);
+    return changed;
+}
+
+bool runPasses(Program* program) {
+    Passes passes;
+    passes.program = program;
+    passes.tempCount = 0;
+
+    // temporaries make the frame bigger, and it can't get bigger than a byte can address
+    Analysis analysis;
+    if (!beginAnalysis(program, &analysis)) return false;
+    passes.maxTemps = UINT8_COUNT - analysis.width;
+    if (passes.maxTemps > MAX_TEMPS) passes.maxTemps = MAX_TEMPS;
+    if (passes.maxTemps < 0) passes.maxTemps = 0;
+    endAnalysis(&analysis);
+
+    bool changed = false;
+    for (int round = 0; round < MAX_ROUNDS; round++) {
+        bool propagated = propagateValues(program);
+        bool eliminated = eliminateDeadStores(program);
+        if (!propagated && !eliminated) break;
+        changed = true;
+    }
+    for (int round = 0; round < MAX_ROUNDS && eliminateCommonSubexpression(&passes); round++) changed = true;
+    for (int round = 0; round < MAX_ROUNDS && hoistLoopInvariants(&passes); round++) changed = true;
+    if (addTemps(&passes)) changed = true;
+    if (specializeNumbers(program)) changed = true;
+    return changed;
+}
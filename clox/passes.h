@@ -0,0 +1,17 @@
+//
+// The optimizations that need to see a whole function, which clox -O runs before the peephole pass: constant and copy
+// propagation (with folding of whatever that makes constant), dead store elimination, common subexpression elimination
+// on pure operations, and moving loop-invariant code out of loops. CSE and LICM keep values in temporaries, which are
+// extra local slots added to the function's frame. Last of all, type inference turns arithmetic on values that are
+// proved to be numbers into the opcodes that don't check.
+//
+
+#ifndef CLOX_PASSES_H
+#define CLOX_PASSES_H
+
+#include "ir.h"
+
+// Returns whether it changed anything
+bool runPasses(Program* program);
+
+#endif //CLOX_PASSES_H
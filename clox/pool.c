@@ -0,0 +1,289 @@
+//
+// VMPool: a stack of idle VMs. Releasing a VM only resets it (see resetVM), so the next acquire
+// gets a VM with warmed-up tables and interned strings instead of paying for initVM.
+//
+// ScriptPool: a work-stealing pool of OS threads for running many Lox scripts at once.
+// Submissions are dealt round robin onto the workers' deques. A worker runs its own jobs newest
+// first, and when it runs dry it steals the oldest job from another worker's deque, so a worker
+// that got stuck with a few slow scripts doesn't hold everyone else up.
+// When there's nothing to run or steal anywhere, workers sleep on workAvailable.
+//
+
+#define _GNU_SOURCE // open_memstream
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+static char* copyCString(const char* chars) {
+    size_t length = strlen(chars);
+    char* copy = malloc(length + 1);
+    if (copy == NULL) exit(1);
+    memcpy(copy, chars, length + 1);
+    return copy;
+}
+
+static VM* newVM(FILE* fout, FILE* ferr) {
+    // VMs are too big to comfortably live on a thread's stack
+    VM* vm = malloc(sizeof(VM));
+    if (vm == NULL) exit(1);
+    initVM(vm, fout, ferr);
+    return vm;
+}
+
+static void pushIdleVM(VMPool* pool, VM* vm) {
+    if (pool->capacity < pool->idleCount + 1) {
+        pool->capacity = pool->capacity < 8 ? 8 : pool->capacity * 2;
+        pool->idle = realloc(pool->idle, sizeof(VM*) * pool->capacity);
+        if (pool->idle == NULL) exit(1);
+    }
+    pool->idle[pool->idleCount++] = vm;
+}
+
+void initVMPool(VMPool* pool, int preallocate) {
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->idle = NULL;
+    pool->idleCount = 0;
+    pool->capacity = 0;
+
+    for (int i = 0; i < preallocate; i++) {
+        pushIdleVM(pool, newVM(stdout, stderr));
+    }
+}
+
+// Only frees the idle VMs: any VM still acquired must be released first
+void freeVMPool(VMPool* pool) {
+    for (int i = 0; i < pool->idleCount; i++) {
+        freeVM(pool->idle[i]);
+        free(pool->idle[i]);
+    }
+    free(pool->idle);
+    pool->idle = NULL;
+    pool->idleCount = 0;
+    pool->capacity = 0;
+    pthread_mutex_destroy(&pool->lock);
+}
+
+VM* acquireVM(VMPool* pool, FILE* fout, FILE* ferr) {
+    VM* vm = NULL;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->idleCount > 0) vm = pool->idle[--pool->idleCount];
+    pthread_mutex_unlock(&pool->lock);
+
+    if (vm == NULL) return newVM(fout, ferr);
+
+    vm->fout = fout;
+    vm->ferr = ferr;
+    setOutputSink(vm, fileSink(fout));
+    return vm;
+}
+
+// Resets here rather than in acquireVM, so the previous script's globals don't stay reachable while the VM sits idle
+void releaseVM(VMPool* pool, VM* vm) {
+    resetVM(vm, stdout, stderr);
+
+    pthread_mutex_lock(&pool->lock);
+    pushIdleVM(pool, vm);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void initDeque(JobDeque* deque) {
+    pthread_mutex_init(&deque->lock, NULL);
+    deque->jobs = NULL;
+    deque->capacity = 0;
+    deque->head = 0;
+    deque->tail = 0;
+}
+
+static void freeDeque(JobDeque* deque) {
+    free(deque->jobs);
+    pthread_mutex_destroy(&deque->lock);
+    deque->jobs = NULL;
+}
+
+static void pushBack(JobDeque* deque, ScriptJob* job) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail == deque->capacity) {
+        int count = deque->tail - deque->head;
+        if (deque->head > 0) {
+            // slide the live jobs back to the start before considering growing
+            memmove(deque->jobs, deque->jobs + deque->head, sizeof(ScriptJob*) * count);
+        } else {
+            deque->capacity = deque->capacity < 8 ? 8 : deque->capacity * 2;
+            deque->jobs = realloc(deque->jobs, sizeof(ScriptJob*) * deque->capacity);
+            if (deque->jobs == NULL) exit(1);
+        }
+        deque->head = 0;
+        deque->tail = count;
+    }
+    deque->jobs[deque->tail++] = job;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+static ScriptJob* popBack(JobDeque* deque) {
+    ScriptJob* job = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail > deque->head) job = deque->jobs[--deque->tail];
+    pthread_mutex_unlock(&deque->lock);
+    return job;
+}
+
+static ScriptJob* stealFront(JobDeque* deque) {
+    ScriptJob* job = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail > deque->head) job = deque->jobs[deque->head++];
+    pthread_mutex_unlock(&deque->lock);
+    return job;
+}
+
+// Take a job from our own deque, or failing that, steal one from the next worker that has any
+static ScriptJob* takeJob(Worker* worker) {
+    ScriptPool* pool = worker->pool;
+    ScriptJob* job = popBack(&worker->deque);
+
+    for (int i = 1; job == NULL && i < pool->workerCount; i++) {
+        job = stealFront(&pool->workers[(worker->id + i) % pool->workerCount].deque);
+    }
+
+    if (job != NULL) {
+        pthread_mutex_lock(&pool->lock);
+        pool->queued--;
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return job;
+}
+
+static void runJob(Worker* worker, ScriptJob* job) {
+    FILE* err = open_memstream(&job->err, &job->errSize);
+
+    resetVM(worker->vm, stdout, err);
+    // print writes straight into job->out, no FILE needed. interpret flushes before it returns.
+    setOutputSink(worker->vm, memorySink(&job->out, &job->outSize));
+    InterpretResult result = interpret(worker->vm, job->source);
+
+    fclose(err);
+
+    ScriptPool* pool = worker->pool;
+    pthread_mutex_lock(&pool->lock);
+    job->result = result;
+    job->done = true;
+    pthread_cond_broadcast(&pool->jobDone);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void* runWorker(void* arg) {
+    Worker* worker = (Worker*)arg;
+    ScriptPool* pool = worker->pool;
+
+    for (;;) {
+        ScriptJob* job = takeJob(worker);
+        if (job != NULL) {
+            runJob(worker, job);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        while (pool->queued == 0 && !pool->shuttingDown) {
+            pthread_cond_wait(&pool->workAvailable, &pool->lock);
+        }
+        bool finished = pool->queued == 0 && pool->shuttingDown;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (finished) return NULL;
+    }
+}
+
+void initScriptPool(ScriptPool* pool, int workerCount) {
+    if (workerCount < 1) workerCount = 1;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->workAvailable, NULL);
+    pthread_cond_init(&pool->jobDone, NULL);
+    pool->queued = 0;
+    pool->shuttingDown = false;
+    pool->nextWorker = 0;
+    pool->workerCount = workerCount;
+
+    pool->workers = malloc(sizeof(Worker) * workerCount);
+    if (pool->workers == NULL) exit(1);
+
+    // every deque must exist before any worker starts looking for something to steal
+    for (int i = 0; i < workerCount; i++) {
+        Worker* worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->id = i;
+        initDeque(&worker->deque);
+
+        // a worker keeps its VM for its whole life, resetting it between jobs
+        worker->vm = newVM(stdout, stderr);
+    }
+
+    for (int i = 0; i < workerCount; i++) {
+        pthread_create(&pool->workers[i].thread, NULL, runWorker, &pool->workers[i]);
+    }
+}
+
+// Runs anything still queued, then stops and frees the workers
+void freeScriptPool(ScriptPool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->shuttingDown = true;
+    pthread_cond_broadcast(&pool->workAvailable);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->workerCount; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+
+    for (int i = 0; i < pool->workerCount; i++) {
+        freeDeque(&pool->workers[i].deque);
+        freeVM(pool->workers[i].vm);
+        free(pool->workers[i].vm);
+    }
+    free(pool->workers);
+    pool->workers = NULL;
+    pool->workerCount = 0;
+
+    pthread_cond_destroy(&pool->jobDone);
+    pthread_cond_destroy(&pool->workAvailable);
+    pthread_mutex_destroy(&pool->lock);
+}
+
+ScriptJob* submitScript(ScriptPool* pool, const char* name, const char* source) {
+    ScriptJob* job = malloc(sizeof(ScriptJob));
+    if (job == NULL) exit(1);
+    job->name = copyCString(name);
+    job->source = copyCString(source);
+    job->done = false;
+    job->result = INTERPRET_OK;
+    job->out = NULL;
+    job->outSize = 0;
+    job->err = NULL;
+    job->errSize = 0;
+
+    // push while holding the pool lock, so no worker can count the job as taken before it's counted as queued
+    pthread_mutex_lock(&pool->lock);
+    Worker* worker = &pool->workers[pool->nextWorker];
+    pool->nextWorker = (pool->nextWorker + 1) % pool->workerCount;
+    pushBack(&worker->deque, job);
+    pool->queued++;
+    pthread_cond_signal(&pool->workAvailable);
+    pthread_mutex_unlock(&pool->lock);
+    return job;
+}
+
+void waitForScript(ScriptPool* pool, ScriptJob* job) {
+    pthread_mutex_lock(&pool->lock);
+    while (!job->done) {
+        pthread_cond_wait(&pool->jobDone, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void freeScriptJob(ScriptJob* job) {
+    free(job->name);
+    free(job->source);
+    free(job->out);
+    free(job->err);
+    free(job);
+}
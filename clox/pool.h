@@ -0,0 +1,88 @@
+//
+// Pools for embedding clox:
+// - VMPool hands out ready-to-run VMs and takes them back, so a host doesn't pay for a fresh VM per request
+// - ScriptPool is a pool of OS threads for running many Lox scripts at once, each worker with its own VM
+//
+
+#ifndef CLOX_POOL_H
+#define CLOX_POOL_H
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include "common.h"
+#include "vm.h"
+
+// A thread-safe stack of idle, already initialized VMs
+typedef struct {
+    pthread_mutex_t lock;
+    VM** idle;
+    int idleCount;
+    int capacity;
+} VMPool;
+
+void initVMPool(VMPool* pool, int preallocate);
+void freeVMPool(VMPool* pool);
+
+// Returns an idle VM (or a brand new one if none are idle) that writes to fout and ferr,
+// and has no globals but the natives.
+VM* acquireVM(VMPool* pool, FILE* fout, FILE* ferr);
+void releaseVM(VMPool* pool, VM* vm);
+
+/*
+ * A script submitted to a ScriptPool.
+ * Everything the script prints is captured: its stdout in out, its stderr in err.
+ * The fields below `done` are only safe to read once waitForScript() has returned.
+ */
+typedef struct ScriptJob {
+    char* name; // the path, or whatever the submitter wants to call it, for reporting
+    char* source;
+
+    bool done;
+    InterpretResult result;
+    char* out;
+    size_t outSize;
+    char* err;
+    size_t errSize;
+} ScriptJob;
+
+// A double-ended queue of jobs. The owning worker takes its newest job from the back,
+// other (idle) workers steal the oldest job from the front.
+typedef struct {
+    pthread_mutex_t lock;
+    ScriptJob** jobs;
+    int capacity;
+    int head;
+    int tail;
+} JobDeque;
+
+typedef struct {
+    pthread_t thread;
+    struct ScriptPool* pool;
+    int id;
+    JobDeque deque;
+    VM* vm;
+} Worker;
+
+typedef struct ScriptPool {
+    Worker* workers;
+    int workerCount;
+    int nextWorker; // which worker's deque the next submission goes to (round robin)
+
+    // guards everything below
+    pthread_mutex_t lock;
+    pthread_cond_t workAvailable;
+    pthread_cond_t jobDone;
+    int queued; // submitted, but not yet picked up by a worker
+    bool shuttingDown;
+} ScriptPool;
+
+void initScriptPool(ScriptPool* pool, int workerCount);
+void freeScriptPool(ScriptPool* pool);
+
+// Queues a copy of source to be run. The returned job belongs to the caller, who frees it with freeScriptJob once it's done.
+ScriptJob* submitScript(ScriptPool* pool, const char* name, const char* source);
+void waitForScript(ScriptPool* pool, ScriptJob* job);
+void freeScriptJob(ScriptJob* job);
+
+#endif //CLOX_POOL_H
@@ -0,0 +1,107 @@
+/* Tests that a VM handed back to a VMPool comes out again clean: nothing one script leaves behind (globals,
+ * the stack, open upvalues, where its output went) may show through to the next script run on the same VM.
+ *
+ * Usage: poolTests
+ */
+
+#define _GNU_SOURCE // open_memstream
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+static int failed = 0;
+
+typedef struct {
+    char* bufp;
+    size_t size;
+    FILE* fptr;
+} MemBuf;
+
+static void initMemBuf(MemBuf* memBuf) {
+    memBuf->bufp = NULL;
+    memBuf->size = 0;
+    memBuf->fptr = open_memstream(&memBuf->bufp, &memBuf->size);
+}
+
+static void freeMemBuf(MemBuf* memBuf) {
+    fclose(memBuf->fptr);
+    free(memBuf->bufp);
+}
+
+static void check(const char* test, bool passed, const char* what) {
+    if (passed) return;
+    failed++;
+    printf("[  FAILED ] %s: %s\n", test, what);
+}
+
+// Runs source on a VM from pool, with its output captured, then gives the VM back. Returns the VM it ran on.
+static VM* runPooled(VMPool* pool, const char* source, InterpretResult* result, MemBuf* out, MemBuf* err) {
+    initMemBuf(out);
+    initMemBuf(err);
+    VM* vm = acquireVM(pool, out->fptr, err->fptr);
+    *result = interpret(vm, source);
+    releaseVM(pool, vm);
+    fflush(out->fptr);
+    fflush(err->fptr);
+    return vm;
+}
+
+static void testResetForgetsGlobals(void) {
+    const char* test = "reset forgets globals";
+    int failedBefore = failed;
+    VMPool pool;
+    initVMPool(&pool, 1);
+
+    InterpretResult result;
+    MemBuf out1, err1, out2, err2;
+
+    // leaves globals behind, and dies with a closure's upvalue still open and values on the stack
+    VM* first = runPooled(&pool,
+                          "var leaked = \"first\";\n"
+                          "var keep;\n"
+                          "fun outer() {\n"
+                          "  var local = \"open\";\n"
+                          "  fun inner() { return local; }\n"
+                          "  keep = inner;\n"
+                          "  print leaked;\n"
+                          "  nil();\n"
+                          "}\n"
+                          "outer();\n",
+                          &result, &out1, &err1);
+    check(test, result == INTERPRET_RUNTIME_ERROR, "the first script should fail");
+    check(test, strcmp(out1.bufp, "first\n") == 0, "the first script should have printed \"first\"");
+    check(test, first->stackTop == first->stack, "the stack should be empty after a reset");
+    check(test, first->frameCount == 0, "there should be no call frames after a reset");
+    check(test, first->openUpvalues == NULL, "there should be no open upvalues after a reset");
+    check(test, first->fout == stdout && first->ferr == stderr, "a released VM shouldn't hold on to the script's streams");
+
+    VM* second = runPooled(&pool, "print length([1, 2]);\nprint leaked;\n", &result, &out2, &err2);
+    check(test, second == first, "the pool should have handed out the same VM again");
+    check(test, result == INTERPRET_RUNTIME_ERROR, "reading the first script's global should fail");
+    check(test, strstr(err2.bufp, "Undefined variable 'leaked'.") != NULL, "expected \"Undefined variable 'leaked'.\"");
+    check(test, strcmp(out2.bufp, "2\n") == 0, "natives should survive the reset, and print should go to the new stream");
+    check(test, strcmp(out1.bufp, "first\n") == 0, "nothing more should have gone to the first script's stream");
+
+    MemBuf out3, err3;
+    runPooled(&pool, "print keep;\n", &result, &out3, &err3);
+    check(test, strstr(err3.bufp, "Undefined variable 'keep'.") != NULL, "expected \"Undefined variable 'keep'.\"");
+
+    freeMemBuf(&out1);
+    freeMemBuf(&err1);
+    freeMemBuf(&out2);
+    freeMemBuf(&err2);
+    freeMemBuf(&out3);
+    freeMemBuf(&err3);
+    freeVMPool(&pool);
+    if (failed == failedBefore) printf("[      OK ] %s\n", test);
+}
+
+int main(int argc, const char* argv[]) {
+    testResetForgetsGlobals();
+
+    printf("\n%s\n", failed == 0 ? "All pool tests passed." : "Some pool tests failed.");
+    return failed == 0 ? 0 : 1;
+}
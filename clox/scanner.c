@@ -2,231 +2,425 @@
 // Created by Rita Bennett-Chew on 2/2/24.
 //
 
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "scanner.h"
 #include "common.h"
 
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_X86_SCANNER
+#include <immintrin.h>
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+// The vector loops read whole aligned blocks, which can run past the end of the source (see findLineEndSse2).
+// That's safe, but it's just the kind of read ASan is there to catch.
+#define NO_ASAN __attribute__((no_sanitize_address))
+#endif
+
+// What each char can be part of, so the hot loops test one table entry instead of a chain of ranges
+#define CHAR_ALPHA 1 // letters and '_': can start an identifier
+#define CHAR_DIGIT 2
+#define CHAR_BLANK 4 // ' ', '\t', '\r' and '\n'
+
+static const uint8_t charClass[256] = {
+        ['\t'] = CHAR_BLANK, ['\n'] = CHAR_BLANK, ['\r'] = CHAR_BLANK, [' '] = CHAR_BLANK,
+        ['0'] = CHAR_DIGIT, ['1'] = CHAR_DIGIT, ['2'] = CHAR_DIGIT, ['3'] = CHAR_DIGIT, ['4'] = CHAR_DIGIT,
+        ['5'] = CHAR_DIGIT, ['6'] = CHAR_DIGIT, ['7'] = CHAR_DIGIT, ['8'] = CHAR_DIGIT, ['9'] = CHAR_DIGIT,
+        ['A'] = CHAR_ALPHA, ['B'] = CHAR_ALPHA, ['C'] = CHAR_ALPHA, ['D'] = CHAR_ALPHA, ['E'] = CHAR_ALPHA,
+        ['F'] = CHAR_ALPHA, ['G'] = CHAR_ALPHA, ['H'] = CHAR_ALPHA, ['I'] = CHAR_ALPHA, ['J'] = CHAR_ALPHA,
+        ['K'] = CHAR_ALPHA, ['L'] = CHAR_ALPHA, ['M'] = CHAR_ALPHA, ['N'] = CHAR_ALPHA, ['O'] = CHAR_ALPHA,
+        ['P'] = CHAR_ALPHA, ['Q'] = CHAR_ALPHA, ['R'] = CHAR_ALPHA, ['S'] = CHAR_ALPHA, ['T'] = CHAR_ALPHA,
+        ['U'] = CHAR_ALPHA, ['V'] = CHAR_ALPHA, ['W'] = CHAR_ALPHA, ['X'] = CHAR_ALPHA, ['Y'] = CHAR_ALPHA,
+        ['Z'] = CHAR_ALPHA, ['_'] = CHAR_ALPHA,
+        ['a'] = CHAR_ALPHA, ['b'] = CHAR_ALPHA, ['c'] = CHAR_ALPHA, ['d'] = CHAR_ALPHA, ['e'] = CHAR_ALPHA,
+        ['f'] = CHAR_ALPHA, ['g'] = CHAR_ALPHA, ['h'] = CHAR_ALPHA, ['i'] = CHAR_ALPHA, ['j'] = CHAR_ALPHA,
+        ['k'] = CHAR_ALPHA, ['l'] = CHAR_ALPHA, ['m'] = CHAR_ALPHA, ['n'] = CHAR_ALPHA, ['o'] = CHAR_ALPHA,
+        ['p'] = CHAR_ALPHA, ['q'] = CHAR_ALPHA, ['r'] = CHAR_ALPHA, ['s'] = CHAR_ALPHA, ['t'] = CHAR_ALPHA,
+        ['u'] = CHAR_ALPHA, ['v'] = CHAR_ALPHA, ['w'] = CHAR_ALPHA, ['x'] = CHAR_ALPHA, ['y'] = CHAR_ALPHA,
+        ['z'] = CHAR_ALPHA,
+};
+
+#define CHAR_IS(c, classes) (charClass[(uint8_t)(c)] & (classes))
+
+// Scanning loops that run over whole stretches of source: blank space, comments and string bodies.
+// Like the Float64Array kernels, there's a scalar, an SSE2 and an AVX2 version, picked once (CLOX_SIMD forces one).
+typedef struct ScanKernels {
+    const char* name;
+    // returns the first char at or after p that isn't blank, adding the newlines skipped to *lines
+    const char* (*skipBlank)(const char* p, int* lines);
+    // returns the first '\n' or '\0' at or after p
+    const char* (*findLineEnd)(const char* p);
+    // returns the first '"' or '\0' at or after p, adding the newlines skipped to *lines
+    const char* (*findStringEnd)(const char* p, int* lines);
+} ScanKernels;
+
+static const char* skipBlankScalar(const char* p, int* lines) {
+    while (CHAR_IS(*p, CHAR_BLANK)) {
+        if (*p == '\n') (*lines)++;
+        p++;
+    }
+    return p;
+}
 
-/*
- * A scanner takes source code as input and outputs Tokens
- * Each scanner is made of 2 pointers
- * - start marks the beginning of the current lexeme being scanned
- * - current points to the current char being looked at (which we haven't scanned yet)
- * and the line number for error reporting
- */
-typedef struct {
-    const char*  start;
-    const char* current;
-    int line;
-} Scanner;
+static const char* findLineEndScalar(const char* p) {
+    while (*p != '\n' && *p != '\0') p++;
+    return p;
+}
+
+static const char* findStringEndScalar(const char* p, int* lines) {
+    while (*p != '"' && *p != '\0') {
+        if (*p == '\n') (*lines)++;
+        p++;
+    }
+    return p;
+}
+
+static const ScanKernels scalarScanKernels = {
+        "scalar", skipBlankScalar, findLineEndScalar, findStringEndScalar
+};
 
-Scanner scanner;
+#ifdef HAVE_X86_SCANNER
 
-void initScanner(const char* source) {
-    scanner.start = source;
-    scanner.current = source;
-    scanner.line = 1;
+// Each loop starts at the aligned block holding p, with the bits for the chars before p shifted out of the masks.
+// An aligned block never straddles two pages, so a block holding any of the source (if only its '\0') is all readable.
+
+TARGET_SSE2 NO_ASAN static const char* skipBlankSse2(const char* p, int* lines) {
+    unsigned skip = (uintptr_t)p & 15;
+    const __m128i* block = (const __m128i*)(p - skip);
+    for (;;) {
+        __m128i chars = _mm_load_si128(block);
+        __m128i newline = _mm_cmpeq_epi8(chars, _mm_set1_epi8('\n'));
+        __m128i blank = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(chars, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(chars, _mm_set1_epi8('\t'))),
+                _mm_or_si128(_mm_cmpeq_epi8(chars, _mm_set1_epi8('\r')), newline));
+        unsigned stop = (~(unsigned)_mm_movemask_epi8(blank) & 0xFFFF) >> skip;
+        unsigned newlines = (unsigned)_mm_movemask_epi8(newline) >> skip;
+        if (stop != 0) {
+            unsigned at = (unsigned)__builtin_ctz(stop);
+            *lines += __builtin_popcount(newlines & ((1u << at) - 1));
+            return (const char*)block + skip + at;
+        }
+        *lines += __builtin_popcount(newlines);
+        block++;
+        skip = 0;
+    }
+}
+
+TARGET_SSE2 NO_ASAN static const char* findLineEndSse2(const char* p) {
+    unsigned skip = (uintptr_t)p & 15;
+    const __m128i* block = (const __m128i*)(p - skip);
+    for (;;) {
+        __m128i chars = _mm_load_si128(block);
+        __m128i end = _mm_or_si128(_mm_cmpeq_epi8(chars, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(chars, _mm_setzero_si128()));
+        unsigned stop = (unsigned)_mm_movemask_epi8(end) >> skip;
+        if (stop != 0) return (const char*)block + skip + __builtin_ctz(stop);
+        block++;
+        skip = 0;
+    }
+}
+
+TARGET_SSE2 NO_ASAN static const char* findStringEndSse2(const char* p, int* lines) {
+    unsigned skip = (uintptr_t)p & 15;
+    const __m128i* block = (const __m128i*)(p - skip);
+    for (;;) {
+        __m128i chars = _mm_load_si128(block);
+        __m128i end = _mm_or_si128(_mm_cmpeq_epi8(chars, _mm_set1_epi8('"')), _mm_cmpeq_epi8(chars, _mm_setzero_si128()));
+        unsigned stop = (unsigned)_mm_movemask_epi8(end) >> skip;
+        unsigned newlines = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(chars, _mm_set1_epi8('\n'))) >> skip;
+        if (stop != 0) {
+            unsigned at = (unsigned)__builtin_ctz(stop);
+            *lines += __builtin_popcount(newlines & ((1u << at) - 1));
+            return (const char*)block + skip + at;
+        }
+        *lines += __builtin_popcount(newlines);
+        block++;
+        skip = 0;
+    }
+}
+
+static const ScanKernels sse2ScanKernels = {
+        "sse2", skipBlankSse2, findLineEndSse2, findStringEndSse2
+};
+
+// The same again, 32 chars at a time. The masks are 32 bits, so the "chars before this one" mask is built in 64 bits.
+
+TARGET_AVX2 NO_ASAN static const char* skipBlankAvx2(const char* p, int* lines) {
+    unsigned skip = (uintptr_t)p & 31;
+    const __m256i* block = (const __m256i*)(p - skip);
+    for (;;) {
+        __m256i chars = _mm256_load_si256(block);
+        __m256i newline = _mm256_cmpeq_epi8(chars, _mm256_set1_epi8('\n'));
+        __m256i blank = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(chars, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(chars, _mm256_set1_epi8('\t'))),
+                _mm256_or_si256(_mm256_cmpeq_epi8(chars, _mm256_set1_epi8('\r')), newline));
+        uint32_t stop = ~(uint32_t)_mm256_movemask_epi8(blank) >> skip;
+        uint32_t newlines = (uint32_t)_mm256_movemask_epi8(newline) >> skip;
+        if (stop != 0) {
+            unsigned at = (unsigned)__builtin_ctz(stop);
+            *lines += __builtin_popcount(newlines & (uint32_t)((1ull << at) - 1));
+            return (const char*)block + skip + at;
+        }
+        *lines += __builtin_popcount(newlines);
+        block++;
+        skip = 0;
+    }
+}
+
+TARGET_AVX2 NO_ASAN static const char* findLineEndAvx2(const char* p) {
+    unsigned skip = (uintptr_t)p & 31;
+    const __m256i* block = (const __m256i*)(p - skip);
+    for (;;) {
+        __m256i chars = _mm256_load_si256(block);
+        __m256i end = _mm256_or_si256(_mm256_cmpeq_epi8(chars, _mm256_set1_epi8('\n')),
+                                      _mm256_cmpeq_epi8(chars, _mm256_setzero_si256()));
+        uint32_t stop = (uint32_t)_mm256_movemask_epi8(end) >> skip;
+        if (stop != 0) return (const char*)block + skip + __builtin_ctz(stop);
+        block++;
+        skip = 0;
+    }
+}
+
+TARGET_AVX2 NO_ASAN static const char* findStringEndAvx2(const char* p, int* lines) {
+    unsigned skip = (uintptr_t)p & 31;
+    const __m256i* block = (const __m256i*)(p - skip);
+    for (;;) {
+        __m256i chars = _mm256_load_si256(block);
+        __m256i end = _mm256_or_si256(_mm256_cmpeq_epi8(chars, _mm256_set1_epi8('"')),
+                                      _mm256_cmpeq_epi8(chars, _mm256_setzero_si256()));
+        uint32_t stop = (uint32_t)_mm256_movemask_epi8(end) >> skip;
+        uint32_t newlines = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chars, _mm256_set1_epi8('\n'))) >> skip;
+        if (stop != 0) {
+            unsigned at = (unsigned)__builtin_ctz(stop);
+            *lines += __builtin_popcount(newlines & (uint32_t)((1ull << at) - 1));
+            return (const char*)block + skip + at;
+        }
+        *lines += __builtin_popcount(newlines);
+        block++;
+        skip = 0;
+    }
+}
+
+static const ScanKernels avx2ScanKernels = {
+        "avx2", skipBlankAvx2, findLineEndAvx2, findStringEndAvx2
+};
+
+#endif
+
+static const ScanKernels* chooseScanKernels(void) {
+    const char* forced = getenv("CLOX_SIMD");
+    if (forced != NULL && strcmp(forced, "scalar") == 0) return &scalarScanKernels;
+
+#ifdef HAVE_X86_SCANNER
+    __builtin_cpu_init();
+    bool avx2 = __builtin_cpu_supports("avx2");
+    bool sse2 = __builtin_cpu_supports("sse2");
+    if (forced != NULL && strcmp(forced, "sse2") == 0 && sse2) return &sse2ScanKernels;
+    if (avx2) return &avx2ScanKernels;
+    if (sse2) return &sse2ScanKernels;
+#endif
+
+    return &scalarScanKernels;
+}
+
+static _Atomic(const ScanKernels*) chosenScanKernels = NULL;
+
+static const ScanKernels* scanKernels(void) {
+    const ScanKernels* kernels = atomic_load_explicit(&chosenScanKernels, memory_order_relaxed);
+    if (kernels == NULL) {
+        kernels = chooseScanKernels();
+        atomic_store_explicit(&chosenScanKernels, kernels, memory_order_relaxed);
+    }
+    return kernels;
+}
+
+
+void initScanner(Scanner* scanner, const char* source) {
+    scanner->start = source;
+    scanner->current = source;
+    scanner->line = 1;
+    scanner->kernels = scanKernels();
 }
 
 static bool isAlpha(char c) {
-    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+    return CHAR_IS(c, CHAR_ALPHA);
 }
 
 static bool isDigit(char c) {
-    return c >= '0' && c <= '9';
+    return CHAR_IS(c, CHAR_DIGIT);
 }
 
-static bool isAtEnd() {
-    return *scanner.current == '\0';
+static bool isAtEnd(Scanner* scanner) {
+    return *scanner->current == '\0';
 }
 
-static char advance() {
-    scanner.current++;
-    return scanner.current[-1];
+static char advance(Scanner* scanner) {
+    scanner->current++;
+    return scanner->current[-1];
 }
 
-static char peek() {
-    return *scanner.current;
+static char peek(Scanner* scanner) {
+    return *scanner->current;
 }
 
-static char peekNext() {
-    if (isAtEnd()) return '\0';
-    return scanner.current[1];
+static char peekNext(Scanner* scanner) {
+    if (isAtEnd(scanner)) return '\0';
+    return scanner->current[1];
 }
 
-static bool match(char expected) {
-    if (isAtEnd()) return false;
-    if (*scanner.current != expected) return false;
-    scanner.current++;
+static bool match(Scanner* scanner, char expected) {
+    if (isAtEnd(scanner)) return false;
+    if (*scanner->current != expected) return false;
+    scanner->current++;
     return true;
 }
-static Token makeToken(TokenType type) {
+static Token makeToken(Scanner* scanner, TokenType type) {
     Token token;
     token.type = type;
-    token.start = scanner.start;
-    token.length = (int) (scanner.current - scanner.start);
-    token.line = scanner.line;
+    token.start = scanner->start;
+    token.length = (int) (scanner->current - scanner->start);
+    token.line = scanner->line;
     return token;
 }
 
-static Token errorToken(const char* message) {
+static Token errorToken(Scanner* scanner, const char* message) {
     Token token;
     token.type = TOKEN_ERROR;
     token.start = message;
     token.length = (int) strlen(message);
-    token.line = scanner.line;
+    token.line = scanner->line;
     return token;
 }
 
-static void skipWhitespace() {
+static void skipWhitespace(Scanner* scanner) {
     for (;;) {
-        char c = peek();
-        switch (c) {
-            case ' ':
-            case '\r':
-            case '\t':
-                advance();
-                break;
-            case '\n':
-                scanner.line++;
-                advance();
-                break;
-            case '/':
-                if (peekNext() == '/') {
-                    // A comment goes until the end of the line.
-                    while (peek() != '\n' && !isAtEnd()) advance();
-                } else {
-                    return;
-                }
-                break;
-            default:
-                return;
+        char c = peek(scanner);
+        if (c == ' ' && !CHAR_IS(scanner->current[1], CHAR_BLANK)) {
+            // a lone space between tokens is by far the most common case, and not worth a trip through skipBlank
+            advance(scanner);
+        } else if (CHAR_IS(c, CHAR_BLANK)) {
+            scanner->current = scanner->kernels->skipBlank(scanner->current, &scanner->line);
+        } else if (c == '/' && peekNext(scanner) == '/') {
+            // A comment goes until the end of the line.
+            scanner->current = scanner->kernels->findLineEnd(scanner->current + 2);
+        } else {
+            return;
         }
     }
 }
 
-static TokenType checkKeyword(int start, int length, const char* rest, TokenType type) {
-    // to return a keyword token, the lexeme must be exactly as long as the keyword
-    // && the remaining characters must match exactly
-    if (scanner.current - scanner.start == start + length && memcmp(scanner.start + start, rest, length) == 0) {
-        return type;
-    }
-
-    return TOKEN_IDENTIFIER;
-}
+// Keywords are looked up with a perfect hash of an identifier's first two chars and its length: no two keywords
+// land in the same slot, so an identifier only ever needs comparing against the one keyword in its slot, if any
+#define KEYWORD_HASH(first, second, length) (((first) * 4 + (second) * 3 + (length)) & 31)
 
-// returns either a keyword token or an identifier token type.
-// Do the minimum amount of work to determine which.
-// bail as soon as we can tell it'll be an ident and not a keyword
-// returns the correct keyword (or an ident) using a trie structure
-static TokenType identifierType() {
-    switch (scanner.start[0]) {
-        // unbranching paths
-        // (ie, if we see an 'a', the only keyword it could be is 'and'.
-        // If it's not 'and', it's an identifier)
-        case 'a': return checkKeyword(1, 2, "nd", TOKEN_AND);
-        case 'c': return checkKeyword(1, 4, "lass", TOKEN_CLASS);
-        case 'e': return checkKeyword(1, 3, "lse", TOKEN_ELSE);
-        case 'i': return checkKeyword(1, 1, "f", TOKEN_IF);
-        case 'n': return checkKeyword(1, 2, "il", TOKEN_NIL);
-        case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
-        case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-        case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-        case 's': return checkKeyword(1, 4, "uper", TOKEN_SUPER);
-        case 'v': return checkKeyword(1, 2, "ar", TOKEN_VAR);
-        case 'w': return checkKeyword(1, 4, "hile", TOKEN_WHILE);
-
-        // multi-char paths
-        case 'f':
-            if (scanner.current - scanner.start > 1) { // is there a second letter?
-                switch (scanner.start[1]) {
-                    case 'a': return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-                    case 'o': return checkKeyword(2, 1, "r", TOKEN_FOR);
-                    case 'u': return checkKeyword(2, 1, "n", TOKEN_FUN);
-                }
-            }
-            break;
-        case 't':
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
-                    case 'h': return checkKeyword(2, 2, "is", TOKEN_THIS);
-                    case 'r': return checkKeyword(2, 2, "ue", TOKEN_TRUE);
-                }
-            }
-            break;
-    }
+typedef struct {
+    const char* chars;
+    int length;
+    TokenType type;
+} Keyword;
+
+// the first two chars are spelled out because a string literal's chars don't count as constants in an initializer
+#define KEYWORD(first, second, chars, type) \
+        [KEYWORD_HASH(first, second, sizeof(chars) - 1)] = {chars, sizeof(chars) - 1, type}
+
+static const Keyword keywords[32] = {
+        KEYWORD('a', 'n', "and", TOKEN_AND),
+        KEYWORD('c', 'l', "class", TOKEN_CLASS),
+        KEYWORD('e', 'l', "else", TOKEN_ELSE),
+        KEYWORD('f', 'a', "false", TOKEN_FALSE),
+        KEYWORD('f', 'o', "for", TOKEN_FOR),
+        KEYWORD('f', 'u', "fun", TOKEN_FUN),
+        KEYWORD('i', 'f', "if", TOKEN_IF),
+        KEYWORD('n', 'i', "nil", TOKEN_NIL),
+        KEYWORD('o', 'r', "or", TOKEN_OR),
+        KEYWORD('p', 'r', "print", TOKEN_PRINT),
+        KEYWORD('r', 'e', "return", TOKEN_RETURN),
+        KEYWORD('s', 'u', "super", TOKEN_SUPER),
+        KEYWORD('t', 'h', "this", TOKEN_THIS),
+        KEYWORD('t', 'r', "true", TOKEN_TRUE),
+        KEYWORD('v', 'a', "var", TOKEN_VAR),
+        KEYWORD('w', 'h', "while", TOKEN_WHILE),
+};
+
+// returns either a keyword token or an identifier token type
+static TokenType identifierType(Scanner* scanner) {
+    int length = (int)(scanner->current - scanner->start);
+    // keywords are 2 to 6 chars long, and empty slots have a length of 0
+    if (length < 2 || length > 6) return TOKEN_IDENTIFIER;
+
+    const Keyword* keyword = &keywords[KEYWORD_HASH((uint8_t)scanner->start[0], (uint8_t)scanner->start[1], length)];
+    if (keyword->length == length && memcmp(scanner->start, keyword->chars, length) == 0) return keyword->type;
     return TOKEN_IDENTIFIER;
 }
 
 // after the first letter, allow digits too
-static Token identifier() {
-    while (isAlpha(peek()) || isDigit(peek())) advance();
-    return makeToken(identifierType());
+static Token identifier(Scanner* scanner) {
+    while (CHAR_IS(peek(scanner), CHAR_ALPHA | CHAR_DIGIT)) advance(scanner);
+    return makeToken(scanner, identifierType(scanner));
 }
 
-static Token number() {
-    while (isDigit(peek())) advance();
+static Token number(Scanner* scanner) {
+    while (isDigit(peek(scanner))) advance(scanner);
 
     // Look for a fractional part.
-    if (peek() == '.' && isDigit(peekNext())) {
+    if (peek(scanner) == '.' && isDigit(peekNext(scanner))) {
         // Consume the '.'.
-        advance();
+        advance(scanner);
 
-        while (isDigit(peek())) advance();
+        while (isDigit(peek(scanner))) advance(scanner);
     }
 
-    return makeToken(TOKEN_NUMBER);
+    return makeToken(scanner, TOKEN_NUMBER);
 }
 
-static Token string() {
-    while (peek() != '"' && !isAtEnd()) {
-        if (peek() == '\n') scanner.line++;
-        advance();
-    }
+static Token string(Scanner* scanner) {
+    scanner->current = scanner->kernels->findStringEnd(scanner->current, &scanner->line);
 
-    if (isAtEnd()) return errorToken("Unterminated string.");
+    if (isAtEnd(scanner)) return errorToken(scanner, "Unterminated string.");
 
     // The closing quote
-    advance();
-    return makeToken(TOKEN_STRING);
+    advance(scanner);
+    return makeToken(scanner, TOKEN_STRING);
 }
 
-Token scanToken() {
-    skipWhitespace();
-    scanner.start = scanner.current;
+Token scanToken(Scanner* scanner) {
+    skipWhitespace(scanner);
+    scanner->start = scanner->current;
 
-    if (isAtEnd()) return makeToken(TOKEN_EOF);
+    if (isAtEnd(scanner)) return makeToken(scanner, TOKEN_EOF);
 
-    char c = advance();
+    char c = advance(scanner);
 
-    if (isAlpha(c)) return identifier();
-    if (isDigit(c)) return number();
+    if (isAlpha(c)) return identifier(scanner);
+    if (isDigit(c)) return number(scanner);
 
     switch(c) {
-        case '(': return makeToken(TOKEN_LEFT_PAREN);
-        case ')': return makeToken(TOKEN_RIGHT_PAREN);
-        case '{': return makeToken(TOKEN_LEFT_BRACE);
-        case '}': return makeToken(TOKEN_RIGHT_BRACE);
-        case ';': return makeToken(TOKEN_SEMICOLON);
-        case ',': return makeToken(TOKEN_COMMA);
-        case '.': return makeToken(TOKEN_DOT);
-        case '-': return makeToken(TOKEN_MINUS);
-        case '+': return makeToken(TOKEN_PLUS);
-        case '/': return makeToken(TOKEN_SLASH);
-        case '*': return makeToken(TOKEN_STAR);
+        case '(': return makeToken(scanner, TOKEN_LEFT_PAREN);
+        case ')': return makeToken(scanner, TOKEN_RIGHT_PAREN);
+        case '[': return makeToken(scanner, TOKEN_LEFT_BRACKET);
+        case ']': return makeToken(scanner, TOKEN_RIGHT_BRACKET);
+        case '{': return makeToken(scanner, TOKEN_LEFT_BRACE);
+        case '}': return makeToken(scanner, TOKEN_RIGHT_BRACE);
+        case ';': return makeToken(scanner, TOKEN_SEMICOLON);
+        case ',': return makeToken(scanner, TOKEN_COMMA);
+        case '.': return makeToken(scanner, TOKEN_DOT);
+        case '-': return makeToken(scanner, TOKEN_MINUS);
+        case '+': return makeToken(scanner, TOKEN_PLUS);
+        case '/': return makeToken(scanner, TOKEN_SLASH);
+        case '*': return makeToken(scanner, TOKEN_STAR);
         case '!':
-            return makeToken(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+            return makeToken(scanner, match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
         case '=':
-            return makeToken(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+            return makeToken(scanner, match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
         case '<':
-            return makeToken(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+            return makeToken(scanner, match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
         case '>':
-            return makeToken(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
-        case '"': return string();
+            return makeToken(scanner, match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+        case '"': return string(scanner);
 
     }
 
-    return errorToken("Unexpected character.");
+    return errorToken(scanner, "Unexpected character.");
 }
\ No newline at end of file
@@ -15,6 +15,7 @@ typedef enum {
   // Single-character tokens.
   TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
   TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
+  TOKEN_LEFT_BRACKET, TOKEN_RIGHT_BRACKET,
   TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
   TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR,
 
@@ -53,7 +54,23 @@ typedef struct {
     int line;
 } Token;
 
-void initScanner(const char* source);
-Token scanToken();
+/*
+ * A scanner takes source code as input and outputs Tokens
+ * Each scanner is made of 2 pointers
+ * - start marks the beginning of the current lexeme being scanned
+ * - current points to the current char being looked at (which we haven't scanned yet)
+ * and the line number for error reporting
+ * All of a scanner's state lives here, so each compilation can own its own scanner (no globals)
+ * kernels are the (possibly vectorized) loops it skips blank space, comments and string bodies with
+ */
+typedef struct {
+    const char* start;
+    const char* current;
+    int line;
+    const struct ScanKernels* kernels;
+} Scanner;
+
+void initScanner(Scanner* scanner, const char* source);
+Token scanToken(Scanner* scanner);
 
 #endif //CLOX_SCANNER_H
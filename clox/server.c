@@ -0,0 +1,216 @@
+//
+// Each worker thread owns a VM for its whole life and loops: accept a connection, run the requested
+// script in its VM, reply, resetVM. Scripts run by path are compiled once per worker and then served from
+// the VM's script cache, keyed by their source, so an edited script gets recompiled however soon after the last run.
+//
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "object.h"
+#include "server.h"
+#include "vm.h"
+
+typedef struct {
+    pthread_t thread;
+    int listenFd;
+    VM* vm;
+} ServerWorker;
+
+// Reads exactly length bytes, unless the peer hangs up first
+static bool readFully(int fd, char* buffer, size_t length) {
+    while (length > 0) {
+        ssize_t got = read(fd, buffer, length);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return false;
+        buffer += got;
+        length -= got;
+    }
+    return true;
+}
+
+// Receives the request header, along with the client's stdout and stderr fds
+static bool receiveHeader(int clientFd, char header[SERVE_HEADER_SIZE], int fds[2]) {
+    struct iovec iov = {header, SERVE_HEADER_SIZE};
+    union {
+        char buffer[CMSG_SPACE(sizeof(int) * 2)];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+
+    ssize_t got = recvmsg(clientFd, &message, 0);
+    if (got <= 0) return false;
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+        || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * 2)) {
+        return false;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * 2);
+
+    // the rest of the header may arrive separately from the ancillary data
+    return readFully(clientFd, header + got, SERVE_HEADER_SIZE - got);
+}
+
+// Like main.c's loadSource (minus the mapping), but a missing file is the client's problem, not a reason for the server to exit
+static char* readScript(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+
+    fseek(file, 0L, SEEK_END);
+    size_t fileSize = ftell(file);
+    rewind(file);
+
+    char* buffer = (char*)malloc(fileSize + 1);
+    if (buffer == NULL || fread(buffer, sizeof(char), fileSize, file) < fileSize) {
+        free(buffer);
+        fclose(file);
+        return NULL;
+    }
+    buffer[fileSize] = '\0';
+
+    fclose(file);
+    return buffer;
+}
+
+static int exitStatus(InterpretResult result) {
+    switch (result) {
+        case INTERPRET_OK: return 0;
+        case INTERPRET_COMPILE_ERROR: return 65;
+        case INTERPRET_RUNTIME_ERROR: return 70;
+    }
+    return 70; // unreachable
+}
+
+// Runs the script at path, using the compiled function cached from an earlier request if the file hasn't changed since.
+// The source itself is the key: reading the file is cheap next to compiling it, and a modification time can't tell
+// apart two same-size edits that land within its resolution.
+static int runPath(VM* vm, const char* path) {
+    struct stat info;
+    if (stat(path, &info) != 0) {
+        fprintf(vm->ferr, "Could not open file \"%s\".\n", path);
+        return 74;
+    }
+
+    char* source = readScript(path);
+    if (source == NULL) {
+        fprintf(vm->ferr, "Could not read file \"%s\".\n", path);
+        return 74;
+    }
+    ObjFunction* function = cachedScript(vm, source);
+    if (function == NULL) function = compileAndCache(vm, source, source);
+    free(source);
+    if (function == NULL) return exitStatus(INTERPRET_COMPILE_ERROR);
+
+    return exitStatus(interpretFunction(vm, function));
+}
+
+static void handleClient(VM* vm, int clientFd) {
+    char header[SERVE_HEADER_SIZE];
+    int fds[2];
+    if (!receiveHeader(clientFd, header, fds)) return;
+
+    FILE* out = fdopen(fds[0], "w");
+    FILE* err = fdopen(fds[1], "w");
+    if (out == NULL || err == NULL) {
+        if (out != NULL) fclose(out); else close(fds[0]);
+        if (err != NULL) fclose(err); else close(fds[1]);
+        return;
+    }
+    // stream output to the client as the script prints it
+    setvbuf(out, NULL, _IOLBF, 0);
+
+    uint32_t length = ((uint32_t)(uint8_t)header[1] << 24) | ((uint32_t)(uint8_t)header[2] << 16)
+                      | ((uint32_t)(uint8_t)header[3] << 8) | (uint32_t)(uint8_t)header[4];
+    char* payload = malloc((size_t)length + 1);
+    if (payload != NULL && readFully(clientFd, payload, length)) {
+        payload[length] = '\0';
+        resetVM(vm, out, err);
+        setOutputSink(vm, fdSink(fds[0]));
+
+        unsigned char status;
+        if (header[0] == SERVE_PATH) {
+            status = (unsigned char)runPath(vm, payload);
+        } else {
+            status = (unsigned char)exitStatus(interpret(vm, payload));
+        }
+
+        // don't let the VM hold on to the client's streams after they're closed
+        resetVM(vm, stdout, stderr);
+        fflush(out);
+        fflush(err);
+        write(clientFd, &status, 1);
+    }
+
+    free(payload);
+    fclose(out);
+    fclose(err);
+}
+
+static void* runServerWorker(void* arg) {
+    ServerWorker* worker = (ServerWorker*)arg;
+    for (;;) {
+        int clientFd = accept(worker->listenFd, NULL, NULL);
+        if (clientFd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("accept");
+            return NULL;
+        }
+        handleClient(worker->vm, clientFd);
+        close(clientFd);
+    }
+}
+
+// Listens on socketPath and serves clients until killed. All workers accept on the same socket.
+void serve(const char* socketPath, int workerCount) {
+    if (workerCount < 1) workerCount = 1;
+
+    // a client hanging up mid-script must not take the server down with it
+    signal(SIGPIPE, SIG_IGN);
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path \"%s\" is too long.\n", socketPath);
+        exit(64);
+    }
+    strcpy(address.sun_path, socketPath);
+
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socketPath);
+    if (listenFd < 0 || bind(listenFd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listenFd, 64) != 0) {
+        fprintf(stderr, "Could not listen on \"%s\": %s\n", socketPath, strerror(errno));
+        exit(74);
+    }
+
+    ServerWorker* workers = malloc(sizeof(ServerWorker) * workerCount);
+    if (workers == NULL) exit(1);
+    for (int i = 0; i < workerCount; i++) {
+        workers[i].listenFd = listenFd;
+        workers[i].vm = malloc(sizeof(VM));
+        if (workers[i].vm == NULL) exit(1);
+        initVM(workers[i].vm, stdout, stderr);
+        // stream output to clients a line at a time
+        configureOutput(workers[i].vm, OUTPUT_BUFFER_SIZE, FLUSH_PER_LINE);
+        pthread_create(&workers[i].thread, NULL, runServerWorker, &workers[i]);
+    }
+
+    for (int i = 0; i < workerCount; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+}
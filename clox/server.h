@@ -0,0 +1,26 @@
+//
+// A long-running clox that runs scripts on behalf of clients connecting over a UNIX socket,
+// so they don't each pay for starting a process, setting up a VM and compiling.
+//
+
+#ifndef CLOX_SERVER_H
+#define CLOX_SERVER_H
+
+#include <stdint.h>
+
+/*
+ * The protocol, one script per connection:
+ * 1. The client sends a SERVE_HEADER_SIZE byte header: the request kind (SERVE_PATH or SERVE_SOURCE),
+ *    then the payload's length as a big-endian uint32.
+ *    Along with the header, as SCM_RIGHTS ancillary data, it passes the two fds the script's stdout and stderr go to,
+ *    so output streams straight to wherever the client's own stdout and stderr point.
+ * 2. The client sends the payload: either the absolute path of a script, or a script's source.
+ * 3. The server runs the script, then replies with a single byte: the status `clox path` would have exited with.
+ */
+#define SERVE_PATH 'P'
+#define SERVE_SOURCE 'S'
+#define SERVE_HEADER_SIZE 5
+
+void serve(const char* socketPath, int workerCount);
+
+#endif //CLOX_SERVER_H
@@ -4,95 +4,197 @@
 
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
-#define TABLE_MAX_LOAD 0.75
+// Full entries can take up to 7/8 of the slots: probing whole groups at a time copes well with full tables
+#define TABLE_MAX_LOAD_NUMERATOR 7
+#define TABLE_MAX_LOAD_DENOMINATOR 8
+
+#define GROUP_WIDTH 16
+
+// A full slot's control byte is the top 7 bits of its key's hash (so 0-127), everything else has the high bit set
+#define CONTROL_EMPTY    ((uint8_t)0x80)
+#define CONTROL_DELETED  ((uint8_t)0xFE)
+// pads out the control bytes of tables smaller than a group. Matches nothing, not even an empty slot
+#define CONTROL_SENTINEL ((uint8_t)0xFF)
+
+#define IS_FULL(control) ((control) < 0x80)
+#define HASH_BITS(hash) ((uint8_t)((hash) >> 25))
+
+// Tables smaller than a group still get a whole group's worth of control bytes, so a group can always be loaded in one go
+static int controlSize(int capacity) {
+    return capacity < GROUP_WIDTH ? GROUP_WIDTH : capacity;
+}
+
+static size_t allocationSize(int capacity) {
+    return sizeof(Entry) * capacity + controlSize(capacity);
+}
+
+static uint32_t groupMask(int capacity) {
+    return (uint32_t)(controlSize(capacity) / GROUP_WIDTH - 1);
+}
+
+// A bitmask of which of the GROUP_WIDTH control bytes starting at group equal byte
+static inline uint32_t matchByte(const uint8_t* group, uint8_t byte) {
+#ifdef __SSE2__
+    __m128i controls = _mm_loadu_si128((const __m128i*)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(controls, _mm_set1_epi8((char)byte)));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < GROUP_WIDTH; i++) {
+        if (group[i] == byte) mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+static inline uint32_t matchAvailable(const uint8_t* group) {
+    return matchByte(group, CONTROL_EMPTY) | matchByte(group, CONTROL_DELETED);
+}
 
 void initTable(Table* table) {
     table->count = 0;
+    table->tombstones = 0;
     table->capacity = 0;
     table->entries = NULL;
+    table->control = NULL;
 }
 
 void freeTable(VM* vm, Table* table) {
-    FREE_ARRAY(vm, Entry, table->entries, table->capacity);
+    if (table->entries != NULL) {
+        reallocate(vm, table->entries, allocationSize(table->capacity), 0);
+    }
     initTable(table);
 }
 
-// Given a key and an array of buckets, which bucket does the entry belong to?
-// Use modulo capacity to divide entries into buckets (index)
-// Also use open addressing - find an entry for lookup (or empty slot for inserting) that either corresponds to:
-// - the key's hash
-// - or, if that's full, then the next slot where we don't already have an entry
-// Return an Entry (comprised of key & value)
-// Returns entry with key = NULL if no entry found with given key. This'll either be a totally empty entry or the first tombstone (key=NULL, value=TrueValue) encountered
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
-    uint32_t index = key->hash & (capacity - 1);
-    Entry* tombstone = NULL;
-    for (;;) {
-        Entry* entry = &entries[index];
-
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) {
-                // empty entry (key and value are empty)
-                // if we've encountered any tombstones, return the first one (for reuse)
-                return tombstone != NULL ? tombstone : entry;
-            } else {
-                // We found a tombstone (key is NULL but value exists)
-                // save the first tombstone encountered
-                if (tombstone == NULL) tombstone = entry;
-            }
-        } else if (entry->key == key) {
-            // We found the key.
-            return entry;
+// Which slot holds key, or -1 if it's not in the table.
+// Probes a group at a time: every slot in the group whose control byte matches the hash bits is a candidate,
+// and since a key is always put in the first group on its probe sequence with room for it,
+// reaching a group with an empty slot means it's not in the table.
+// Groups are probed in triangular steps (+1, +2, +3...), which visits every group when there's a power of 2 of them.
+static int findSlot(Table* table, ObjString* key) {
+    uint32_t mask = groupMask(table->capacity);
+    uint32_t group = key->hash & mask;
+    uint8_t bits = HASH_BITS(key->hash);
+
+    for (uint32_t step = 1;; step++) {
+        const uint8_t* controls = table->control + group * GROUP_WIDTH;
+        for (uint32_t match = matchByte(controls, bits); match != 0; match &= match - 1) {
+            int slot = (int)(group * GROUP_WIDTH) + __builtin_ctz(match);
+            if (table->entries[slot].key == key) return slot;
         }
+        if (matchByte(controls, CONTROL_EMPTY) != 0) return -1;
+
+        group = (group + step) & mask;
+    }
+}
 
-        index = (index + 1) & (capacity - 1);
+// The first empty or deleted slot on hash's probe sequence. The table must have room.
+static int findAvailableSlot(uint8_t* control, int capacity, uint32_t hash) {
+    uint32_t mask = groupMask(capacity);
+    uint32_t group = hash & mask;
+
+    for (uint32_t step = 1;; step++) {
+        uint32_t available = matchAvailable(control + group * GROUP_WIDTH);
+        if (available != 0) return (int)(group * GROUP_WIDTH) + __builtin_ctz(available);
+
+        group = (group + step) & mask;
     }
 }
 
 bool tableGet(Table* table, ObjString* key, Value* value) {
     if (table->count == 0) return false;
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    int slot = findSlot(table, key);
+    if (slot < 0) return false;
 
-    *value = entry->value;
+    *value = table->entries[slot].value;
     return true;
 }
 
-static void adjustCapacity(VM* vm, Table* table, int capacity) {
-    Entry* entries = ALLOCATE(vm, Entry, capacity);
-    for (int i = 0; i < capacity; i++) {
-        entries[i].key = NULL;
-        entries[i].value = NIL_VAL;
+// Moves every live entry into the new (uninitialized) block of entries and control bytes, and installs it in the table.
+// All the tombstones get left behind. Returns the old block, for the caller to free.
+static Entry* moveEntries(Table* table, Entry* entries, int capacity) {
+    uint8_t* control = (uint8_t*)(entries + capacity);
+    memset(control, CONTROL_EMPTY, capacity);
+    memset(control + capacity, CONTROL_SENTINEL, controlSize(capacity) - capacity);
+
+    for (int i = 0; i < table->capacity; i++) {
+        if (!IS_FULL(table->control[i])) continue;
+
+        Entry* entry = &table->entries[i];
+        int slot = findAvailableSlot(control, capacity, entry->hash);
+        control[slot] = table->control[i];
+        entries[slot] = *entry;
     }
 
-    // we're resizing to a new capacity
-    // we'll soon re-insert all entries to a new array
-    // don't copy over tombstones
-    table->count = 0;
+    Entry* oldEntries = table->entries;
+    table->entries = entries;
+    table->control = control;
+    table->capacity = capacity;
+    table->tombstones = 0;
+    return oldEntries;
+}
+
+static void adjustCapacity(VM* vm, Table* table, int capacity) {
+    Entry* entries = (Entry*)reallocate(vm, NULL, 0, allocationSize(capacity));
+
+    // the allocation can run the GC, which can change the table, so only look at it now
+    int oldCapacity = table->capacity;
+    Entry* oldEntries = moveEntries(table, entries, capacity);
+
+    // Release memory for old array
+    if (oldEntries != NULL) reallocate(vm, oldEntries, allocationSize(oldCapacity), 0);
+}
+
+// Clears out the tombstones without allocating, by putting every live entry back in the first group with room
+// on its probe sequence. Live entries are first marked as deleted, meaning "still to be placed", and tombstones
+// as empty. Then each entry to be placed either stays where it is (it's already in the right group),
+// moves to an empty slot, or swaps with another entry that's still to be placed, which is then placed next.
+// A slot that's been placed is never freed up again, so earlier placements stay findable.
+static void rehashInPlace(Table* table) {
+    for (int i = 0; i < table->capacity; i++) {
+        table->control[i] = IS_FULL(table->control[i]) ? CONTROL_DELETED : CONTROL_EMPTY;
+    }
 
-    // To choose which bucket for each entry, we take its hash key % array size
-    // So when size changes, we'll have to re-insert every entry into the new empty array
     for (int i = 0; i < table->capacity; i++) {
+        if (table->control[i] != CONTROL_DELETED) continue;
+
         Entry* entry = &table->entries[i];
-        if (entry->key == NULL) continue;
+        uint32_t hash = entry->hash;
+        int target = findAvailableSlot(table->control, table->capacity, hash);
 
-        Entry* dest = findEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++;
+        if (target / GROUP_WIDTH == i / GROUP_WIDTH) {
+            table->control[i] = HASH_BITS(hash);
+        } else if (table->control[target] == CONTROL_EMPTY) {
+            table->entries[target] = *entry;
+            table->control[target] = HASH_BITS(hash);
+            entry->key = NULL;
+            table->control[i] = CONTROL_EMPTY;
+        } else {
+            Entry waiting = table->entries[target];
+            table->entries[target] = *entry;
+            table->control[target] = HASH_BITS(hash);
+            *entry = waiting;
+            i--; // place the entry we swapped in
+        }
     }
 
-    // Release memory for old array
-    FREE_ARRAY(vm, Entry, table->entries, table->capacity);
-    table->entries = entries;
-    table->capacity = capacity;
+    table->tombstones = 0;
+}
+
+// Empties the table but keeps its entries array, so refilling it to a similar size won't need to grow it again
+void tableClear(Table* table) {
+    if (table->capacity > 0) memset(table->control, CONTROL_EMPTY, table->capacity);
+    table->count = 0;
+    table->tombstones = 0;
 }
 
 // Sets a value to a key in the table
@@ -100,35 +202,59 @@ static void adjustCapacity(VM* vm, Table* table, int capacity) {
 // meaning it'll be either a textually new string,
 // or a pointer to a textually equivalent string.
 bool tableSet(VM* vm, Table* table, ObjString* key, Value value) {
-    // allocate a big-enough array
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-        int capacity = GROW_CAPACITY(table->capacity);
-        adjustCapacity(vm, table, capacity);
+    if (table->count > 0) {
+        int slot = findSlot(table, key);
+        if (slot >= 0) {
+            table->entries[slot].value = value;
+            return false;
+        }
     }
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    bool isNewKey = entry->key == NULL;
+    // tombstones count towards the load, since they make probes just as long as live entries do
+    if ((table->count + table->tombstones + 1) * TABLE_MAX_LOAD_DENOMINATOR
+        > table->capacity * TABLE_MAX_LOAD_NUMERATOR) {
+        if (table->count > 0 && table->count <= table->capacity / 2) {
+            // it's mostly tombstones that filled it up, so there's plenty of room once they're gone
+            rehashInPlace(table);
+        } else {
+            adjustCapacity(vm, table, GROW_CAPACITY(table->capacity));
+        }
+    }
 
-    // increment only if it's a totally new entry - no existing key, not a tombstone
-    if (isNewKey && IS_NIL(entry->value)) table->count++;
+    int slot = findAvailableSlot(table->control, table->capacity, key->hash);
+    if (table->control[slot] == CONTROL_DELETED) table->tombstones--;
+    table->control[slot] = HASH_BITS(key->hash);
+    table->entries[slot].key = key;
+    table->entries[slot].hash = key->hash;
+    table->entries[slot].length = key->length;
+    table->entries[slot].value = value;
+    table->count++;
+    return true;
+}
 
-    entry->key = key;
-    entry->value = value;
-    return isNewKey;
+static void deleteSlot(Table* table, int slot) {
+    // If the slot's group still has an empty slot, no probe has ever gone past this group,
+    // so the slot can go straight back to empty instead of needing a tombstone
+    int group = slot / GROUP_WIDTH * GROUP_WIDTH;
+    if (matchByte(table->control + group, CONTROL_EMPTY) != 0) {
+        table->control[slot] = CONTROL_EMPTY;
+    } else {
+        table->control[slot] = CONTROL_DELETED;
+        table->tombstones++;
+    }
+    table->entries[slot].key = NULL;
+    table->count--;
 }
 
-// Replace the entry with key 'key', if found, with tombstone (key=NULL, value=TrueValue)
-// return true if an entry was found and replaced with a tombstone.
+// Removes the entry with key 'key', if found,
+// return true if an entry was found and removed.
 bool tableDelete(Table* table, ObjString* key) {
     if (table->count == 0) return false;
 
-    // Find the entry
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    int slot = findSlot(table, key);
+    if (slot < 0) return false;
 
-    // Place a tombstone in the entry
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    deleteSlot(table, slot);
     return true;
 }
 
@@ -138,48 +264,76 @@ bool tableDelete(Table* table, ObjString* key) {
 // adds the entry to the dest hash table using tableSet()
 void tableAddAll(VM* vm, Table* from, Table* to) {
     for (int i = 0; i < from->capacity; i++) {
-        Entry* entry = &from->entries[i];
-        if (entry->key != NULL) {
-            tableSet(vm, to, entry->key, entry->value);
+        if (IS_FULL(from->control[i])) {
+            tableSet(vm, to, from->entries[i].key, from->entries[i].value);
         }
     }
 }
 
-// similar to findEntry, but we can't use that because tableFindString() was created to find interned strings in vm.strings, which is our solution to findEntry()'s problem of comparing key strings by total equality. (Before interning, 2 strings could be textually equal but wouldn't be found to be equal b/c they'd have different locations)
-// Compare strings char-by-char here, and only here, and the rest of the VM can take advantage of that - taking for granted that any 2 strings at different addresses in memory must have different contents
+// similar to findSlot, but we can't use that because tableFindString() was created to find interned strings in vm.strings, which is our solution to findSlot()'s problem of comparing key strings by total equality. (Before interning, 2 strings could be textually equal but wouldn't be found to be equal b/c they'd have different locations)
+// Compare strings char-by-char here, and only here, and the rest of the VM can take advantage of that - taking for granted that any 2 interned strings at different addresses in memory must have different contents
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash) {
     if (table->count == 0) return NULL;
 
-    uint32_t index = hash & (table->capacity - 1);
-    for (;;) {
-        Entry* entry = &table->entries[index];
-        if (entry->key == NULL) {
-            // Stop if we find an empty non-tombstone entry.
-            if (IS_NIL(entry->value)) return NULL;
-        } else if (entry->key->length == length
-                    && entry->key->hash == hash
-                    && memcmp(entry->key->chars, chars, length) == 0) {
-            // We found it.
-            return entry->key;
+    uint32_t mask = groupMask(table->capacity);
+    uint32_t group = hash & mask;
+    uint8_t bits = HASH_BITS(hash);
+
+    for (uint32_t step = 1;; step++) {
+        const uint8_t* controls = table->control + group * GROUP_WIDTH;
+        for (uint32_t match = matchByte(controls, bits); match != 0; match &= match - 1) {
+            Entry* entry = &table->entries[group * GROUP_WIDTH + __builtin_ctz(match)];
+            if (entry->hash == hash && entry->length == length && memcmp(entry->key->chars, chars, length) == 0) {
+                // We found it.
+                return entry->key;
+            }
         }
+        // Stop once we reach a group with an empty slot
+        if (matchByte(controls, CONTROL_EMPTY) != 0) return NULL;
 
-        index = (index+1) & (table->capacity - 1);
+        group = (group + step) & mask;
     }
 }
 
 void tableRemoveWhite(Table* table) {
     for (int i = 0; i < table->capacity; i++) {
-        Entry* entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.isMarked) {
-            tableDelete(table, entry->key);
+        if (IS_FULL(table->control[i]) && !table->entries[i].key->obj.isMarked) {
+            deleteSlot(table, i);
         }
     }
 }
 
+/*
+ * The GC calls this on vm.strings once it's swept, since every collection can leave a lot of dead strings' tombstones
+ * behind in it. Without this, a long-running VM's intern table would only ever get bigger and its probes longer.
+ * - A table that's mostly empty is shrunk down to where it's about half full
+ * - Otherwise, if tombstones have taken over a quarter of its slots, they're cleared out in place
+ */
+void tableCompact(VM* vm, Table* table) {
+    if (table->capacity > 8 && table->count * 8 < table->capacity) {
+        int capacity = 8;
+        while (capacity < table->count * 2) capacity *= 2;
+
+        // allocate without going through reallocate: we're finishing up a collection, and mustn't start another one
+        size_t size = allocationSize(capacity);
+        Entry* entries = (Entry*)malloc(size);
+        if (entries == NULL) exit(1);
+        vm->bytesAllocated += size;
+
+        int oldCapacity = table->capacity;
+        Entry* oldEntries = moveEntries(table, entries, capacity);
+        reallocate(vm, oldEntries, allocationSize(oldCapacity), 0);
+    } else if (table->tombstones * 4 > table->capacity) {
+        rehashInPlace(table);
+    }
+}
+
 void markTable(VM* vm, Table* table) {
     for (int i = 0; i < table->capacity; i++) {
+        if (!IS_FULL(table->control[i])) continue;
+
         Entry* entry = &table->entries[i];
         markObject(vm,(Obj*)entry->key);
         markValue(vm, entry->value);
     }
-}
\ No newline at end of file
+}
@@ -12,13 +12,25 @@ typedef struct VM VM;
 
 typedef struct {
     ObjString* key; // keys must be a string
+    // copies of the key's hash and length, so tableFindString can rule out a candidate whose 7 hash bits matched
+    // by chance without following its key pointer, and resizing never has to follow any
+    uint32_t hash;
+    int length;
     Value value;
 } Entry;
 
+/*
+ * A "Swiss table": alongside the entries is an array of control bytes, one per entry, saying whether the entry
+ * is empty, deleted, or full, and if full, holding 7 bits of its key's hash.
+ * Lookups compare a whole group of 16 control bytes against the hash bits at once, and only look at the
+ * entries whose bits match, so probing rarely touches an entry (let alone its key) that isn't the one it wants.
+ */
 typedef struct {
-    int count;
+    int count; // live entries
+    int tombstones; // deleted entries that still take up a slot until the next rehash
     int capacity;
     Entry* entries;
+    uint8_t* control; // in the same allocation as entries, right after them
 } Table;
 
 void initTable(Table* table);
@@ -26,9 +38,11 @@ void freeTable(VM* vm, Table* table);
 bool tableGet(Table* table, ObjString* key, Value* value);
 bool tableSet(VM* vm, Table* table, ObjString* key, Value value);
 bool tableDelete(Table* table, ObjString* key);
+void tableClear(Table* table);
 void tableAddAll(VM* vm, Table* from, Table* to);
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
 void tableRemoveWhite(Table* table);
+void tableCompact(VM* vm, Table* table);
 void markTable(VM* vm, Table* table);
 
 #endif //CLOX_TABLE_H
@@ -32,42 +32,62 @@ void freeValueArray(VM* vm, ValueArray* array) {
     initValueArray(array);
 }
 
-void printValue(Value value, FILE* fd) {
+void writeValue(Output* out, Value value) {
 #ifdef NAN_BOXING
     if (IS_BOOL(value)) {
-        fprintf(fd, AS_BOOL(value) ? "true" : "false");
+        writeString(out, AS_BOOL(value) ? "true" : "false");
     } else if (IS_NIL(value)) {
-        fprintf(fd, "nil");
+        writeString(out, "nil");
     } else if (IS_NUMBER(value)) {
-        fprintf(fd, "%g", AS_NUMBER(value));
+        writeNumber(out, AS_NUMBER(value));
     } else if (IS_OBJ(value)) {
-        printObject(value, fd);
+        writeObject(out, value);
     }
 #else
     switch (value.type) {
         case VAL_BOOL:
-            fprintf(fd, AS_BOOL(value) ? "true" : "false");
+            writeString(out, AS_BOOL(value) ? "true" : "false");
             break;
-        case VAL_NIL: fprintf(fd, "nil"); break;
-        case VAL_NUMBER: fprintf(fd, "%g", AS_NUMBER(value)); break;
-        case VAL_OBJ: printObject(value, fd); break;
+        case VAL_NIL: writeString(out, "nil"); break;
+        case VAL_NUMBER: writeNumber(out, AS_NUMBER(value)); break;
+        case VAL_OBJ: writeObject(out, value); break;
     }
 #endif
 }
 
+// For everything outside the VM's print path (the disassembler, GC logging...), which just wants it on a FILE
+void printValue(Value value, FILE* fd) {
+    char buffer[256];
+    Output out;
+    initOutput(&out, fileSink(fd), FLUSH_WHEN_FULL, buffer, sizeof(buffer));
+    writeValue(&out, value);
+    flushOutput(&out);
+}
+
+// Flat strings and slices. Slices have no identity worth comparing, so they always go by their chars.
+static bool stringValuesEqual(Value a, Value b) {
+    if (IS_STRING(a) && IS_STRING(b)) return stringsEqual(AS_STRING(a), AS_STRING(b));
+    if ((!IS_STRING(a) && !IS_SLICE(a)) || (!IS_STRING(b) && !IS_SLICE(b))) return false;
+    int length = stringLength(a);
+    return length == stringLength(b) && memcmp(stringChars(a), stringChars(b), length) == 0;
+}
+
 bool valuesEqual(Value a, Value b) {
 #ifdef NAN_BOXING
     if (IS_NUMBER(a) && IS_NUMBER(b)) {
         return AS_NUMBER(a) == AS_NUMBER(b);
     }
-    return a == b;
+    if (a == b) return true;
+    return IS_OBJ(a) && IS_OBJ(b) && stringValuesEqual(a, b);
 #else
     if (a.type != b.type) return false;
     switch (a.type) {
         case VAL_BOOL:      return AS_BOOL(a) == AS_BOOL(b);
         case VAL_NIL:       return true;
         case VAL_NUMBER:    return AS_NUMBER(a) == AS_NUMBER(b);
-        case VAL_OBJ:       return AS_OBJ(a) == AS_OBJ(b);
+        case VAL_OBJ:
+            if (AS_OBJ(a) == AS_OBJ(b)) return true;
+            return stringValuesEqual(a, b);
         default:            return false; // Unreachable
     }
 #endif
@@ -9,6 +9,7 @@
 #include <string.h>
 
 #include "common.h"
+#include "output.h"
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
@@ -104,6 +105,7 @@ bool valuesEqual(Value a, Value b);
 void initValueArray(ValueArray* array);
 void writeValueArray(VM* vm, ValueArray* array, Value value);
 void freeValueArray(VM* vm, ValueArray* array);
+void writeValue(Output* out, Value value);
 void printValue(Value value, FILE* fd);
 
 
@@ -3,15 +3,17 @@
 //
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <string.h>
-#include <time.h>
 
 #include "vm.h"
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
 #include "object.h"
+#include "map.h"
 #include "memory.h"
+#include "natives.h"
 
 // This should ideally be a pointer that's passed around
 // So the host app can control when and where the VM is allocated,
@@ -20,17 +22,15 @@
 // it's a global variable
 //VM vm; // commented out b/c not needed after refactor for testing
 
-static Value clockNative(int argCount, Value* args) {
-    return NUMBER_VAL((double) clock() / CLOCKS_PER_SEC);
-}
-
 static void resetStack(VM* vm) {
     vm->stackTop = vm->stack;
     vm->frameCount = 0;
     vm->openUpvalues = NULL;
 }
 
-static void runtimeError(VM* vm, const char* format, ...) {
+void runtimeError(VM* vm, const char* format, ...) {
+    // anything the script printed before the error comes before it
+    flushOutput(&vm->out);
 
     // First, print the error msg itself
     va_list args;
@@ -58,17 +58,14 @@ static void runtimeError(VM* vm, const char* format, ...) {
     resetStack(vm);
 }
 
-static void defineNative(VM* vm, const char* name, NativeFn function) {
-    push(vm, OBJ_VAL(copyString(vm, name, (int) strlen(name))));
-    push(vm, OBJ_VAL(newNative(vm, function)));
-    tableSet(vm, &vm->globals, AS_STRING(vm->stack[0]), vm->stack[1]);
-    pop(vm);
-    pop(vm);
-}
-
 void initVM(VM* vm, FILE* fout, FILE* ferr) {
     vm->fout = fout;
     vm->ferr = ferr;
+    char* buffer = malloc(OUTPUT_BUFFER_SIZE);
+    if (buffer == NULL) exit(1);
+    initOutput(&vm->out, fileSink(fout), FLUSH_WHEN_FULL, buffer, OUTPUT_BUFFER_SIZE);
+    vm->disassemble = false;
+    vm->optimize = false;
     resetStack(vm);
     vm->objects = NULL;
     vm->bytesAllocated = 0;
@@ -77,20 +74,63 @@ void initVM(VM* vm, FILE* fout, FILE* ferr) {
     vm->grayCount = 0;
     vm->grayCapacity = 0;
     vm->grayStack = NULL;
+    vm->weakSlices = NULL;
     initTable(&vm->globals);
+    initTable(&vm->natives);
+    initTable(&vm->scripts);
     initTable(&vm->strings);
 
+    vm->parser = NULL;
     vm->initString = NULL;
     vm->initString = copyString(vm, "init", 4);
 
-    defineNative(vm, "clock", clockNative);
+    defineNatives(vm);
+}
+
+// Readies an already initialized VM to run a new, unrelated script, much more cheaply than freeVM + initVM.
+// The previous script's globals and stack are dropped, but the VM keeps its heap, its interned strings
+// (including the natives' names) and the capacity of its tables.
+// Whatever the previous script left behind is now unreachable, and gets freed by the next GC.
+void resetVM(VM* vm, FILE* fout, FILE* ferr) {
+    vm->fout = fout;
+    vm->ferr = ferr;
+    setOutputSink(vm, fileSink(fout));
+    resetStack(vm);
+    vm->parser = NULL;
+
+    tableClear(&vm->globals);
+    tableAddAll(vm, &vm->natives, &vm->globals);
 }
 
 void freeVM(VM* vm) {
     freeTable(vm, &vm->globals);
+    freeTable(vm, &vm->natives);
+    freeTable(vm, &vm->scripts);
     freeTable(vm, &vm->strings);
     vm->initString = NULL;
     freeObjects(vm);
+
+    flushOutput(&vm->out);
+    free(vm->out.buffer);
+}
+
+// Sends print's output somewhere other than fout, from now until the next resetVM. Whatever's still buffered
+// goes to the old sink first. The buffer size and flush policy stay as they were.
+void setOutputSink(VM* vm, OutputSink sink) {
+    flushOutput(&vm->out);
+    vm->out.sink = sink;
+}
+
+// A bufferSize of 0 sends every write straight to the sink
+void configureOutput(VM* vm, size_t bufferSize, FlushPolicy policy) {
+    flushOutput(&vm->out);
+    free(vm->out.buffer);
+    char* buffer = NULL;
+    if (bufferSize > 0) {
+        buffer = malloc(bufferSize);
+        if (buffer == NULL) exit(1);
+    }
+    initOutput(&vm->out, vm->out.sink, policy, buffer, bufferSize);
 }
 
 void push(VM* vm, Value value) {
@@ -161,10 +201,14 @@ static bool callValue(VM* vm, Value callee, int argCount) {
             case OBJ_FUNCTION:
                 return call(vm, AS_FUNCTION(callee), argCount);
             case OBJ_NATIVE: {
-                NativeFn native = AS_NATIVE(callee);
-                Value result = native(argCount, vm->stackTop - argCount);
-                vm->stackTop -= argCount + 1;
-                push(vm, result);
+                ObjNative* native = AS_NATIVE(callee);
+                if (native->arity >= 0 && argCount != native->arity) {
+                    runtimeError(vm, "Expected %d arguments but got %d.", native->arity, argCount);
+                    return false;
+                }
+                if (!native->function(vm, argCount, vm->stackTop - argCount)) return false;
+                // the result is in the native's own slot, now the top of the stack
+                vm->stackTop -= argCount;
                 return true;
             }
             default:
@@ -263,22 +307,57 @@ static bool isFalsey(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate(VM* vm) {
-    ObjString* b = AS_STRING(peek(vm, 0));
-    ObjString* a = AS_STRING(peek(vm, 1));
+// Checks that index is a whole number that's a valid position in something count elements long.
+// kind names the something, for the error message.
+static bool checkIndex(VM* vm, const char* kind, int count, Value index, int* result) {
+    if (!IS_NUMBER(index)) {
+        runtimeError(vm, "%s index must be a number.", kind);
+        return false;
+    }
+    double number = AS_NUMBER(index);
+    if (number < 0 || number >= count || number != (int)number) {
+        runtimeError(vm, "%s index out of range.", kind);
+        return false;
+    }
+    *result = (int)number;
+    return true;
+}
 
-    int length = a->length + b->length;
-    char* chars = ALLOCATE(vm, char, length+1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars+a->length, b->chars, b->length);
-    chars[length] = '\0';
+// Below this many chars it's cheaper to copy both sides right away than to make a rope and flatten it later
+#define ROPE_MIN_LENGTH 32
+
+static void concatenate(VM* vm) {
+    int length = stringLength(peek(vm, 0)) + stringLength(peek(vm, 1));
+    if (length >= ROPE_MIN_LENGTH) {
+        ObjRope* rope = newRope(vm, peek(vm, 1), peek(vm, 0));
+        pop(vm);
+        pop(vm);
+        push(vm, OBJ_VAL(rope));
+        return;
+    }
 
-    ObjString* result = takeString(vm, chars, length);
+    // ropes are never this short, so both sides are flat strings or slices.
+    // Their chars are only looked at after allocating, which could have detached a slice (see detachSlice).
+    ObjString* result = allocateString(vm, length);
+    int aLength = stringLength(peek(vm, 1));
+    memcpy(result->chars, stringChars(peek(vm, 1)), aLength);
+    memcpy(result->chars + aLength, stringChars(peek(vm, 0)), length - aLength);
     pop(vm);
     pop(vm);
     push(vm, OBJ_VAL(result));
 }
 
+// Equality only knows how to compare flat strings, so any rope being compared to a string is flattened
+// (in its stack slot) first. Strings of different lengths can't be equal, so those are left alone.
+static void flattenForEquality(VM* vm) {
+    Value b = peek(vm, 0);
+    Value a = peek(vm, 1);
+    if (!IS_ANY_STRING(a) || !IS_ANY_STRING(b) || stringLength(a) != stringLength(b)) return;
+
+    if (IS_ROPE(a)) vm->stackTop[-2] = OBJ_VAL(flattenRope(vm, AS_ROPE(a)));
+    if (IS_ROPE(b)) vm->stackTop[-1] = OBJ_VAL(flattenRope(vm, AS_ROPE(b)));
+}
+
 static InterpretResult run(VM* vm) {
     CallFrame* frame = &vm->frames[vm->frameCount - 1];
 
@@ -297,8 +376,30 @@ static InterpretResult run(VM* vm) {
         push(vm, valueType(a op b));                               \
     } while (false) // in a do...while loop to capture all of it and for semicolrun(on wrangling reasons
 
+// BINARY_OP for operands that are known to be numbers. Works on the stack in place.
+#define NUMBER_OP(valueType, op)                                                              \
+    do {                                                                                      \
+        vm->stackTop[-2] = valueType(AS_NUMBER(vm->stackTop[-2]) op AS_NUMBER(vm->stackTop[-1])); \
+        vm->stackTop--;                                                                       \
+    } while (false)
+
+// A comparison fused with the jump on its result: jumps if `a op b` comes out as jumpIf
+#define COMPARE_JUMP(op, jumpIf)                                   \
+    do {                                                           \
+        uint16_t offset = READ_SHORT();                            \
+        if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) {  \
+            runtimeError(vm, "Operands must be numbers.");         \
+            return INTERPRET_RUNTIME_ERROR;                        \
+        }                                                          \
+        double b = AS_NUMBER(pop(vm));                             \
+        double a = AS_NUMBER(pop(vm));                             \
+        if ((a op b) == (jumpIf)) frame->ip += offset;             \
+    } while (false)
+
 for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
+    // keep the trace and the script's own output in order
+    flushOutput(&vm->out);
     // show current contents of the stack
     fprintf(vm->fout, "          ");
     for (Value *slot = vm->stack; slot < vm->stackTop; slot++) {
@@ -421,12 +522,97 @@ for (;;) {
             }
             break;
         }
+        case OP_BUILD_LIST: {
+            int count = READ_BYTE();
+            ObjList* list = newList(vm);
+            push(vm, OBJ_VAL(list)); // keep the list safe from the GC while it's filled in
+            for (int i = count; i > 0; i--) {
+                writeValueArray(vm, &list->items, peek(vm, i));
+            }
+            vm->stackTop -= count + 1;
+            push(vm, OBJ_VAL(list));
+            break;
+        }
+        case OP_GET_INDEX: {
+            if (IS_MAP(peek(vm, 1))) {
+                // a missing key reads as nil
+                Value value;
+                if (!mapGet(vm, AS_MAP(peek(vm, 1)), peek(vm, 0), &value)) value = NIL_VAL;
+                vm->stackTop -= 2;
+                push(vm, value);
+                break;
+            }
+            if (IS_FLOAT64_ARRAY(peek(vm, 1))) {
+                ObjFloat64Array* array = AS_FLOAT64_ARRAY(peek(vm, 1));
+                int index;
+                if (!checkIndex(vm, "Float64Array", array->count, peek(vm, 0), &index)) return INTERPRET_RUNTIME_ERROR;
+                vm->stackTop -= 2;
+                push(vm, NUMBER_VAL(array->values[index]));
+                break;
+            }
+            if (!IS_LIST(peek(vm, 1))) {
+                runtimeError(vm, "Only lists, maps and Float64Arrays can be indexed.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            ObjList* list = AS_LIST(peek(vm, 1));
+            int index;
+            if (!checkIndex(vm, "List", list->items.count, peek(vm, 0), &index)) return INTERPRET_RUNTIME_ERROR;
+
+            vm->stackTop -= 2;
+            push(vm, list->items.values[index]);
+            break;
+        }
+        case OP_SET_INDEX: {
+            if (IS_MAP(peek(vm, 2))) {
+                mapSet(vm, AS_MAP(peek(vm, 2)), peek(vm, 1), peek(vm, 0));
+                Value value = pop(vm);
+                vm->stackTop -= 2;
+                push(vm, value);
+                break;
+            }
+            if (IS_FLOAT64_ARRAY(peek(vm, 2))) {
+                ObjFloat64Array* array = AS_FLOAT64_ARRAY(peek(vm, 2));
+                int index;
+                if (!checkIndex(vm, "Float64Array", array->count, peek(vm, 1), &index)) return INTERPRET_RUNTIME_ERROR;
+                if (!IS_NUMBER(peek(vm, 0))) {
+                    runtimeError(vm, "Float64Array elements must be numbers.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                Value value = pop(vm);
+                array->values[index] = AS_NUMBER(value);
+                vm->stackTop -= 2;
+                push(vm, value);
+                break;
+            }
+            if (!IS_LIST(peek(vm, 2))) {
+                runtimeError(vm, "Only lists, maps and Float64Arrays can be indexed.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            ObjList* list = AS_LIST(peek(vm, 2));
+            int index;
+            if (!checkIndex(vm, "List", list->items.count, peek(vm, 1), &index)) return INTERPRET_RUNTIME_ERROR;
+
+            // like any assignment, this leaves the assigned value on the stack
+            Value value = pop(vm);
+            list->items.values[index] = value;
+            vm->stackTop -= 2;
+            push(vm, value);
+            break;
+        }
         case OP_EQUAL: {
+            flattenForEquality(vm);
             Value b = pop(vm);
             Value a = pop(vm);
             push(vm, BOOL_VAL(valuesEqual(a, b)));
             break;
         }
+        case OP_NOT_EQUAL: {
+            flattenForEquality(vm);
+            Value b = pop(vm);
+            Value a = pop(vm);
+            push(vm, BOOL_VAL(!valuesEqual(a, b)));
+            break;
+        }
         case OP_GREATER:
             BINARY_OP(BOOL_VAL, >);
             break;
@@ -434,7 +620,7 @@ for (;;) {
             BINARY_OP(BOOL_VAL, <);
             break;
         case OP_ADD: {
-            if (IS_STRING(peek(vm, 0)) && IS_STRING(peek(vm, 1))) {
+            if (IS_ANY_STRING(peek(vm, 0)) && IS_ANY_STRING(peek(vm, 1))) {
                 concatenate(vm);
             } else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) {
                 double b = AS_NUMBER(pop(vm));
@@ -465,9 +651,31 @@ for (;;) {
             }
             push(vm, NUMBER_VAL(-AS_NUMBER(pop(vm))));
             break;
+        case OP_GREATER_NUMBER:
+            NUMBER_OP(BOOL_VAL, >);
+            break;
+        case OP_LESS_NUMBER:
+            NUMBER_OP(BOOL_VAL, <);
+            break;
+        case OP_ADD_NUMBER:
+            NUMBER_OP(NUMBER_VAL, +);
+            break;
+        case OP_SUBTRACT_NUMBER:
+            NUMBER_OP(NUMBER_VAL, -);
+            break;
+        case OP_MULTIPLY_NUMBER:
+            NUMBER_OP(NUMBER_VAL, *);
+            break;
+        case OP_DIVIDE_NUMBER:
+            NUMBER_OP(NUMBER_VAL, /);
+            break;
+        case OP_NEGATE_NUMBER:
+            vm->stackTop[-1] = NUMBER_VAL(-AS_NUMBER(vm->stackTop[-1]));
+            break;
         case OP_PRINT: {
-            printValue(pop(vm), vm->fout);
-            fprintf(vm->fout, "\n");
+            if (IS_ROPE(peek(vm, 0))) flattenRope(vm, AS_ROPE(peek(vm, 0)));
+            writeValue(&vm->out, pop(vm));
+            writeNewline(&vm->out);
             break;
         }
         case OP_JUMP: {
@@ -480,11 +688,78 @@ for (;;) {
             if (isFalsey(peek(vm, 0))) frame->ip += offset;
             break;
         }
+        case OP_JUMP_IF_TRUE: {
+            uint16_t offset = READ_SHORT();
+            if (!isFalsey(peek(vm, 0))) frame->ip += offset;
+            break;
+        }
+        case OP_POP_JUMP_IF_FALSE: {
+            uint16_t offset = READ_SHORT();
+            if (isFalsey(pop(vm))) frame->ip += offset;
+            break;
+        }
+        case OP_POP_JUMP_IF_TRUE: {
+            uint16_t offset = READ_SHORT();
+            if (!isFalsey(pop(vm))) frame->ip += offset;
+            break;
+        }
+        case OP_JUMP_IF_EQUAL:
+        case OP_JUMP_IF_NOT_EQUAL: {
+            uint16_t offset = READ_SHORT();
+            flattenForEquality(vm);
+            Value b = pop(vm);
+            Value a = pop(vm);
+            if (valuesEqual(a, b) == (instruction == OP_JUMP_IF_EQUAL)) frame->ip += offset;
+            break;
+        }
+        case OP_JUMP_IF_GREATER:
+            COMPARE_JUMP(>, true);
+            break;
+        case OP_JUMP_IF_NOT_GREATER:
+            COMPARE_JUMP(>, false);
+            break;
+        case OP_JUMP_IF_LESS:
+            COMPARE_JUMP(<, true);
+            break;
+        case OP_JUMP_IF_NOT_LESS:
+            COMPARE_JUMP(<, false);
+            break;
         case OP_LOOP: {
             uint16_t offset = READ_SHORT();
             frame->ip -= offset;
             break;
         }
+        case OP_FOR_LOOP: {
+            // The limit's on the stack, the counter stays in its slot. The operands are read in order with the checks
+            // in between, since the increment's bytes have its line and the rest have the condition's.
+            Value* counter = &frame->slots[READ_BYTE()];
+            double step = AS_NUMBER(READ_CONSTANT());
+            uint8_t arithmetic = READ_BYTE();
+            if (!IS_NUMBER(*counter)) {
+                // the body put something else in it
+                runtimeError(vm, arithmetic == OP_ADD ? "Operands must be two numbers or two strings." : "Operands must be numbers.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            double i = arithmetic == OP_ADD ? AS_NUMBER(*counter) + step : AS_NUMBER(*counter) - step;
+            *counter = NUMBER_VAL(i);
+
+            uint8_t exitTest = READ_BYTE();
+            if (!IS_NUMBER(peek(vm, 0))) {
+                runtimeError(vm, "Operands must be numbers.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            double limit = AS_NUMBER(pop(vm));
+            uint16_t offset = READ_SHORT();
+            bool exit;
+            switch (exitTest) {
+                case OP_JUMP_IF_LESS:        exit = i < limit; break;
+                case OP_JUMP_IF_NOT_LESS:    exit = !(i < limit); break;
+                case OP_JUMP_IF_GREATER:     exit = i > limit; break;
+                default:                     exit = !(i > limit); break;
+            }
+            if (!exit) frame->ip -= offset;
+            break;
+        }
         case OP_CALL: {
             int argCount = READ_BYTE();
             if (!callValue(vm, peek(vm, argCount), argCount)) {
@@ -493,6 +768,34 @@ for (;;) {
             frame = &vm->frames[vm->frameCount - 1];
             break;
         }
+        case OP_TAIL_CALL: {
+            // Calling a Lox function whose result we'd only return: nothing in this frame is needed any more, so close
+            // its upvalues, slide the callee and its arguments down over its window, and start the callee in it.
+            // Anything else, errors included, is an ordinary call, and the OP_RETURN after this returns its result.
+            int argCount = READ_BYTE();
+            Value callee = peek(vm, argCount);
+            ObjClosure* closure = NULL;
+            if (IS_CLOSURE(callee)) {
+                closure = AS_CLOSURE(callee);
+            } else if (IS_BOUND_METHOD(callee)) {
+                vm->stackTop[-argCount - 1] = AS_BOUND_METHOD(callee)->receiver;
+                closure = AS_BOUND_METHOD(callee)->method;
+            }
+            if (closure == NULL || closure->function->arity != argCount) {
+                if (!callValue(vm, callee, argCount)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                frame = &vm->frames[vm->frameCount - 1];
+                break;
+            }
+
+            closeUpvalues(vm, frame->slots);
+            memmove(frame->slots, vm->stackTop - argCount - 1, sizeof(Value) * (argCount + 1));
+            vm->stackTop = frame->slots + argCount + 1;
+            frame->closure = closure;
+            frame->ip = closure->function->chunk.code;
+            break;
+        }
         case OP_INVOKE: {
             ObjString* method = READ_STRING();
             int argCount = READ_BYTE();
@@ -578,17 +881,50 @@ for (;;) {
 #undef READ_CONSTANT
 #undef READ_STRING
 #undef BINARY_OP
+#undef NUMBER_OP
+#undef COMPARE_JUMP
 }
 
-InterpretResult interpret(VM* vm, const char* source) {
-    ObjFunction* function = compile(vm, source);
-    if (function == NULL) return INTERPRET_COMPILE_ERROR;
-
+// Runs a top-level function returned by compile() or compileAndCache()
+InterpretResult interpretFunction(VM* vm, ObjFunction* function) {
     push(vm, OBJ_VAL(function));
     ObjClosure* closure = newClosure(vm, function);
     pop(vm);
     push(vm, OBJ_VAL(closure));
     call(vm, closure, 0);
 
-    return run(vm);
-}
\ No newline at end of file
+    InterpretResult result = run(vm);
+    flushOutput(&vm->out);
+    return result;
+}
+InterpretResult interpret(VM* vm, const char* source) {
+    ObjFunction* function = compile(vm, source);
+    if (function == NULL) return INTERPRET_COMPILE_ERROR;
+
+    return interpretFunction(vm, function);
+}
+
+// Returns the function compileAndCache() compiled under key, or NULL if there isn't one
+ObjFunction* cachedScript(VM* vm, const char* key) {
+    ObjString* name = tableFindString(&vm->strings, key, (int)strlen(key), hashString(key, (int)strlen(key)));
+    Value function;
+    if (name == NULL || !tableGet(&vm->scripts, name, &function)) return NULL;
+    return AS_FUNCTION(function);
+}
+
+// Compiles source and remembers the resulting function under key (the source itself, say), for hosts that run the same scripts over and over.
+// Cached scripts survive resetVM. Returns NULL on a compile error.
+ObjFunction* compileAndCache(VM* vm, const char* key, const char* source) {
+    ObjFunction* function = compile(vm, source);
+    if (function == NULL) return NULL;
+
+    // forget everything rather than let a long-lived VM accumulate stale scripts forever
+    if (vm->scripts.count >= SCRIPT_CACHE_MAX) tableClear(&vm->scripts);
+
+    push(vm, OBJ_VAL(function));
+    push(vm, OBJ_VAL(copyString(vm, key, (int)strlen(key))));
+    tableSet(vm, &vm->scripts, AS_STRING(peek(vm, 0)), peek(vm, 1));
+    pop(vm);
+    pop(vm);
+    return function;
+}
@@ -12,8 +12,10 @@
 
 #define FRAMES_MAX 64
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+#define SCRIPT_CACHE_MAX 256
 
 // Forward declarations
+struct Parser;
 struct ObjFunction;
 struct ObjClosure;
 struct ObjUpvalue;
@@ -37,6 +39,15 @@ typedef struct VM {
     FILE* fout;
     FILE* ferr;
 
+    // everything print writes goes through here (see output.h). Starts out writing to fout.
+    Output out;
+
+    // print each function's bytecode as it's compiled, before and after optimizeFunction (clox --disassemble)
+    bool disassemble;
+
+    // run the whole-function passes (see passes.h) on everything compiled, not just the peephole pass (clox -O)
+    bool optimize;
+
     CallFrame frames[FRAMES_MAX];
     int frameCount;
 
@@ -47,11 +58,20 @@ typedef struct VM {
 
     Table globals;
 
+    // every native function, by name, so resetVM can put them back into a cleared globals
+    Table natives;
+
+    // top-level functions compiled by compileAndCache, by key. Unlike globals, these survive resetVM
+    Table scripts;
+
     // A table to store strings for string interning (deduplication, as in, not duplicated) purposes
     Table strings;
 
     ObjString* initString;
 
+    // the compilation in progress, if any, so the GC can mark the functions it's building
+    struct Parser* parser;
+
     struct ObjUpvalue* openUpvalues;
 
     size_t bytesAllocated;
@@ -63,6 +83,9 @@ typedef struct VM {
     int grayCount;
     int grayCapacity;
     Obj** grayStack;
+
+    // slices found during a collection that hold their parent only weakly (see blackenObject)
+    struct ObjSlice* weakSlices;
 } VM;
 
 typedef enum {
@@ -74,9 +97,16 @@ typedef enum {
 //extern VM vm;
 
 void initVM(VM* vm, FILE* fout, FILE* ferr);
+void resetVM(VM* vm, FILE* fout, FILE* ferr);
 void freeVM(VM* vm);
+void setOutputSink(VM* vm, OutputSink sink);
+void configureOutput(VM* vm, size_t bufferSize, FlushPolicy policy);
 InterpretResult interpret(VM* vm, const char* source);
+InterpretResult interpretFunction(VM* vm, struct ObjFunction* function);
+struct ObjFunction* cachedScript(VM* vm, const char* key);
+struct ObjFunction* compileAndCache(VM* vm, const char* key, const char* source);
 void push(VM* vm, Value value);
 Value pop(VM* vm);
+void runtimeError(VM* vm, const char* format, ...);
 
 #endif //CLOX_VM_H